@@ -0,0 +1,455 @@
+#include "Database.h"
+#include "AsyncEngine.h"
+#include "MysqlBackend.h"
+
+#if defined(LIBMARIADB) && defined(__linux__)
+#define ASYNC_ENGINE_SUPPORTED
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <chrono>
+#include <deque>
+#endif
+
+enum AsyncSlotState
+{
+    SLOT_QUERY,
+    SLOT_STORE
+};
+
+struct AsyncEngine::Slot
+{
+    Slot(DatabaseConnection& connection, const uint32 lane) :
+        conn(connection),
+        uiLane(lane),
+        lock(connection.m_mutex, std::defer_lock),
+        eState(SLOT_QUERY),
+        uiStatement(0),
+        iError(0),
+        pResult(nullptr),
+        bWaiting(false),
+        iDeadlineMs(-1),
+        iStartUs(0)
+    {}
+
+    DatabaseConnection& conn;
+
+    // Index in the Database's pool, also its DatabaseMetrics lane.
+    uint32 uiLane;
+
+    // Held while an object runs, so blocking callers borrowing this connection wait for it.
+    std::unique_lock<std::mutex> lock;
+
+    std::shared_ptr<QueryObj> pCurrent;
+    std::vector<std::string> vStatements;
+    AsyncSlotState eState;
+    size_t uiStatement;
+    int iError;
+    MYSQL_RES* pResult;
+
+    // Objects routed here that haven't started, by priority.
+    QueryLanes pending;
+
+    // True while registered with epoll for an operation in progress.
+    bool bWaiting;
+
+    // Steady clock ms at which to call back with MYSQL_WAIT_TIMEOUT, -1 for none.
+    int64 iDeadlineMs;
+
+    // When the statement in flight was sent.
+    int64 iStartUs;
+};
+
+#ifdef ASYNC_ENGINE_SUPPORTED
+
+static int64 NowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void AsyncEngine::ReportBacklog(Slot& slot)
+{
+    if (!slot.conn.m_pMetrics)
+        return;
+
+    slot.conn.m_pMetrics->SetLaneBacklog(slot.uiLane, slot.pending);
+}
+
+AsyncEngine::AsyncEngine(Database& db, std::vector<std::unique_ptr<DatabaseConnection>>& vConnections) :
+    m_db(db),
+    m_bStopping(false),
+    m_iEpoll(-1),
+    m_iWakeFd(-1)
+{
+    for (size_t i = 0; i < vConnections.size(); ++i)
+        m_vSlots.push_back(std::unique_ptr<Slot>(new Slot(*vConnections[i], uint32(i))));
+}
+
+AsyncEngine::~AsyncEngine()
+{
+    Stop();
+
+    if (m_iWakeFd != -1)
+        close(m_iWakeFd);
+
+    if (m_iEpoll != -1)
+        close(m_iEpoll);
+}
+
+bool AsyncEngine::isSupported()
+{
+    return true;
+}
+
+bool AsyncEngine::Start()
+{
+    m_iEpoll = epoll_create1(EPOLL_CLOEXEC);
+    m_iWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (m_iEpoll == -1 || m_iWakeFd == -1)
+    {
+        printf("AsyncEngine::Start - Could not create epoll or eventfd.");
+        return false;
+    }
+
+    // A null ptr marks the wake up fd, every other registration points at its Slot.
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(m_iEpoll, EPOLL_CTL_ADD, m_iWakeFd, &event);
+
+    m_thread = std::thread(&AsyncEngine::Run, this);
+    return true;
+}
+
+void AsyncEngine::Stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutexIncoming);
+        m_bStopping = true;
+    }
+
+    Wake();
+    m_thread.join();
+}
+
+void AsyncEngine::Push(std::shared_ptr<QueryObj> pObj)
+{
+    bool bWasEmpty;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutexIncoming);
+        bWasEmpty = m_vIncoming.empty();
+        m_vIncoming.push_back(std::move(pObj));
+    }
+
+    // The engine takes everything at once, one wake up per batch is enough.
+    if (bWasEmpty)
+        Wake();
+}
+
+void AsyncEngine::Wake()
+{
+    uint64 uiOne = 1;
+
+    if (write(m_iWakeFd, &uiOne, sizeof(uiOne)) != sizeof(uiOne))
+        printf("AsyncEngine::Wake - Could not signal the engine thread.");
+}
+
+void AsyncEngine::Run()
+{
+    QueueLimiter::MarkWorkerThread();
+
+    std::vector<std::shared_ptr<QueryObj>> vIncoming;
+    std::vector<std::vector<std::shared_ptr<QueryObj>>> vRouted(m_vSlots.size());
+    epoll_event events[64];
+
+    while (true)
+    {
+        bool bStopping;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutexIncoming);
+            vIncoming.swap(m_vIncoming);
+            bStopping = m_bStopping;
+        }
+
+        // Same routing as the worker threads, one connection per shard key.
+        for (size_t i = 0; i < vIncoming.size(); ++i)
+            vRouted[vIncoming[i]->getShardKey() % m_vSlots.size()].push_back(std::move(vIncoming[i]));
+
+        if (!vIncoming.empty())
+        {
+            for (size_t i = 0; i < m_vSlots.size(); ++i)
+            {
+                m_vSlots[i]->pending.Add(m_db, vRouted[i]);
+                ReportBacklog(*m_vSlots[i]);
+            }
+        }
+
+        vIncoming.clear();
+
+        bool bBusy = false;
+        bool bLockWait = false;
+        int64 iNextDeadline = -1;
+
+        for (size_t i = 0; i < m_vSlots.size(); ++i)
+        {
+            Slot& slot = *m_vSlots[i];
+
+            if (!slot.pCurrent)
+                TryStartNext(slot);
+
+            if (slot.pCurrent || !slot.pending.empty())
+                bBusy = true;
+
+            // Something to do but a blocking caller has the connection, look again soon.
+            if (!slot.pCurrent && !slot.pending.empty())
+                bLockWait = true;
+
+            if (slot.bWaiting && slot.iDeadlineMs != -1 && (iNextDeadline == -1 || slot.iDeadlineMs < iNextDeadline))
+                iNextDeadline = slot.iDeadlineMs;
+        }
+
+        // Anything queued before Stop still runs.
+        if (bStopping && !bBusy)
+            break;
+
+        int iTimeout = -1;
+
+        if (iNextDeadline != -1)
+            iTimeout = int(std::max<int64>(0, iNextDeadline - NowMs()));
+
+        if (bLockWait && (iTimeout == -1 || iTimeout > 1))
+            iTimeout = 1;
+
+        const int iCount = epoll_wait(m_iEpoll, events, 64, iTimeout);
+
+        for (int i = 0; i < iCount; ++i)
+        {
+            Slot* pSlot = static_cast<Slot*>(events[i].data.ptr);
+
+            if (!pSlot)
+            {
+                // Only needs emptying, Push and Stop are picked up at the top of the loop.
+                uint64 uiValue;
+                while (read(m_iWakeFd, &uiValue, sizeof(uiValue)) > 0) {}
+                continue;
+            }
+
+            if (!pSlot->bWaiting)
+                continue;
+
+            // Errors and hang ups are read by the library, which reports them.
+            int iStatus = 0;
+
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                iStatus |= MYSQL_WAIT_READ;
+
+            if (events[i].events & EPOLLOUT)
+                iStatus |= MYSQL_WAIT_WRITE;
+
+            if (events[i].events & EPOLLPRI)
+                iStatus |= MYSQL_WAIT_EXCEPT;
+
+            pSlot->bWaiting = false;
+            Advance(*pSlot, iStatus);
+
+            if (!pSlot->pCurrent)
+                TryStartNext(*pSlot);
+        }
+
+        if (iNextDeadline != -1)
+        {
+            const int64 iNow = NowMs();
+
+            for (size_t i = 0; i < m_vSlots.size(); ++i)
+            {
+                Slot& slot = *m_vSlots[i];
+
+                if (slot.bWaiting && slot.iDeadlineMs != -1 && slot.iDeadlineMs <= iNow)
+                {
+                    slot.bWaiting = false;
+                    Advance(slot, MYSQL_WAIT_TIMEOUT);
+
+                    if (!slot.pCurrent)
+                        TryStartNext(slot);
+                }
+            }
+        }
+    }
+
+    printf("AsyncEngine::Run end.\n");
+}
+
+void AsyncEngine::TryStartNext(Slot& slot)
+{
+    uint32 uiWeights[DB_PRIORITY_COUNT];
+    m_db.getPriorityWeights(uiWeights);
+
+    while (!slot.pCurrent && !slot.pending.empty())
+    {
+        if (!slot.lock.owns_lock() && !slot.lock.try_lock())
+            return;
+
+        std::shared_ptr<QueryObj> pObj = slot.pending.Next(uiWeights);
+
+        if (slot.conn.m_pMetrics)
+            slot.conn.m_pMetrics->RecordQueueWait(uint64(DatabaseMetrics::NowUs() - pObj->m_iQueuedUs));
+
+        ReportBacklog(slot);
+
+        slot.vStatements.clear();
+
+        if (pObj->GetStatements(slot.vStatements))
+        {
+            slot.pCurrent = std::move(pObj);
+            slot.uiStatement = 0;
+            slot.eState = SLOT_QUERY;
+            Advance(slot, 0);
+        }
+        else
+        {
+            // Blocks the engine for this one object, the blocking API still works on a non-blocking handle.
+            //  The engine sends single statements itself, so multi statements can't stay on after it.
+            pObj->RunQuery(m_db, slot.conn);
+            slot.conn.SetMultiStatements(false);
+        }
+    }
+
+    // Give blocking callers a chance at the connection between objects.
+    if (!slot.pCurrent && slot.lock.owns_lock())
+        slot.lock.unlock();
+}
+
+void AsyncEngine::Advance(Slot& slot, int iStatus)
+{
+    // Runs statements until one has to wait on the socket or the object is done.
+    // iStatus is what the socket became ready for, or 0 to start the next step.
+    MYSQL* pMysql = slot.conn.getMysql();
+
+    while (slot.pCurrent)
+    {
+        // Done, whoever called us starts the next object.
+        if (slot.uiStatement >= slot.vStatements.size())
+        {
+            std::shared_ptr<QueryObj> pDone = std::move(slot.pCurrent);
+            pDone->OnStatementsDone(m_db);
+            return;
+        }
+
+        const std::string& strQuery = slot.vStatements[slot.uiStatement];
+
+        if (slot.eState == SLOT_QUERY)
+        {
+            if (iStatus)
+            {
+                iStatus = mysql_real_query_cont(&slot.iError, pMysql, iStatus);
+            }
+            else
+            {
+                slot.iStartUs = DatabaseMetrics::NowUs();
+                iStatus = mysql_real_query_start(&slot.iError, pMysql, strQuery.c_str(), (unsigned long)strQuery.size());
+            }
+
+            if (iStatus)
+            {
+                Wait(slot, iStatus);
+                return;
+            }
+
+            if (slot.iError)
+            {
+                printf("SQL Error: '%s'.", mysql_error(pMysql));
+                printf("Query: '%s'.", strQuery.c_str());
+                slot.conn.RecordQuery(strQuery, slot.iStartUs, false);
+                slot.conn.CheckReconnect();
+                slot.pCurrent->OnStatementResult(slot.uiStatement++, nullptr);
+            }
+            else if (!mysql_field_count(pMysql))
+            {
+                slot.conn.NotifyWrite(strQuery);
+                slot.conn.RecordQuery(strQuery, slot.iStartUs, true);
+                slot.pCurrent->OnStatementResult(slot.uiStatement++, nullptr);
+            }
+            else
+            {
+                slot.eState = SLOT_STORE;
+            }
+        }
+        else
+        {
+            if (iStatus)
+                iStatus = mysql_store_result_cont(&slot.pResult, pMysql, iStatus);
+            else
+                iStatus = mysql_store_result_start(&slot.pResult, pMysql);
+
+            if (iStatus)
+            {
+                Wait(slot, iStatus);
+                return;
+            }
+
+            MYSQL_RES* pResult = slot.pResult;
+            slot.pResult = nullptr;
+            slot.eState = SLOT_QUERY;
+
+            std::shared_ptr<QueryResult> result = MysqlBackend::WrapResult(pMysql, pResult, slot.conn.m_pMetrics);
+            slot.conn.RecordQuery(strQuery, slot.iStartUs, true);
+            slot.pCurrent->OnStatementResult(slot.uiStatement++, result);
+        }
+    }
+}
+
+void AsyncEngine::Wait(Slot& slot, int iStatus)
+{
+    const int iFd = mysql_get_socket(slot.conn.getMysql());
+
+    epoll_event event;
+    event.events = EPOLLONESHOT;
+    event.data.ptr = &slot;
+
+    if (iStatus & MYSQL_WAIT_READ)
+        event.events |= EPOLLIN;
+
+    if (iStatus & MYSQL_WAIT_WRITE)
+        event.events |= EPOLLOUT;
+
+    if (iStatus & MYSQL_WAIT_EXCEPT)
+        event.events |= EPOLLPRI;
+
+    // One shot, so each wait re-arms the registration. The first wait (or the first on a new socket after a reconnect) adds it.
+    if (epoll_ctl(m_iEpoll, EPOLL_CTL_MOD, iFd, &event) != 0)
+        epoll_ctl(m_iEpoll, EPOLL_CTL_ADD, iFd, &event);
+
+    slot.iDeadlineMs = (iStatus & MYSQL_WAIT_TIMEOUT) ? NowMs() + mysql_get_timeout_value_ms(slot.conn.getMysql()) : -1;
+    slot.bWaiting = true;
+}
+
+#else
+
+AsyncEngine::AsyncEngine(Database& db, std::vector<std::unique_ptr<DatabaseConnection>>& vConnections) :
+    m_db(db),
+    m_bStopping(false),
+    m_iEpoll(-1),
+    m_iWakeFd(-1)
+{}
+
+AsyncEngine::~AsyncEngine() {}
+
+bool AsyncEngine::isSupported() { return false; }
+bool AsyncEngine::Start() { return false; }
+void AsyncEngine::Stop() {}
+void AsyncEngine::Push(std::shared_ptr<QueryObj> pObj) {}
+void AsyncEngine::Wake() {}
+void AsyncEngine::Run() {}
+void AsyncEngine::TryStartNext(Slot& slot) {}
+void AsyncEngine::Advance(Slot& slot, int iStatus) {}
+void AsyncEngine::Wait(Slot& slot, int iStatus) {}
+void AsyncEngine::ReportBacklog(Slot& slot) {}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef ASYNCENGINE_H
+#define ASYNCENGINE_H
+
+#include "DatabaseConnection.h"
+#include "QueryObjects.h"
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Drives every connection of a Database from one thread, using MariaDB's non-blocking client API
+// (mysql_real_query_start/_cont, mysql_store_result_start/_cont) with epoll. Each connection has
+// one query in flight, so with N connections N queries are in flight at once without N threads.
+//
+// Queued objects keep the same ordering as the worker threads give: all objects with the same shard
+// key go to the same connection, in the order they were pushed within their priority (see QueryLanes). Objects that can't describe
+// themselves as plain statements (prepared statements, transactions) run through the blocking API
+// on the engine thread, which MariaDB allows on a non-blocking connection.
+//
+// Only available when built against MariaDB Connector/C on Linux, see isSupported().
+class AsyncEngine
+{
+    public:
+        AsyncEngine(Database& db, std::vector<std::unique_ptr<DatabaseConnection>>& vConnections);
+        ~AsyncEngine();
+
+        static bool isSupported();
+
+        bool Start();
+
+        // Runs whatever is still queued, then ends the thread.
+        void Stop();
+
+        void Push(std::shared_ptr<QueryObj> pObj);
+
+    private:
+        struct Slot;
+
+        void Run();
+        void Wake();
+        void TryStartNext(Slot& slot);
+        void Advance(Slot& slot, int iStatus);
+        void Wait(Slot& slot, int iStatus);
+
+        // Tells the metrics how much is routed to slot but not started yet.
+        void ReportBacklog(Slot& slot);
+
+        Database& m_db;
+        std::vector<std::unique_ptr<Slot>> m_vSlots;
+
+        // Pushed objects waiting for the engine thread to pick them up.
+        std::mutex m_mutexIncoming;
+        std::vector<std::shared_ptr<QueryObj>> m_vIncoming;
+        bool m_bStopping;
+
+        int m_iEpoll;
+
+        // Written to wake the engine thread when something is pushed or on Stop.
+        int m_iWakeFd;
+
+        std::thread m_thread;
+};
+
+#endif
\ No newline at end of file
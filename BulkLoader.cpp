@@ -0,0 +1,135 @@
+#include "Database.h"
+#include "BulkLoader.h"
+
+void BulkLoadState::OnChunkDone(const bool bSuccess, const uint64 rows)
+{
+    bool bReport;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        --uiInFlight;
+        uiRowsLoaded += rows;
+        bFailed |= !bSuccess;
+        bReport = bFinished && !uiInFlight;
+    }
+
+    // Wakes a loader waiting for room.
+    condition.notify_all();
+
+    if (bReport && fnOnComplete)
+        fnOnComplete(!bFailed, uiRowsLoaded);
+}
+
+void BulkLoadState::OnFinished()
+{
+    bool bReport;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        bFinished = true;
+        bReport = !uiInFlight;
+    }
+
+    if (bReport && fnOnComplete)
+        fnOnComplete(!bFailed, uiRowsLoaded);
+}
+
+BulkLoader::BulkLoader(Database& db, std::shared_ptr<BulkLoadState> pState, const uint64 shardKey, const size_t chunkBytes, const uint32 maxInFlight) :
+    m_db(db),
+    m_pState(pState),
+    m_uiShardKey(shardKey),
+    m_uiChunkBytes(chunkBytes),
+    m_uiMaxInFlight(maxInFlight),
+    m_uiChunkRows(0),
+    m_uiRows(0)
+{
+    ASSERT(maxInFlight > 0);
+
+    // The last row can go a bit past it.
+    m_strChunk.reserve(m_uiChunkBytes + m_uiChunkBytes / 8);
+}
+
+BulkLoader::~BulkLoader()
+{
+    Finish();
+}
+
+void BulkLoader::AppendEscaped(const char* value, const size_t length)
+{
+    const char* pEnd = value + length;
+    const char* pRun = value;
+
+    for (const char* pCurrent = value; pCurrent != pEnd; ++pCurrent)
+    {
+        char cEscape;
+
+        switch (*pCurrent)
+        {
+            case '\\': cEscape = '\\'; break;
+            case '\t': cEscape = 't'; break;
+            case '\n': cEscape = 'n'; break;
+            case '\r': cEscape = 'r'; break;
+            case '\0': cEscape = '0'; break;
+            default: continue;
+        }
+
+        m_strChunk.append(pRun, pCurrent - pRun);
+        m_strChunk += '\\';
+        m_strChunk += cEscape;
+        pRun = pCurrent + 1;
+    }
+
+    m_strChunk.append(pRun, pEnd - pRun);
+    m_strChunk += '\t';
+}
+
+void BulkLoader::EndRow()
+{
+    ASSERT(m_pState);
+
+    // Every field ends in a tab, the last one's becomes the end of the line.
+    if (!m_strChunk.empty() && m_strChunk.back() == '\t')
+        m_strChunk.back() = '\n';
+    else
+        m_strChunk += '\n';
+
+    ++m_uiChunkRows;
+    ++m_uiRows;
+
+    if (m_strChunk.size() >= m_uiChunkBytes)
+        QueueChunk();
+}
+
+void BulkLoader::QueueChunk()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_pState->mutex);
+        m_pState->condition.wait(lock, [this] { return m_pState->uiInFlight < m_uiMaxInFlight; });
+        ++m_pState->uiInFlight;
+    }
+
+    // The chunk goes with the object, the next one starts from an empty buffer of the same size.
+    std::shared_ptr<BulkLoadObj> pObj = std::make_shared<BulkLoadObj>(m_pState, m_strChunk, m_uiShardKey);
+
+    m_strChunk.clear();
+    m_strChunk.reserve(m_uiChunkBytes + m_uiChunkBytes / 8);
+    m_uiChunkRows = 0;
+
+    // Turned away by the queue limits, it counts as a chunk that failed.
+    if (!m_db.PushQuery(pObj))
+        m_pState->OnChunkDone(false, 0);
+}
+
+void BulkLoader::Finish()
+{
+    if (!m_pState)
+        return;
+
+    if (m_uiChunkRows)
+        QueueChunk();
+
+    m_pState->OnFinished();
+    m_pState.reset();
+}
@@ -0,0 +1,191 @@
+#ifndef BULKLOADER_H
+#define BULKLOADER_H
+
+#include "QueryMapping.h"
+
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+class Database;
+
+// What a BulkLoader and the chunks it queued share. Chunks finish on the worker thread.
+struct BulkLoadState
+{
+    BulkLoadState(const std::string& statement, std::function<void(bool, uint64)> onComplete) :
+        strStatement(statement),
+        fnOnComplete(onComplete),
+        uiInFlight(0),
+        uiRowsLoaded(0),
+        bFinished(false),
+        bFailed(false)
+    {}
+
+    // Called by each chunk once it ran.
+    void OnChunkDone(const bool bSuccess, const uint64 rows);
+
+    // Called once nothing else is coming, reports right away if every chunk already ran.
+    void OnFinished();
+
+    const std::string strStatement;
+    std::function<void(bool, uint64)> fnOnComplete;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    uint32 uiInFlight;
+    uint64 uiRowsLoaded;
+    bool bFinished;
+    bool bFailed;
+};
+
+// Rows for one LOAD DATA LOCAL INFILE, see Database::BeginBulkLoad. Not thread-safe, fill it from one thread.
+// Rows are written in LOAD DATA's tab separated text into a chunk. Each full chunk is queued as its own load,
+// so memory stays at about chunk size times the chunks allowed in flight, however many rows there are.
+// Once that many are queued, adding rows blocks until one of them ran. Don't fill it from a worker thread, it could wait on itself.
+// Every chunk commits on its own: if one fails the others are still loaded, onComplete is told false and how many rows made it.
+class BulkLoader
+{
+    friend class Database;
+
+    public:
+        // Finishes if Finish wasn't called.
+        ~BulkLoader();
+
+        // One value for each column given to BeginBulkLoad, in order. Numbers, enums, bool, strings,
+        //  and nullptr or an empty std::optional (or a null const char*) for NULL.
+        template <class... Args>
+        void addRow(const Args&... args)
+        {
+            (appendField(args), ...);
+            EndRow();
+        }
+
+        // The members bound in DbMapping<T>, for a loader from beginMappedBulkLoad<T>.
+        template <class T>
+        void addObject(const T& row)
+        {
+            std::apply([this, &row](const auto&... columns) { (appendField(row.*(columns.pMember)), ...); }, DbMapping<T>::columns());
+            EndRow();
+        }
+
+        // Queues what's left. onComplete is called (on a worker thread, or here if they all ran already) once every chunk is done.
+        void Finish();
+
+        // Added so far.
+        uint64 getRowCount() const { return m_uiRows; }
+
+        // "`a`,`b`" from the names bound in DbMapping<T>.
+        template <class T>
+        static std::string mappedColumns()
+        {
+            std::string strColumns;
+
+            std::apply([&strColumns](const auto&... columns)
+            {
+                ((strColumns += strColumns.empty() ? "`" : ",`", strColumns += columns.szName, strColumns += '`'), ...);
+            }, DbMapping<T>::columns());
+
+            return strColumns;
+        }
+
+    private:
+        BulkLoader(Database& db, std::shared_ptr<BulkLoadState> pState, const uint64 shardKey, const size_t chunkBytes, const uint32 maxInFlight);
+
+        // With LOAD DATA's escapes: backslash, tab, newline, carriage return and NUL.
+        void AppendEscaped(const char* value, const size_t length);
+        void AppendNull() { m_strChunk += "\\N\t"; }
+
+        // Ends the row, queues the chunk if it's full.
+        void EndRow();
+
+        // Waits for room, then queues the chunk.
+        void QueueChunk();
+
+        template <class T>
+        struct isOptional : std::false_type {};
+
+        template <class T>
+        struct isOptional<std::optional<T>> : std::true_type {};
+
+        template <class T>
+        struct DependentFalse : std::false_type {};
+
+        template <class T>
+        void appendField(const T& value)
+        {
+            typedef typename std::decay<T>::type Type;
+
+            if constexpr (std::is_same<Type, bool>::value)
+            {
+                m_strChunk += value ? "1\t" : "0\t";
+            }
+            else if constexpr (std::is_enum<Type>::value)
+            {
+                appendField(static_cast<typename std::underlying_type<Type>::type>(value));
+            }
+            else if constexpr (std::is_arithmetic<Type>::value)
+            {
+                if constexpr (std::is_floating_point<Type>::value)
+                {
+                    if (!std::isfinite(value))
+                    {
+                        AppendNull();
+                        return;
+                    }
+                }
+
+                char szNumber[32];
+                std::to_chars_result res = std::to_chars(szNumber, szNumber + sizeof(szNumber), value);
+                m_strChunk.append(szNumber, res.ptr - szNumber);
+                m_strChunk += '\t';
+            }
+            else if constexpr (std::is_same<Type, const char*>::value || std::is_same<Type, char*>::value)
+            {
+                if (value)
+                    AppendEscaped(value, strlen(value));
+                else
+                    AppendNull();
+            }
+            else if constexpr (std::is_same<Type, std::string>::value || std::is_same<Type, std::string_view>::value)
+            {
+                AppendEscaped(value.data(), value.size());
+            }
+            else if constexpr (std::is_same<Type, std::nullptr_t>::value)
+            {
+                AppendNull();
+            }
+            else if constexpr (isOptional<Type>::value)
+            {
+                if (value)
+                    appendField(*value);
+                else
+                    AppendNull();
+            }
+            else
+            {
+                static_assert(DependentFalse<Type>::value, "BulkLoader can't write this type, convert it first.");
+            }
+        }
+
+        Database& m_db;
+        std::shared_ptr<BulkLoadState> m_pState;
+
+        const uint64 m_uiShardKey;
+        const size_t m_uiChunkBytes;
+        const uint32 m_uiMaxInFlight;
+
+        std::string m_strChunk;
+        uint64 m_uiChunkRows;
+        uint64 m_uiRows;
+};
+
+#endif
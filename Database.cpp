@@ -1,357 +1,1234 @@
-#include "Database.h"
-
-#include <ctime>
-#include <iostream>
-#include <fstream>
-
-// Keep track of how many database connections the 
-size_t Database::m_stDatabaseCount = 0;
-
-Database::Database() : 
-    m_pMYSQL(nullptr),
-    m_bQueriesTransaction(false),
-    m_bCancelToken(false),
-    m_bInit(false)
-{
-    
-}
-
-Database::~Database()
-{
-    Uninitialise();
-}
-
-bool Database::Uninitialise()
-{
-    if (!m_bInit)
-        return false;
-
-    m_bCancelToken = true;
-
-    // Wait for the work thread to finish.
-    m_threadWorker.join();
-
-    if (m_pMYSQL)
-        mysql_close(m_pMYSQL);
-
-    // Free MYSQL library pointers for last ~DB
-    if (--m_stDatabaseCount == 0)
-        mysql_library_end();
-
-    m_pMYSQL = nullptr;
-    m_bInit = false;
-    return true;
-}
-
-bool Database::Initialize(const char* infoString)
-{
-    m_bInit = true;
-
-    // Before first connection
-    if (m_stDatabaseCount++ == 0)
-    {
-        mysql_library_init(-1, NULL, NULL);
-
-        if (!mysql_thread_safe())
-        {
-            printf("Database::Initialize - Used MySQL library isn't thread-safe.");
-            return false;
-        }
-    }
-
-    m_threadWorker = std::thread(&Database::WorkerThread, this);
-
-    MYSQL* pMyqlInit = mysql_init(NULL);
-
-    if (!pMyqlInit)
-    {
-        printf("Database::Initialize - Could not initialize Mysql connection");
-        return false;
-    }
-        
-    std::string strHost;
-    std::string strPortOrSocket;
-    std::string strUser;
-    std::string strPassword;
-    std::string strDbName;
-
-    std::istringstream ss(infoString);
-
-    if (!std::getline(ss, strHost, ';') ||
-        !std::getline(ss, strPortOrSocket, ';') ||
-        !std::getline(ss, strUser, ';') ||
-        !std::getline(ss, strPassword, ';') ||
-        !std::getline(ss, strDbName, ';'))
-
-    {
-        printf("Database::Initialize - Bad infoString, format should be 'host;port;user;pw;dbname'.");
-        return false;
-    }
-
-    mysql_options(pMyqlInit, MYSQL_SET_CHARSET_NAME, "utf8");
-    
-    int32 port = 0;
-
-    // Named pipe use option (Windows)
-    if (strHost == ".") 
-    {
-        uint32 opt = MYSQL_PROTOCOL_PIPE;
-        mysql_options(pMyqlInit, MYSQL_OPT_PROTOCOL, (char const*)&opt);
-        port = 0;
-    }
-
-    // Generic case
-    else
-    {
-        port = atoi(strPortOrSocket.c_str());
-    }
-
-    m_pMYSQL = mysql_real_connect(pMyqlInit, strHost.c_str(), strUser.c_str(), strPassword.c_str(), strDbName.c_str(), port, NULL, 0);
-
-    if (m_pMYSQL)
-    {
-        mysql_autocommit(m_pMYSQL, 1);
-
-        QueueExecuteQuery("SET NAMES `utf8`");
-        QueueExecuteQuery("SET CHARACTER SET `utf8`");
-
-        static uint32 minMysqlVersion = 50003;
-
-        if (MYSQL_VERSION_ID < minMysqlVersion)
-        {
-            printf("Database::Initialize - Your MySQL is out of date. Your have %d when a minimum of %d is required.", MYSQL_VERSION_ID, minMysqlVersion);
-            return false;
-        }
-
-        my_bool my_true = (my_bool)1;
-        mysql_options(m_pMYSQL, MYSQL_OPT_RECONNECT, &my_true);
-        return true;
-    }
-    else
-    {
-        printf("Database::Initialize - Could not connect to MySQL database %s at %s\n", strDbName.c_str(),strHost.c_str());
-        mysql_close(pMyqlInit);
-        return false;
-    }
-}
-
-void Database::WorkerThread()
-{
-    // Cycle until m_bCancelToken variable is set to false.
-    //  However, we will also wait until we've finished emptying m_queueQueries. 
-    //  Anything in that queue expected itself to be finished.
-
-    while (true)
-    {
-        // New list every loop, don't store outside of scope.
-        std::vector<std::shared_ptr<QueryObj>> queries;
-
-        // Grab all pending queries.
-        if (m_queueQueries.popAll(queries))
-        {
-            std::lock_guard<std::mutex> lock(m_mutexMysql);
-
-            // Do every query.
-            while (!queries.empty())
-            {
-                QueryObj* pObj = (*queries.begin()).get();
-                pObj->RunQuery(*this);
-                queries.erase(queries.begin());
-            }
-        }
-        else
-        {
-            if (m_bCancelToken)
-                break;
-
-            // Don't be a racing thread.
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-    }
-
-    printf("Database::WorkerThread end.\n");
-}
-
-std::shared_ptr<QueryResult> Database::Query(const char* format, ...)
-{
-    if (!format || !m_pMYSQL)
-        return std::shared_ptr<QueryResult>(NULL);
-
-    std::string strQuery;
-    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
-    return LockedPerformQuery(strQuery);
-}
-
-int32 Database::QueryInt32(const char* format, ...)
-{
-    if (!format || !m_pMYSQL)
-        return 0;
-
-    std::string strQuery;
-    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
-
-    if (std::shared_ptr<QueryResult> result = LockedPerformQuery(strQuery))
-    {
-        DbField* pFields = result->fetchCurrentRow();
-        return pFields[0].getInt32();
-    }
-
-    return 0;
-}
-
-std::shared_ptr<QueryResult> Database::LockedPerformQuery(const std::string strQuery)
-{
-    std::lock_guard<std::mutex> lock(m_mutexMysql);
-    return PerformQuery(strQuery);    
-}
-
-std::shared_ptr<QueryResult> Database::PerformQuery(const std::string strQuery)
-{
-    ASSERT(m_pMYSQL);
-    
-    if (!RawMysqlQueryCall(strQuery))
-        return nullptr;
-
-    MYSQL_RES* pResult = mysql_store_result(m_pMYSQL);
-
-    if (!pResult)
-        return nullptr;
-
-    uint64 uiNumRows = mysql_affected_rows(m_pMYSQL);
-
-    if (!uiNumRows)
-    {
-        mysql_free_result(pResult);
-        return nullptr;
-    }
-
-    uint32 uiNumFields = mysql_field_count(m_pMYSQL);
-
-    if (!uiNumFields)
-    {
-        mysql_free_result(pResult);
-        return nullptr;
-    }
-
-    return std::make_shared<QueryResult>(pResult, mysql_fetch_fields(pResult), uiNumRows, uiNumFields);
-}
-
-void Database::BeginManyQueries()
-{
-    ASSERT(!m_bQueriesTransaction);
-    m_bQueriesTransaction = true;
-}
-
-void Database::CommitManyQueries()
-{
-    std::vector<std::shared_ptr<QueryObj>> result;
-
-    for (size_t i = 0; i < m_vTransactionQueries.size(); ++i)
-        result.push_back(std::make_shared<QueryObj>(m_vTransactionQueries[i]));
-
-    // We anticipate that 
-    m_queueQueries.pushMany(result);
-
-    m_vTransactionQueries.clear();
-    m_bQueriesTransaction = false;
-}
-
-void Database::CancelManyQueries()
-{
-    m_vTransactionQueries.clear();
-    m_bQueriesTransaction = false;
-}
-
-bool Database::ExecuteQueryInstant(const char* format, ...)
-{
-    if (!format || !m_pMYSQL)
-        return false;
-    
-    std::string strQuery;
-    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
-
-    std::lock_guard<std::mutex> lock(m_mutexMysql);
-    return RawMysqlQueryCall(strQuery, true);
-}
-
-bool Database::QueueExecuteQuery(const char*  format,...)
-{
-    if (!format || !m_pMYSQL)
-        return false;
-    
-    std::string strQuery;
-    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
-
-    if (m_bQueriesTransaction)
-    {
-        m_vTransactionQueries.push_back(strQuery);
-    }
-    else
-    {
-        ASSERT(!strQuery.empty());
-        m_queueQueries.push(std::make_shared<QueryObj>(strQuery));
-    }
-
-    return true;
-}
-
-bool Database::RawMysqlQueryCall(const std::string strQuery, const bool bDeleteGatheredData)
-{    
-    ASSERT(m_pMYSQL);
-
-    if (mysql_query(m_pMYSQL, strQuery.c_str()))
-    {
-        printf("SQL Error: '%s'.", mysql_error(m_pMYSQL));
-        printf("Query: '%s'.", strQuery.c_str());
-        return false;
-    }
-
-    if (bDeleteGatheredData)
-    {
-        if (MYSQL_RES* pResult = mysql_store_result(m_pMYSQL))
-            mysql_free_result(pResult);
-    }
-
-    return true;
-}
-
-void Database::Ping()
-{
-    QueueExecuteQuery("SELECT 1");
-}
-
-void Database::EscapeString(std::string& str)
-{
-    if (str.empty() || !m_pMYSQL)
-        return;
-
-    char strResult[MAX_QUERY_LEN];
-    ASSERT(str.size() < MAX_QUERY_LEN);
-    
-    mysql_real_escape_string(m_pMYSQL, strResult, str.c_str(), str.size());
-    
-    // Copy result.
-    str = strResult;
-}
-
-void Database::CallbackResult(const uint64 id, std::shared_ptr<CallbackQueryObj::ResultQueryHolder> result)
-{
-    std::lock_guard<std::mutex> lock(m_mutexCallbackQueries);
-    
-    auto itr = m_uoCallbackQueries.find(id);
-
-    if (itr != m_uoCallbackQueries.end())
-    {
-        printf("Database::CallbackResult - Id already exists, deleting old one.");
-        m_uoCallbackQueries.erase(itr);
-    }
-
-    m_uoCallbackQueries[id] = result;
-}
-
-void Database::GrabAndClearCallbackQueries(std::unordered_map<uint64, std::shared_ptr<CallbackQueryObj::ResultQueryHolder>>& result)
-{
-    std::lock_guard<std::mutex> lock(m_mutexCallbackQueries);
-    result = m_uoCallbackQueries;
-    m_uoCallbackQueries.clear();
-}
\ No newline at end of file
+#include "Database.h"
+#include "AsyncEngine.h"
+
+#include <ctime>
+#include <iostream>
+#include <fstream>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+// Keep track of how many database connections the 
+size_t Database::m_stDatabaseCount = 0;
+
+Database::Database() : 
+    m_bInit(false),
+    m_bQueriesTransaction(false),
+    m_bCoalesceInserts(false),
+    m_uiCoalesceMaxBytes(0),
+    m_uiBulkChunkBytes(4 * 1024 * 1024),
+    m_uiBulkMaxInFlight(4),
+    m_pWriteBehind(new WriteBehind(*this)),
+    m_pQueueLimiter(new QueueLimiter(*this)),
+    m_uiNextConnection(0),
+    m_uiNextReplica(0),
+    m_eReadPolicy(DB_READ_ROUND_ROBIN),
+    m_uiMaxReplicaLagMs(5000),
+    m_eReadYourWrites(DB_RYW_OFF),
+    m_uiReadYourWritesMs(1000),
+    m_pKeyWrites(new DbWriteWindow[DB_RYW_KEY_SLOTS]),
+    m_iCallbackEventFd(-1)
+{
+    SetPriorityWeights(16, 4, 1);
+}
+
+Database::~Database()
+{
+    Uninitialise();
+
+#ifdef __linux__
+    if (m_iCallbackEventFd >= 0)
+        close(m_iCallbackEventFd);
+#endif
+}
+
+bool Database::Uninitialise()
+{
+    if (!m_bInit)
+        return false;
+
+    // Row writes still waiting go in the queues before they're drained.
+    m_pWriteBehind->Stop();
+
+    // Spilled SQL is queued again, in order, as the workers make room.
+    m_pQueueLimiter->Stop();
+
+    // Runs what's queued, then stops.
+    if (m_pEngine)
+    {
+        m_pEngine->Stop();
+        m_pEngine.reset();
+    }
+
+    // Wake the workers, they finish what's queued and then stop.
+    for (size_t i = 0; i < m_vQueueQueries.size(); ++i)
+        m_vQueueQueries[i]->shutdown();
+
+    // Wait for the work threads to finish.
+    for (size_t i = 0; i < m_vThreadWorkers.size(); ++i)
+        m_vThreadWorkers[i].join();
+
+    // Everything queued is done by now, unless it failed on a lost connection.
+    if (m_pSpool)
+        m_pSpool->Close();
+
+    m_vThreadWorkers.clear();
+    m_vQueueQueries.clear();
+    m_vConnections.clear();
+    m_vReplicas.clear();
+
+    // Free MYSQL library pointers for last ~DB
+    if (--m_stDatabaseCount == 0)
+        mysql_library_end();
+
+    m_bInit = false;
+    return true;
+}
+
+bool Database::Initialize(const char* infoString, const uint32 poolSize, const DatabaseExecutionMode mode)
+{
+    ASSERT(poolSize > 0);
+
+    if (m_bInit)
+        return false;
+
+    if (mode == DB_EXECUTION_EVENT_LOOP && !AsyncEngine::isSupported())
+    {
+        printf("Database::Initialize - The event loop mode needs MariaDB Connector/C on Linux.");
+        return false;
+    }
+
+    m_bInit = true;
+
+    // Before first connection
+    if (m_stDatabaseCount++ == 0)
+    {
+        mysql_library_init(-1, NULL, NULL);
+
+        if (!mysql_thread_safe())
+        {
+            printf("Database::Initialize - Used MySQL library isn't thread-safe.");
+            return false;
+        }
+    }
+        
+    std::string strHost;
+    std::string strPortOrSocket;
+    std::string strUser;
+    std::string strPassword;
+    std::string strDbName;
+
+    if (!ParseInfoString(infoString, strHost, strPortOrSocket, strUser, strPassword, strDbName))
+        return false;
+
+    // A lane per worker queue, or per connection of the event loop.
+    m_metrics.SetLanes(poolSize);
+
+    for (uint32 i = 0; i < poolSize; ++i)
+    {
+        std::unique_ptr<DatabaseConnection> pConn(new DatabaseConnection(m_fnBackendFactory ? m_fnBackendFactory() : nullptr));
+
+        if (!pConn->Open(strHost, strPortOrSocket, strUser, strPassword, strDbName, mode == DB_EXECUTION_EVENT_LOOP))
+        {
+            m_vConnections.clear();
+            return false;
+        }
+
+        if (mode == DB_EXECUTION_EVENT_LOOP && !pConn->getMysql())
+        {
+            printf("Database::Initialize - The event loop mode needs the MySQL backend.");
+            m_vConnections.clear();
+            return false;
+        }
+
+        pConn->m_pCache = &m_cache;
+        pConn->m_pMetrics = &m_metrics;
+        m_vConnections.push_back(std::move(pConn));
+
+        if (mode == DB_EXECUTION_THREADS)
+            m_vQueueQueries.push_back(std::unique_ptr<SafeQueue<std::shared_ptr<QueryObj>>>(new SafeQueue<std::shared_ptr<QueryObj>>()));
+    }
+
+    if (mode == DB_EXECUTION_EVENT_LOOP)
+    {
+        m_pEngine.reset(new AsyncEngine(*this, m_vConnections));
+
+        if (!m_pEngine->Start())
+        {
+            m_pEngine.reset();
+            m_vConnections.clear();
+            return false;
+        }
+    }
+    else
+    {
+        // Only start working once every connection is open, workers index into the vectors above.
+        for (uint32 i = 0; i < poolSize; ++i)
+            m_vThreadWorkers.push_back(std::thread(&Database::WorkerThread, this, i));
+    }
+
+    // Replays what a crash left undone, so it needs somewhere to run.
+    if (m_pSpool && !m_pSpool->Open())
+    {
+        Uninitialise();
+        return false;
+    }
+
+    return true;
+}
+
+bool Database::ParseInfoString(const char* infoString, std::string& strHost, std::string& strPortOrSocket, std::string& strUser, std::string& strPassword, std::string& strDbName)
+{
+    std::istringstream ss(infoString);
+
+    if (!std::getline(ss, strHost, ';') ||
+        !std::getline(ss, strPortOrSocket, ';') ||
+        !std::getline(ss, strUser, ';') ||
+        !std::getline(ss, strPassword, ';') ||
+        !std::getline(ss, strDbName, ';'))
+
+    {
+        printf("Database::ParseInfoString - Bad infoString, format should be 'host;port;user;pw;dbname'.");
+        return false;
+    }
+
+    return true;
+}
+
+bool Database::AddReplica(const char* infoString, const uint32 poolSize)
+{
+    ASSERT(poolSize > 0);
+
+    if (m_vConnections.empty())
+    {
+        printf("Database::AddReplica - Initialize first.");
+        return false;
+    }
+
+    std::string strHost;
+    std::string strPortOrSocket;
+    std::string strUser;
+    std::string strPassword;
+    std::string strDbName;
+
+    if (!ParseInfoString(infoString, strHost, strPortOrSocket, strUser, strPassword, strDbName))
+        return false;
+
+    std::unique_ptr<Replica> pReplica(new Replica());
+
+    for (uint32 i = 0; i < poolSize; ++i)
+    {
+        std::unique_ptr<DatabaseConnection> pConn(new DatabaseConnection(m_fnBackendFactory ? m_fnBackendFactory() : nullptr));
+
+        if (!pConn->Open(strHost, strPortOrSocket, strUser, strPassword, strDbName))
+            return false;
+
+        pConn->m_pCache = &m_cache;
+        pConn->m_pMetrics = &m_metrics;
+        pReplica->vConnections.push_back(std::move(pConn));
+    }
+
+    // Nothing goes to it before its lag is known.
+    RefreshReplicaLag(*pReplica, DatabaseMetrics::NowUs());
+    m_vReplicas.push_back(std::move(pReplica));
+    return true;
+}
+
+void Database::RefreshReplicaLag(Replica& replica, const int64 iNowUs)
+{
+    int64 iCheckedUs = replica.iCheckedUs;
+
+    // Whoever swaps the time in does the check, everyone else keeps going with the last one.
+    if (iNowUs - iCheckedUs < DB_REPLICA_LAG_CHECK_US || !replica.iCheckedUs.compare_exchange_strong(iCheckedUs, iNowUs))
+        return;
+
+    for (size_t i = 0; i < replica.vConnections.size(); ++i)
+    {
+        DatabaseConnection& conn = *replica.vConnections[i];
+        std::unique_lock<std::mutex> lock(conn.m_mutex, std::try_to_lock);
+
+        // Busy connections are still answering, try again next time.
+        if (!lock.owns_lock())
+            continue;
+
+        std::shared_ptr<const QueryResultStorage> pStorage;
+        uint32 uiFieldCount = 0;
+
+        if (!replica.bLegacyStatus && !conn.PerformQueryToStorage("SHOW REPLICA STATUS", pStorage, uiFieldCount))
+            replica.bLegacyStatus = true;
+
+        if (replica.bLegacyStatus && !conn.PerformQueryToStorage("SHOW SLAVE STATUS", pStorage, uiFieldCount))
+        {
+            replica.iLagMs = -1;
+            return;
+        }
+
+        // No rows: not replicating from anything, so never behind.
+        if (!pStorage || pStorage->vCells.empty())
+        {
+            replica.iLagMs = 0;
+            return;
+        }
+
+        QueryResult result(pStorage, uiFieldCount);
+        int32 iColumn = result.getColumnIndex("Seconds_Behind_Source");
+
+        if (iColumn < 0)
+            iColumn = result.getColumnIndex("Seconds_Behind_Master");
+
+        if (iColumn < 0)
+        {
+            printf("Database::RefreshReplicaLag - The replica status has no Seconds_Behind_Source column.");
+            replica.iLagMs = -1;
+            return;
+        }
+
+        // NULL while replication is stopped.
+        const DbField& field = result[iColumn];
+        replica.iLagMs = field.isNull() ? -1 : field.getInt64() * 1000;
+        return;
+    }
+}
+
+void Database::WorkerThread(const uint32 index)
+{
+    // Sleep until something is queued, cycle until our queue is shut down.
+    //  However, we will also wait until we've finished emptying our queue. 
+    //  Anything in that queue expected itself to be finished.
+
+    DatabaseConnection& conn = *m_vConnections[index];
+    SafeQueue<std::shared_ptr<QueryObj>>& queue = *m_vQueueQueries[index];
+
+    QueueLimiter::MarkWorkerThread();
+
+    // Reused every loop, it swaps buffers with the queue so popping doesn't allocate.
+    std::vector<std::shared_ptr<QueryObj>> queries;
+
+    QueryLanes lanes;
+    uint32 uiWeights[DB_PRIORITY_COUNT];
+
+    while (true)
+    {
+        // Wait for, then grab, all pending queries.
+        if (!queue.waitPopAll(queries))
+            break;
+
+        TakeQueries(index, conn, queries, lanes);
+        getPriorityWeights(uiWeights);
+
+        const int64 iWaitStartUs = DatabaseMetrics::NowUs();
+        std::lock_guard<std::mutex> lock(conn.m_mutex);
+        m_metrics.RecordWorkerLockWait(uint64(DatabaseMetrics::NowUs() - iWaitStartUs));
+
+        // Do every query, letting go of each as soon as it's done.
+        while (std::shared_ptr<QueryObj> pObj = lanes.Next(uiWeights))
+        {
+            m_metrics.RecordQueueWait(uint64(DatabaseMetrics::NowUs() - pObj->m_iQueuedUs));
+            m_metrics.SetLaneBacklog(index, lanes);
+
+            // Reads only use a replica that's idle right now, the worker's own connection is as good as waiting.
+            std::unique_lock<std::mutex> replicaLock;
+            DatabaseConnection* pReplica = pObj->m_bReplicaRead ? BorrowReplica(replicaLock, false) : nullptr;
+
+            pObj->RunQuery(*this, pReplica ? *pReplica : conn);
+            pObj.reset();
+
+            // Whatever was queued meanwhile gets its turn now, not after everything taken before it.
+            if (queue.popAll(queries))
+                TakeQueries(index, conn, queries, lanes);
+        }
+    }
+
+    printf("Database::WorkerThread %u end.\n", index);
+}
+
+void Database::TakeQueries(const uint32 index, DatabaseConnection& conn, std::vector<std::shared_ptr<QueryObj>>& queries, QueryLanes& lanes)
+{
+    if (m_bCoalesceInserts)
+    {
+        // Leave some room for the packet header.
+        const size_t uiMaxBytes = size_t(std::min<uint64>(m_uiCoalesceMaxBytes, conn.getMaxAllowedPacket() - 1024));
+        CoalescedInsertObj::Coalesce(queries, uiMaxBytes);
+    }
+
+    lanes.Add(*this, queries);
+    m_metrics.SetLaneBacklog(index, lanes);
+}
+
+bool Database::PushQuery(std::shared_ptr<QueryObj> pObj)
+{
+    pObj->m_iQueuedUs = DatabaseMetrics::NowUs();
+    DbPriorityScope::getPriority(pObj->m_ePriority);
+
+    if (m_pSpool)
+        m_pSpool->Record(*pObj);
+
+    if (!m_pQueueLimiter->Admit(pObj))
+        return false;
+
+    // Spilled, the limiter queues it once there's room.
+    if (pObj)
+        EnqueueQuery(std::move(pObj));
+
+    return true;
+}
+
+// The calling thread's writes, for DB_RYW_CALLER. Shared with the ones it queued, which may outlive it.
+static const std::shared_ptr<DbWriteWindow>& CallerWrites()
+{
+    static thread_local std::shared_ptr<DbWriteWindow> t_pWrites(new DbWriteWindow());
+    return t_pWrites;
+}
+
+void Database::EnqueueQuery(std::shared_ptr<QueryObj> pObj)
+{
+    // Decided here, the read-your-writes window belongs to whoever queued it.
+    //  The event loop runs every queued read on the primary, but its writes still hold blocking reads there.
+    if (!m_vReplicas.empty())
+    {
+        if (pObj->isRead(*this))
+            pObj->m_bReplicaRead = !m_pEngine && !ReadsPrimary(pObj->getShardKey());
+        else if (DbWriteWindow* pWindow = FindWriteWindow(pObj->getShardKey()))
+        {
+            // Open until it's done, the window after it starts when it's destroyed.
+            pWindow->uiPending.fetch_add(1, std::memory_order_relaxed);
+
+            if (pWindow == CallerWrites().get())
+                pObj->m_pWriteWindow = CallerWrites();
+            else
+                pObj->m_pWriteWindow = std::shared_ptr<DbWriteWindow>(m_pKeyWrites, pWindow);
+        }
+    }
+
+    if (m_pEngine)
+    {
+        m_pEngine->Push(std::move(pObj));
+        return;
+    }
+
+    ASSERT(!m_vQueueQueries.empty());
+    const size_t uiQueue = pObj->getShardKey() % m_vQueueQueries.size();
+    m_vQueueQueries[uiQueue]->push(std::move(pObj));
+}
+
+DatabaseConnection& Database::BorrowConnection(std::unique_lock<std::mutex>& lock)
+{
+    ASSERT(!m_vConnections.empty());
+
+    const uint32 uiCount = uint32(m_vConnections.size());
+    const uint32 uiStart = m_uiNextConnection++ % uiCount;
+
+    for (uint32 i = 0; i < uiCount; ++i)
+    {
+        DatabaseConnection& conn = *m_vConnections[(uiStart + i) % uiCount];
+        lock = std::unique_lock<std::mutex>(conn.m_mutex, std::try_to_lock);
+
+        if (lock.owns_lock())
+        {
+            m_metrics.RecordCallerLockWait(0);
+            return conn;
+        }
+    }
+
+    // Everyone is busy, wait in line on the one we started at.
+    const int64 iWaitStartUs = DatabaseMetrics::NowUs();
+
+    DatabaseConnection& conn = *m_vConnections[uiStart];
+    lock = std::unique_lock<std::mutex>(conn.m_mutex);
+
+    m_metrics.RecordCallerLockWait(uint64(DatabaseMetrics::NowUs() - iWaitStartUs));
+    return conn;
+}
+
+DatabaseConnection* Database::BorrowReplica(std::unique_lock<std::mutex>& lock, const bool bWait)
+{
+    const DbReadPolicy ePolicy = m_eReadPolicy;
+
+    if (m_vReplicas.empty() || ePolicy == DB_READ_PRIMARY)
+        return nullptr;
+
+    const int64 iNowUs = DatabaseMetrics::NowUs();
+    const int64 iMaxLagMs = m_uiMaxReplicaLagMs;
+
+    const uint32 uiCount = uint32(m_vReplicas.size());
+    const uint32 uiStart = m_uiNextReplica++ % uiCount;
+
+    // Round robin: the first usable one in turn. Least lag: the one furthest along.
+    Replica* pChosen = nullptr;
+
+    for (uint32 i = 0; i < uiCount; ++i)
+    {
+        Replica& replica = *m_vReplicas[(uiStart + i) % uiCount];
+        RefreshReplicaLag(replica, iNowUs);
+
+        const int64 iLagMs = replica.iLagMs;
+
+        if (iLagMs < 0 || iLagMs > iMaxLagMs)
+            continue;
+
+        if (!pChosen || (ePolicy == DB_READ_LEAST_LAG && iLagMs < pChosen->iLagMs))
+            pChosen = &replica;
+
+        if (ePolicy != DB_READ_ROUND_ROBIN)
+            continue;
+
+        // Any idle connection will do, otherwise wait on the first usable replica below.
+        for (size_t j = 0; j < replica.vConnections.size(); ++j)
+        {
+            DatabaseConnection& conn = *replica.vConnections[j];
+            lock = std::unique_lock<std::mutex>(conn.m_mutex, std::try_to_lock);
+
+            if (lock.owns_lock())
+            {
+                m_metrics.RecordReplicaRead();
+                return &conn;
+            }
+        }
+    }
+
+    if (!pChosen)
+    {
+        m_metrics.RecordReplicaFallback();
+        return nullptr;
+    }
+
+    const uint32 uiConnections = uint32(pChosen->vConnections.size());
+    const uint32 uiFirst = pChosen->uiNextConnection++ % uiConnections;
+
+    for (uint32 i = 0; i < uiConnections; ++i)
+    {
+        DatabaseConnection& conn = *pChosen->vConnections[(uiFirst + i) % uiConnections];
+        lock = std::unique_lock<std::mutex>(conn.m_mutex, std::try_to_lock);
+
+        if (lock.owns_lock())
+        {
+            m_metrics.RecordReplicaRead();
+            return &conn;
+        }
+    }
+
+    if (!bWait)
+    {
+        m_metrics.RecordReplicaFallback();
+        return nullptr;
+    }
+
+    const int64 iWaitStartUs = DatabaseMetrics::NowUs();
+
+    DatabaseConnection& conn = *pChosen->vConnections[uiFirst];
+    lock = std::unique_lock<std::mutex>(conn.m_mutex);
+
+    m_metrics.RecordCallerLockWait(uint64(DatabaseMetrics::NowUs() - iWaitStartUs));
+    m_metrics.RecordReplicaRead();
+    return &conn;
+}
+
+DatabaseConnection& Database::BorrowQueryConnection(std::unique_lock<std::mutex>& lock, const bool bRead)
+{
+    if (m_vReplicas.empty())
+        return BorrowConnection(lock);
+
+    if (!bRead)
+        NoteWrite(0);
+    else if (!ReadsPrimary(0))
+    {
+        if (DatabaseConnection* pReplica = BorrowReplica(lock, true))
+            return *pReplica;
+    }
+
+    return BorrowConnection(lock);
+}
+
+DbWriteWindow* Database::FindWriteWindow(const uint64 key) const
+{
+    switch (m_eReadYourWrites)
+    {
+        case DB_RYW_CALLER:
+            return CallerWrites().get();
+        case DB_RYW_KEY:
+            return &m_pKeyWrites[key % DB_RYW_KEY_SLOTS];
+        default:
+            return nullptr;
+    }
+}
+
+bool Database::ReadsPrimary(const uint64 key) const
+{
+    const DbWriteWindow* pWindow = FindWriteWindow(key);
+
+    if (!pWindow)
+        return false;
+
+    if (pWindow->uiPending.load(std::memory_order_acquire))
+        return true;
+
+    const int64 iWriteUs = pWindow->iLastUs.load(std::memory_order_relaxed);
+    return iWriteUs && DatabaseMetrics::NowUs() - iWriteUs < int64(m_uiReadYourWritesMs) * 1000;
+}
+
+void Database::NoteWrite(const uint64 key)
+{
+    if (DbWriteWindow* pWindow = FindWriteWindow(key))
+        pWindow->iLastUs.store(DatabaseMetrics::NowUs(), std::memory_order_relaxed);
+}
+
+// True if str at i is word, any run of whitespace in str matching a space in word.
+static bool MatchWordNoCase(const char* str, const char* word)
+{
+    for (; *word; ++word)
+    {
+        if (*word == ' ')
+        {
+            if (!isspace(uint8(*str)))
+                return false;
+
+            while (isspace(uint8(*str)))
+                ++str;
+        }
+        else if (toupper(uint8(*str++)) != *word)
+        {
+            return false;
+        }
+    }
+
+    return !isalnum(uint8(*str)) && *str != '_';
+}
+
+bool Database::isReadQuery(const char* query)
+{
+    ASSERT(query);
+
+    // Skip what can come before the verb: whitespace, comments and the brackets of "(SELECT ...) UNION ...".
+    while (*query)
+    {
+        if (isspace(uint8(*query)) || *query == '(')
+            ++query;
+        else if (query[0] == '/' && query[1] == '*' && strstr(query + 2, "*/"))
+            query = strstr(query + 2, "*/") + 2;
+        else
+            break;
+    }
+
+    if (!MatchWordNoCase(query, "SELECT") && !MatchWordNoCase(query, "SHOW") && !MatchWordNoCase(query, "DESC") &&
+        !MatchWordNoCase(query, "DESCRIBE") && !MatchWordNoCase(query, "EXPLAIN"))
+        return false;
+
+    // Reads that lock rows or depend on the connection's session have to stay on the primary, workers rely on the latter.
+    static const char* const szPrimaryOnly[] = { "FOR UPDATE", "FOR SHARE", "LOCK IN SHARE MODE", "INTO", "LAST_INSERT_ID", "FOUND_ROWS",
+                                                 "ROW_COUNT", "GET_LOCK", "RELEASE_LOCK", "RELEASE_ALL_LOCKS", "IS_USED_LOCK", "IS_FREE_LOCK" };
+
+    char cQuote = 0;
+
+    for (const char* pCurrent = query; *pCurrent; ++pCurrent)
+    {
+        if (cQuote)
+        {
+            if (*pCurrent == '\\' && pCurrent[1])
+                ++pCurrent;
+            else if (*pCurrent == cQuote)
+                cQuote = 0;
+
+            continue;
+        }
+
+        if (*pCurrent == '\'' || *pCurrent == '"' || *pCurrent == '`')
+        {
+            cQuote = *pCurrent;
+            continue;
+        }
+
+        // User variables live in the session too.
+        if (*pCurrent == '@')
+            return false;
+
+        if (pCurrent != query && (isalnum(uint8(pCurrent[-1])) || pCurrent[-1] == '_'))
+            continue;
+
+        for (size_t i = 0; i < sizeof(szPrimaryOnly) / sizeof(szPrimaryOnly[0]); ++i)
+        {
+            if (MatchWordNoCase(pCurrent, szPrimaryOnly[i]))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+std::shared_ptr<QueryResult> Database::Query(const char* format, ...)
+{
+    if (!format || m_vConnections.empty())
+        return std::shared_ptr<QueryResult>(NULL);
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+    return LockedPerformQuery(strQuery);
+}
+
+int32 Database::QueryInt32(const char* format, ...)
+{
+    if (!format || m_vConnections.empty())
+        return 0;
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    if (std::shared_ptr<QueryResult> result = LockedPerformQuery(strQuery))
+    {
+        DbField* pFields = result->fetchCurrentRow();
+        return pFields[0].getInt32();
+    }
+
+    return 0;
+}
+
+// Handler that fulfills a promise, so the future versions can share the callback path.
+static AsyncQueryObj::ResultHandler MakePromiseHandler(std::future<std::shared_ptr<QueryResult>>& future)
+{
+    std::shared_ptr<std::promise<std::shared_ptr<QueryResult>>> pPromise = std::make_shared<std::promise<std::shared_ptr<QueryResult>>>();
+    future = pPromise->get_future();
+    return [pPromise](std::shared_ptr<QueryResult> result) { pPromise->set_value(result); };
+}
+
+std::future<std::shared_ptr<QueryResult>> Database::QueryAsync(const char* format, ...)
+{
+    std::future<std::shared_ptr<QueryResult>> future;
+    AsyncQueryObj::ResultHandler fnHandler = MakePromiseHandler(future);
+
+    if (!format || m_vConnections.empty())
+    {
+        fnHandler(nullptr);
+        return future;
+    }
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    if (!PushAsyncQuery(strQuery, fnHandler, nullptr, 0))
+        fnHandler(nullptr);
+
+    return future;
+}
+
+bool Database::QueryAsyncThen(AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const char* format, ...)
+{
+    if (!format || m_vConnections.empty())
+        return false;
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    return PushAsyncQuery(strQuery, onResult, executor, 0);
+}
+
+std::future<std::shared_ptr<QueryResult>> Database::QueryShardedAsync(const uint64 shardKey, const char* format, ...)
+{
+    std::future<std::shared_ptr<QueryResult>> future;
+    AsyncQueryObj::ResultHandler fnHandler = MakePromiseHandler(future);
+
+    if (!format || m_vConnections.empty())
+    {
+        fnHandler(nullptr);
+        return future;
+    }
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    if (!PushAsyncQuery(strQuery, fnHandler, nullptr, shardKey))
+        fnHandler(nullptr);
+
+    return future;
+}
+
+bool Database::QueryShardedAsyncThen(const uint64 shardKey, AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const char* format, ...)
+{
+    if (!format || m_vConnections.empty())
+        return false;
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    return PushAsyncQuery(strQuery, onResult, executor, shardKey);
+}
+
+bool Database::PushAsyncQuery(const std::string& strQuery, AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const uint64 shardKey)
+{
+    return PushQuery(std::make_shared<AsyncQueryObj>(strQuery, onResult, executor, shardKey));
+}
+
+std::future<std::shared_ptr<QueryResult>> Database::QueryStatementAsync(const PreparedStatement& stmt, const uint64 shardKey)
+{
+    std::future<std::shared_ptr<QueryResult>> future;
+    AsyncQueryObj::ResultHandler fnHandler = MakePromiseHandler(future);
+
+    if (m_vConnections.empty() || !PushQuery(std::make_shared<AsyncQueryObj>(stmt, fnHandler, nullptr, shardKey)))
+        fnHandler(nullptr);
+
+    return future;
+}
+
+bool Database::QueryStatementAsyncThen(const PreparedStatement& stmt, AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const uint64 shardKey)
+{
+    return !m_vConnections.empty() && PushQuery(std::make_shared<AsyncQueryObj>(stmt, onResult, executor, shardKey));
+}
+
+std::shared_ptr<QueryResult> Database::CachedQuery(const uint32 ttlMs, const char* tags, const char* format, ...)
+{
+    if (!format || m_vConnections.empty())
+        return nullptr;
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    if (!m_cache.isEnabled())
+        return LockedPerformQuery(strQuery);
+
+    std::shared_ptr<const QueryResultStorage> pStorage;
+    uint32 uiFieldCount = 0;
+    uint64 uiGeneration = 0;
+
+    if (!m_cache.Find(strQuery, pStorage, uiFieldCount, uiGeneration))
+    {
+        std::shared_ptr<const QueryResultStorage> pFresh;
+
+        {
+            std::unique_lock<std::mutex> lock;
+
+            if (!BorrowConnection(lock).PerformQueryToStorage(strQuery, pFresh, uiFieldCount))
+                return nullptr;
+        }
+
+        // No rows is worth remembering too.
+        m_cache.Insert(strQuery, pFresh, uiFieldCount, ttlMs, tags, uiGeneration);
+        pStorage = pFresh;
+    }
+
+    if (!pStorage)
+        return nullptr;
+
+    return std::make_shared<QueryResult>(pStorage, uiFieldCount);
+}
+
+std::shared_ptr<QueryResult> Database::CachedQueryStatement(const PreparedStatement& stmt, const uint32 ttlMs, const char* tags)
+{
+    if (m_vConnections.empty())
+        return nullptr;
+
+    if (!m_cache.isEnabled())
+        return QueryStatement(stmt);
+
+    const std::string strKey = QueryCache::MakeStatementKey(stmt);
+
+    std::shared_ptr<const QueryResultStorage> pStorage;
+    uint32 uiFieldCount = 0;
+    uint64 uiGeneration = 0;
+
+    if (m_cache.Find(strKey, pStorage, uiFieldCount, uiGeneration))
+        return pStorage ? std::make_shared<QueryResult>(pStorage, uiFieldCount) : nullptr;
+
+    std::shared_ptr<QueryResult> result;
+
+    {
+        std::unique_lock<std::mutex> lock;
+
+        if (!BorrowConnection(lock).ExecuteStatement(*this, stmt, &result))
+            return nullptr;
+    }
+
+    // Statement results are already copied out, the cache shares the same rows.
+    if (result)
+        m_cache.Insert(strKey, result->getStorage(), result->getFieldCount(), ttlMs, tags, uiGeneration);
+    else
+        m_cache.Insert(strKey, nullptr, 0, ttlMs, tags, uiGeneration);
+
+    return result;
+}
+
+std::unique_ptr<QueryStream> Database::StreamQuery(const char* format, ...)
+{
+    streamError() = 0;
+
+    if (!format || m_vConnections.empty())
+        return nullptr;
+
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    std::unique_lock<std::mutex> lock;
+    DatabaseConnection& conn = BorrowQueryConnection(lock, !m_vReplicas.empty() && isReadQuery(strQuery.c_str()));
+
+    MYSQL_RES* pResult = conn.PerformStreamQuery(strQuery);
+
+    if (!pResult)
+    {
+        // A backend that can't stream has no error number of its own, CR_UNKNOWN_ERROR stands in.
+        streamError() = conn.getMysql() ? mysql_errno(conn.getMysql()) : 2000;
+        return nullptr;
+    }
+
+    std::unique_ptr<QueryStream> pStream(new QueryStream(std::move(lock), conn.getMysql(), pResult, mysql_num_fields(pResult), &m_metrics));
+
+    // Same as Query, no rows means no result. The first fetch failing is told apart by getStreamError.
+    if (!pStream->fetchCurrentRow())
+    {
+        streamError() = pStream->getError();
+        return nullptr;
+    }
+
+    return pStream;
+}
+
+std::shared_ptr<QueryResult> Database::LockedPerformQuery(const std::string& strQuery)
+{
+    std::unique_lock<std::mutex> lock;
+    return BorrowQueryConnection(lock, !m_vReplicas.empty() && isReadQuery(strQuery.c_str())).PerformQuery(strQuery);
+}
+
+void Database::BeginManyQueries()
+{
+    ASSERT(!m_bQueriesTransaction);
+    m_bQueriesTransaction = true;
+}
+
+bool Database::CommitManyQueries(std::function<void(bool)> onComplete, const uint64 shardKey)
+{
+    // Takes the queries, leaving m_vTransactionQueries empty.
+    const bool bQueued = PushQuery(std::make_shared<TransactionQueryObj>(m_vTransactionQueries, onComplete, shardKey));
+
+    m_vTransactionQueries.clear();
+    m_bQueriesTransaction = false;
+
+    if (!bQueued && onComplete)
+        onComplete(false);
+
+    return bQueued;
+}
+
+void Database::CancelManyQueries()
+{
+    m_vTransactionQueries.clear();
+    m_bQueriesTransaction = false;
+}
+
+bool Database::ExecuteQueryInstant(const char* format, ...)
+{
+    if (!format || m_vConnections.empty())
+        return false;
+    
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    std::unique_lock<std::mutex> lock;
+    return BorrowQueryConnection(lock, false).RawMysqlQueryCall(strQuery, true);
+}
+
+bool Database::QueueExecuteQuery(const char*  format,...)
+{
+    if (!format || m_vConnections.empty())
+        return false;
+    
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    return PushExecuteQuery(strQuery, 0);
+}
+
+bool Database::QueueShardedExecuteQuery(const uint64 shardKey, const char* format, ...)
+{
+    if (!format || m_vConnections.empty())
+        return false;
+    
+    std::string& strQuery = QueryFormatter::getThreadBuffer();
+    FORMAT_STRING_ARGS(format, strQuery, MAX_QUERY_LEN);
+
+    return PushExecuteQuery(strQuery, shardKey);
+}
+
+bool Database::PushExecuteQuery(const std::string& strQuery, const uint64 shardKey)
+{
+    ASSERT(!strQuery.empty());
+
+    if (!m_bQueriesTransaction)
+        return PushQuery(std::make_shared<QueryObj>(strQuery, shardKey));
+
+    // Counted with the transaction once it's committed.
+    m_vTransactionQueries.push_back(std::make_shared<QueryObj>(strQuery, shardKey));
+    return true;
+}
+
+std::unique_ptr<BulkLoader> Database::BeginBulkLoad(const char* table, const char* columns, std::function<void(bool, uint64)> onComplete, const uint64 shardKey)
+{
+    ASSERT(table);
+
+    if (m_vConnections.empty())
+        return nullptr;
+
+    // The file name is never opened, the connection reads the chunk instead. These are LOAD DATA's defaults, spelled out.
+    std::string strStatement = "LOAD DATA LOCAL INFILE 'bulk' INTO TABLE ";
+    strStatement += table;
+    strStatement += " CHARACTER SET utf8 FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n'";
+
+    if (columns)
+    {
+        strStatement += " (";
+        strStatement += columns;
+        strStatement += ')';
+    }
+
+    std::shared_ptr<BulkLoadState> pState = std::make_shared<BulkLoadState>(strStatement, onComplete);
+    return std::unique_ptr<BulkLoader>(new BulkLoader(*this, pState, shardKey, m_uiBulkChunkBytes, m_uiBulkMaxInFlight));
+}
+
+bool Database::SetWriteSpool(const char* directory, const uint32 segmentBytes, const uint32 syncIntervalMs)
+{
+    if (m_bInit)
+    {
+        printf("Database::SetWriteSpool - Call before Initialize.");
+        return false;
+    }
+
+#ifdef __linux__
+    m_pSpool.reset(directory ? new WriteSpool(*this, directory, segmentBytes, syncIntervalMs) : nullptr);
+    return true;
+#else
+    printf("Database::SetWriteSpool - Only supported on Linux.");
+    return false;
+#endif
+}
+
+WriteSpoolStats Database::getWriteSpoolStats()
+{
+    if (!m_pSpool)
+        return WriteSpoolStats();
+
+    return m_pSpool->getStats();
+}
+
+bool Database::FlushWriteBehind(std::function<void()> onFlushed)
+{
+    if (m_vConnections.empty())
+        return false;
+
+    return m_pWriteBehind->Flush(onFlushed);
+}
+
+bool Database::RegisterStatement(const uint32 id, const char* sql)
+{
+    ASSERT(sql);
+    std::lock_guard<std::mutex> lock(m_mutexStatements);
+
+    if (!m_uoStatements.insert(std::make_pair(id, std::string(sql))).second)
+        return false;
+
+    if (isReadQuery(sql))
+        m_usReadStatements.insert(id);
+
+    return true;
+}
+
+bool Database::isReadStatement(const uint32 id)
+{
+    std::lock_guard<std::mutex> lock(m_mutexStatements);
+    return m_usReadStatements.count(id) != 0;
+}
+
+bool Database::getStatementSql(const uint32 id, std::string& result)
+{
+    std::lock_guard<std::mutex> lock(m_mutexStatements);
+    
+    auto itr = m_uoStatements.find(id);
+
+    if (itr == m_uoStatements.end())
+        return false;
+
+    result = itr->second;
+    return true;
+}
+
+bool Database::QueueExecuteStatement(const PreparedStatement& stmt, const uint64 shardKey)
+{
+    if (m_vConnections.empty())
+        return false;
+
+    if (!m_bQueriesTransaction)
+        return PushQuery(std::make_shared<PreparedQueryObj>(stmt, shardKey));
+
+    m_vTransactionQueries.push_back(std::make_shared<PreparedQueryObj>(stmt, shardKey));
+    return true;
+}
+
+bool Database::ExecuteStatementInstant(const PreparedStatement& stmt)
+{
+    if (m_vConnections.empty())
+        return false;
+
+    std::unique_lock<std::mutex> lock;
+    return BorrowQueryConnection(lock, false).ExecuteStatement(*this, stmt);
+}
+
+std::shared_ptr<QueryResult> Database::QueryStatement(const PreparedStatement& stmt)
+{
+    if (m_vConnections.empty())
+        return nullptr;
+
+    std::shared_ptr<QueryResult> result;
+    std::unique_lock<std::mutex> lock;
+    BorrowQueryConnection(lock, !m_vReplicas.empty() && isReadStatement(stmt.getId())).ExecuteStatement(*this, stmt, &result);
+    return result;
+}
+
+void Database::getMetrics(DatabaseMetricsSnapshot& result)
+{
+    m_metrics.Snapshot(result);
+
+    // The lanes only know what their worker already took, add what's still waiting in each queue.
+    const int64 iNowUs = DatabaseMetrics::NowUs();
+
+    for (size_t i = 0; i < m_vQueueQueries.size(); ++i)
+    {
+        m_vQueueQueries[i]->inspect([&result, iNowUs](const std::vector<std::shared_ptr<QueryObj>>& vQueued)
+        {
+            if (vQueued.empty())
+                return;
+
+            result.uiQueueDepth += vQueued.size();
+
+            for (size_t j = 0; j < vQueued.size(); ++j)
+                ++result.uiPriorityDepth[vQueued[j]->getPriority()];
+
+            result.uiOldestQueuedUs = std::max<uint64>(result.uiOldestQueuedUs, uint64(iNowUs - vQueued.front()->m_iQueuedUs));
+        });
+    }
+
+    m_pQueueLimiter->Snapshot(result);
+
+    result.vReplicaLagMs.clear();
+
+    for (size_t i = 0; i < m_vReplicas.size(); ++i)
+        result.vReplicaLagMs.push_back(m_vReplicas[i]->iLagMs);
+}
+
+void Database::Ping()
+{
+    QueueExecuteQuery("SELECT 1");
+}
+
+void Database::EscapeString(std::string& str)
+{
+    if (str.empty() || m_vConnections.empty())
+        return;
+
+    // Every character can double, plus the terminator.
+    std::string strResult(str.size() * 2 + 1, '\0');
+    
+    // Escaping only reads the connection's character set, every connection in the pool shares it.
+    strResult.resize(m_vConnections[0]->getBackend().EscapeString(&strResult[0], str.c_str(), str.size()));
+    str.swap(strResult);
+}
+
+void Database::CallbackResult(const uint64 id, std::shared_ptr<CallbackQueryObj::ResultQueryHolder> result)
+{
+    // Only the first result since the last grab needs to wake anyone up.
+    if (!m_queueCallbackResults.push(DbCallbackResult(id, std::move(result))))
+        return;
+
+#ifdef __linux__
+    const int iFd = m_iCallbackEventFd;
+
+    if (iFd >= 0)
+    {
+        const uint64 uiOne = 1;
+
+        if (write(iFd, &uiOne, sizeof(uiOne)) != sizeof(uiOne))
+            printf("Database::CallbackResult - Could not signal the eventfd.");
+    }
+#endif
+}
+
+bool Database::GrabCallbackResults(std::vector<DbCallbackResult>& vResults)
+{
+#ifdef __linux__
+    // Reset before taking, anything finishing after this signals again.
+    const int iFd = m_iCallbackEventFd;
+
+    if (iFd >= 0)
+    {
+        uint64 uiCount;
+
+        if (read(iFd, &uiCount, sizeof(uiCount)) < 0 && errno != EAGAIN)
+            printf("Database::GrabCallbackResults - Could not reset the eventfd.");
+    }
+#endif
+
+    return m_queueCallbackResults.popAll(vResults);
+}
+
+bool Database::WaitCallbackResults(std::vector<DbCallbackResult>& vResults, const uint32 timeoutMs)
+{
+    if (GrabCallbackResults(vResults))
+        return true;
+
+    if (!m_queueCallbackResults.waitPopAllFor(vResults, std::chrono::milliseconds(timeoutMs)))
+        return false;
+
+    // Taken by the wait, so the eventfd is still set.
+    std::vector<DbCallbackResult> vLater;
+
+    if (GrabCallbackResults(vLater))
+    {
+        for (size_t i = 0; i < vLater.size(); ++i)
+            vResults.push_back(std::move(vLater[i]));
+    }
+
+    return true;
+}
+
+int Database::getCallbackEventFd()
+{
+#ifdef __linux__
+    std::call_once(m_onceCallbackEventFd, [this]()
+    {
+        const int iFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (iFd < 0)
+        {
+            printf("Database::getCallbackEventFd - Could not create an eventfd.");
+            return;
+        }
+
+        m_iCallbackEventFd = iFd;
+
+        // Results that finished before anyone asked.
+        const uint64 uiOne = 1;
+        bool bPending = false;
+        m_queueCallbackResults.inspect([&bPending](const std::vector<DbCallbackResult>& vQueued) { bPending = !vQueued.empty(); });
+
+        if (bPending && write(iFd, &uiOne, sizeof(uiOne)) != sizeof(uiOne))
+            printf("Database::getCallbackEventFd - Could not signal the eventfd.");
+    });
+#endif
+
+    return m_iCallbackEventFd;
+}
+
+void Database::GrabAndClearCallbackQueries(std::unordered_map<uint64, std::shared_ptr<CallbackQueryObj::ResultQueryHolder>>& result)
+{
+    std::vector<DbCallbackResult> vResults;
+    result.clear();
+
+    if (!GrabCallbackResults(vResults))
+        return;
+
+    for (size_t i = 0; i < vResults.size(); ++i)
+    {
+        std::shared_ptr<CallbackQueryObj::ResultQueryHolder>& pHolder = result[vResults[i].first];
+
+        if (pHolder)
+            printf("Database::GrabAndClearCallbackQueries - Id %llu finished more than once, only the last is kept.", (unsigned long long)vResults[i].first);
+
+        pHolder = std::move(vResults[i].second);
+    }
+}
@@ -1,114 +1,571 @@
-#ifndef DATABASE_H
-#define DATABASE_H
-
-#include "SafeQueue.h"
-#include "QueryResult.h"
-#include "QueryObjects.h"
-
-#include <mysql.h>
-#include <unordered_map>
-#include <thread>
-
-#define MAX_QUERY_LEN 8192
-
-#define _LIKE_           "LIKE"
-#define _TABLE_SIM_      "`"
-#define _CONCAT3_(A,B,C) "CONCAT( " A " , " B " , " C " )"
-#define _OFFSET_         "LIMIT %d,1"
-
-#define FORMAT_STRING_ARGS(format, output, len) \
-{                                               \
-	va_list ap;                                 \
-	char szQuery[len];                          \
-	va_start(ap, format);                       \
-	vsprintf(szQuery, format, ap);              \
-	va_end(ap);                                 \
-	output = szQuery;                           \
-}
-
-// Callback results are in the same queue as QueueExecuteQuery and CommitManyQueries
-// ::Query and ::ExecuteQueryInstant are asynchronous with m_queueQueries
-class Database
-{
-    friend class QueryObj;
-    friend class CallbackQueryObj;
-
-    public:
-        Database();
-        ~Database();        
-        
-        void Ping();
-        void EscapeString(std::string& str);
-        void GrabAndClearCallbackQueries(std::unordered_map<uint64, std::shared_ptr<CallbackQueryObj::ResultQueryHolder>>& result);
-        
-		// Adds to the async queue
-        void BeginManyQueries();
-        void CommitManyQueries();
-        void CancelManyQueries();
-        
-		// Query: Non-blocking, adds to the async queue
-        void queueCallbackQuery(const uint64 id, const std::unordered_map<uint8, std::string>& queries, const std::string msgToSelf = "") 
-        { 
-            m_queueQueries.push(std::shared_ptr<CallbackQueryObj>(new CallbackQueryObj(id, msgToSelf, queries)));
-        }
-
-		// Query: Non-blocking, adds to the async queue
-        void queueCallbackQuery(const uint64 id, const std::string query, const std::string msgToSelf = "") 
-        { 
-            m_queueQueries.push(std::shared_ptr<CallbackQueryObj>(new CallbackQueryObj(id, msgToSelf, query)));
-        }
-		
-		// Query: Non-blocking, adds to the async queue
-        bool QueueExecuteQuery(const char* format, ...);
-		
-		// Query: Blocking, returns upon completion.
-        bool ExecuteQueryInstant(const char* format, ...); 
-
-        bool Uninitialise();
-        bool Initialize(const char* infoString);   
-        
-		// Query: Blocking, returns upon completion.
-        int32 QueryInt32(const char* format, ...);
-
-		// Query: Blocking, returns upon completion.
-        std::shared_ptr<QueryResult> Query(const char* format, ...);
-
-        operator bool () const { return m_pMYSQL != NULL; }
-        
-    private:        
-        void WorkerThread();
-        void CallbackResult(const uint64 id, std::shared_ptr<CallbackQueryObj::ResultQueryHolder> result);
-
-        // Returns true if success, false if fail.
-        bool RawMysqlQueryCall(const std::string strQuery, const bool bDeleteGatheredData = false);
-
-        std::shared_ptr<QueryResult> LockedPerformQuery(const std::string strQuery);
-        std::shared_ptr<QueryResult> PerformQuery(const std::string strQuery);
-        
-        MYSQL* m_pMYSQL;
-
-        // When true, the queue thread ends.
-        bool m_bCancelToken;
-        bool m_bInit;
-
-        // When true, execute queries get added to m_vTransactionQueries.
-        bool m_bQueriesTransaction;
-
-        static size_t m_stDatabaseCount;
-        
-        std::mutex m_mutexMysql;
-        std::mutex m_mutexCallbackQueries;
-        std::thread m_threadWorker;
-                
-        SafeQueue<std::shared_ptr<QueryObj>> m_queueQueries;
-
-        // Begin -> Commit, a way to do a bunch of queries at the same time without waiting in queue.
-        std::vector<std::string> m_vTransactionQueries;
-
-        // The results of queued queries with callbacks.
-        std::unordered_map<uint64, std::shared_ptr<CallbackQueryObj::ResultQueryHolder>> m_uoCallbackQueries;
-};
-
-#endif
-
-
+#ifndef DATABASE_H
+#define DATABASE_H
+
+#include "SafeQueue.h"
+#include "QueryResult.h"
+#include "QueryObjects.h"
+#include "DatabaseConnection.h"
+#include "QueryStream.h"
+#include "QueryCache.h"
+#include "DatabaseMetrics.h"
+#include "QueryFormatter.h"
+#include "QueryMapping.h"
+#include "BulkLoader.h"
+#include "WriteBehind.h"
+#include "QueueLimiter.h"
+#include "WriteSpool.h"
+
+#include <mysql.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <future>
+
+#define MAX_QUERY_LEN 8192
+
+// Shard keys DB_RYW_KEY tells apart, the rest share a window with one of them.
+#define DB_RYW_KEY_SLOTS 1024
+
+// How often a replica's lag is checked, at most.
+#define DB_REPLICA_LAG_CHECK_US 1000000
+
+#define _LIKE_           "LIKE"
+#define _TABLE_SIM_      "`"
+#define _CONCAT3_(A,B,C) "CONCAT( " A " , " B " , " C " )"
+#define _OFFSET_         "LIMIT %d,1"
+
+// len is only where output starts, longer queries grow it.
+#define FORMAT_STRING_ARGS(format, output, len)        \
+{                                                      \
+	va_list ap;                                        \
+	va_start(ap, format);                              \
+	QueryFormatter::FormatV(output, len, format, ap);  \
+	va_end(ap);                                        \
+}
+
+class AsyncEngine;
+
+enum DatabaseExecutionMode
+{
+    // One worker thread per connection, each blocking on its query.
+    DB_EXECUTION_THREADS,
+
+    // One thread drives every connection with MariaDB's non-blocking API, see AsyncEngine.
+    DB_EXECUTION_EVENT_LOOP
+};
+
+// Where reads go once replicas were added with AddReplica. Writes, transactions and anything that locks rows always go to the primary.
+enum DbReadPolicy
+{
+    DB_READ_PRIMARY,
+
+    // Whichever replica within the lag limit has an idle connection, taking turns.
+    DB_READ_ROUND_ROBIN,
+
+    // The replica furthest along, as of its last lag check.
+    DB_READ_LEAST_LAG
+};
+
+// Keeps reads that follow a write on the primary while the write is queued or running and for a while after,
+//  so they see it even if the replicas are behind.
+enum DbReadYourWrites
+{
+    DB_RYW_OFF,
+
+    // After the calling thread wrote anything.
+    DB_RYW_CALLER,
+
+    // After anything was written with the same shard key. Blocking calls count as key 0.
+    DB_RYW_KEY
+};
+
+// Callback results are in the same queue as QueueExecuteQuery and CommitManyQueries
+// ::Query and ::ExecuteQueryInstant are asynchronous with m_vQueueQueries
+//
+// Initialize opens poolSize connections, each drained by its own worker thread.
+// Queued objects are routed to a worker by their shard key, so everything queued with the
+// same key (by default 0) runs in the order it was given. Blocking calls borrow whichever connection is idle.
+//
+// Each worker keeps a lane per DbPriority: reads someone waits on (callbacks, QueryAsync) are interactive,
+// everything else normal unless queued inside a DbPriorityScope. Between objects the worker picks up newly queued ones,
+// so a login read doesn't wait behind a bulk save of other keys queued before it. Lanes never reorder objects of one shard key,
+// except reads among themselves: a read still waits for writes queued before it with its key, see QueryLanes.
+class Database
+{
+    friend class QueryObj;
+    friend class CallbackQueryObj;
+    friend class AsyncQueryObj;
+    friend class BulkLoader;
+    friend class WriteBehind;
+    friend class QueueLimiter;
+    friend class WriteSpool;
+    friend class DatabaseConnection;
+
+    public:
+        Database();
+        ~Database();        
+        
+        void Ping();
+        void EscapeString(std::string& str);
+        // Older interface to GrabCallbackResults, result is replaced. If an id finished more than once only the last one is kept.
+        void GrabAndClearCallbackQueries(std::unordered_map<uint64, std::shared_ptr<CallbackQueryObj::ResultQueryHolder>>& result);
+
+        // Takes every finished callback query in the order they finished, duplicate ids included, returns false if there were none.
+        //  vResults is expected to be empty: keep passing the same (cleared) vector and it swaps buffers without copying or allocating.
+        bool GrabCallbackResults(std::vector<DbCallbackResult>& vResults);
+
+        // Same as GrabCallbackResults, but first waits up to timeoutMs for something to finish.
+        bool WaitCallbackResults(std::vector<DbCallbackResult>& vResults, const uint32 timeoutMs);
+
+        // An eventfd that's readable while callback results are waiting, to poll or epoll with the loop's other events.
+        //  GrabCallbackResults resets it. Created on the first call, -1 where there is no eventfd (anything but Linux).
+        int getCallbackEventFd();
+        
+		// Adds to the async queue
+        //  Everything queued between Begin and Commit runs as a single transaction, on the worker owning shardKey.
+        //  onComplete (optional) is called from that worker with true once committed or false if it was rolled back,
+        //  or right away with false if the queue turned it away (see SetQueueLimits).
+        //  Shard keys given to the calls in between are ignored, it all runs in order with shardKey. Other keys don't keep their order
+        //  against it: something queued later with one of them on another worker may commit first. Use one key per batch where that matters.
+        void BeginManyQueries();
+        bool CommitManyQueries(std::function<void(bool)> onComplete = nullptr, const uint64 shardKey = 0);
+        void CancelManyQueries();
+        
+		// Query: Non-blocking, adds to the async queue
+        bool queueCallbackQuery(const uint64 id, const std::unordered_map<uint8, std::string>& queries, const std::string msgToSelf = "", const uint64 shardKey = 0) 
+        { 
+            return PushQuery(std::shared_ptr<CallbackQueryObj>(new CallbackQueryObj(id, msgToSelf, queries, shardKey)));
+        }
+
+		// Query: Non-blocking, adds to the async queue
+        bool queueCallbackQuery(const uint64 id, const std::string query, const std::string msgToSelf = "", const uint64 shardKey = 0) 
+        { 
+            return PushQuery(std::shared_ptr<CallbackQueryObj>(new CallbackQueryObj(id, msgToSelf, query, shardKey)));
+        }
+		
+		// Query: Non-blocking, adds to the async queue. The future becomes ready on the worker thread.
+        //  Nothing to poll and no ids to keep apart, many of these can be in the queue at once.
+        std::future<std::shared_ptr<QueryResult>> QueryAsync(const char* format, ...);
+
+		// Query: Non-blocking, adds to the async queue. onResult is run through executor, or on the worker thread if executor is empty.
+        //  Returns false, and onResult is never called, if it wasn't queued.
+        bool QueryAsyncThen(AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const char* format, ...);
+
+		// Query: Non-blocking, QueryAsync and QueryAsyncThen on the worker owning shardKey.
+        std::future<std::shared_ptr<QueryResult>> QueryShardedAsync(const uint64 shardKey, const char* format, ...);
+        bool QueryShardedAsyncThen(const uint64 shardKey, AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const char* format, ...);
+
+		// Statement: Non-blocking, adds to the async queue. Same as QueryAsync and QueryAsyncThen.
+        std::future<std::shared_ptr<QueryResult>> QueryStatementAsync(const PreparedStatement& stmt, const uint64 shardKey = 0);
+        bool QueryStatementAsyncThen(const PreparedStatement& stmt, AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const uint64 shardKey = 0);
+
+		// Query: Non-blocking, adds to the async queue
+        bool QueueExecuteQuery(const char* format, ...);
+
+		// Query: Non-blocking, adds to the async queue of the worker owning shardKey.
+        //  Only ordered relative to other queries with the same shard key.
+        bool QueueShardedExecuteQuery(const uint64 shardKey, const char* format, ...);
+		
+		// Query: Blocking, returns upon completion.
+        bool ExecuteQueryInstant(const char* format, ...); 
+
+        // The same as Query, ExecuteQueryInstant, QueueExecuteQuery and QueueShardedExecuteQuery, with a '?' in sql for each argument
+        //  instead of printf formats. Argument types are checked when compiling and strings are escaped, see QueryFormatter.
+        //  The query is built in a buffer kept per thread, so the blocking ones don't allocate once it's big enough.
+        template <class... Args>
+        std::shared_ptr<QueryResult> queryArgs(const char* sql, const Args&... args)
+        {
+            std::string& strQuery = QueryFormatter::getThreadBuffer();
+
+            if (m_vConnections.empty() || !QueryFormatter::Format(strQuery, getEscaper(), sql, args...))
+                return nullptr;
+
+            return LockedPerformQuery(strQuery);
+        }
+
+        // Query: Blocking, queryArgs with each row mapped into a T (see QueryMapping), appended to vRows.
+        //  Returns false if the result is missing a column T is bound to.
+        template <class T, class... Args>
+        bool queryRows(std::vector<T>& vRows, const char* sql, const Args&... args)
+        {
+            return QueryMapping::mapRows(queryArgs(sql, args...), vRows);
+        }
+
+        template <class... Args>
+        bool executeArgs(const char* sql, const Args&... args)
+        {
+            std::string& strQuery = QueryFormatter::getThreadBuffer();
+
+            if (m_vConnections.empty() || !QueryFormatter::Format(strQuery, getEscaper(), sql, args...))
+                return false;
+
+            std::unique_lock<std::mutex> lock;
+            return BorrowQueryConnection(lock, false).RawMysqlQueryCall(strQuery, true);
+        }
+
+        template <class... Args>
+        bool queueExecuteArgs(const char* sql, const Args&... args)
+        {
+            return queueShardedExecuteArgs(0, sql, args...);
+        }
+
+        template <class... Args>
+        bool queueShardedExecuteArgs(const uint64 shardKey, const char* sql, const Args&... args)
+        {
+            std::string& strQuery = QueryFormatter::getThreadBuffer();
+
+            if (m_vConnections.empty() || !QueryFormatter::Format(strQuery, getEscaper(), sql, args...))
+                return false;
+
+            return PushExecuteQuery(strQuery, shardKey);
+        }
+
+        // Bulk: Non-blocking, adds to the async queue. Rows added to the loader are sent with LOAD DATA LOCAL INFILE, read from memory,
+        //  into columns (comma separated, null for all of them in table order) of table. See BulkLoader, and SetBulkLoadChunks for how much
+        //  memory it holds. onComplete (optional) is called once with whether every row loaded and how many did. Not part of BeginManyQueries.
+        //  Needs the MySQL backend (ReplayBackend only counts the rows) and local_infile turned on at the server.
+        std::unique_ptr<BulkLoader> BeginBulkLoad(const char* table, const char* columns, std::function<void(bool, uint64)> onComplete = nullptr, const uint64 shardKey = 0);
+
+        // BeginBulkLoad into the columns bound in DbMapping<T>, add rows with BulkLoader::addObject.
+        template <class T>
+        std::unique_ptr<BulkLoader> beginMappedBulkLoad(const char* table, std::function<void(bool, uint64)> onComplete = nullptr, const uint64 shardKey = 0)
+        {
+            return BeginBulkLoad(table, BulkLoader::mappedColumns<T>().c_str(), onComplete, shardKey);
+        }
+
+        // Rows are sent about chunkBytes at a time, adding rows waits while maxInFlight chunks are queued (4 MB and 4 by default).
+        void SetBulkLoadChunks(const uint32 chunkBytes, const uint32 maxInFlight)
+        {
+            ASSERT(maxInFlight > 0);
+            m_uiBulkChunkBytes = chunkBytes;
+            m_uiBulkMaxInFlight = maxInFlight;
+        }
+
+        // Write-behind: Non-blocking. Sets the columns of the row where keyColumn = key, name and value pairs after the key:
+        //  queueRowUpdate("characters", "guid", guid, "level", level, "money", money). Formatted like queryArgs.
+        //  Held for up to the interval given to SetWriteBehind, a later write to the same row replaces the earlier values
+        //  instead of adding a statement, then sent in batches, see WriteBehind. Values replace, so "money = money + 1" doesn't belong here.
+        //  Nothing queued or run meanwhile sees the write, not even by the same thread. Not part of BeginManyQueries.
+        template <class Key, class... Args>
+        bool queueRowUpdate(const char* table, const char* keyColumn, const Key& key, const Args&... columns)
+        {
+            return queueRowWrite(false, table, keyColumn, key, columns...);
+        }
+
+        // Write-behind: Non-blocking. queueRowUpdate, but inserts the row if it isn't there (INSERT ... ON DUPLICATE KEY UPDATE).
+        template <class Key, class... Args>
+        bool queueRowUpsert(const char* table, const char* keyColumn, const Key& key, const Args&... columns)
+        {
+            return queueRowWrite(true, table, keyColumn, key, columns...);
+        }
+
+        // Queues every row write waiting now. onFlushed (optional) is called on the worker thread once they ran,
+        //  anything queued on shard key 0 after this returns runs after them. Returns false if not initialised, or if the queue
+        //  turned the flush away (see SetQueueLimits): the rows then wait for the next flush, and onFlushed is never called.
+        bool FlushWriteBehind(std::function<void()> onFlushed = nullptr);
+
+        // Row writes are flushed every intervalMs, or once maxRows rows are waiting (100 ms and 10000 by default).
+        void SetWriteBehind(const uint32 intervalMs, const uint32 maxRows) { m_pWriteBehind->SetLimits(intervalMs, maxRows); }
+
+        WriteBehindStats getWriteBehindStats() { return m_pWriteBehind->getStats(); }
+
+        bool Uninitialise();
+        bool Initialize(const char* infoString, const uint32 poolSize = 1, const DatabaseExecutionMode mode = DB_EXECUTION_THREADS);   
+
+        // Before Initialize: each connection sends its SQL through a backend made by factory instead of the MySQL client library,
+        //  e.g. ReplayBackend::Factory to answer from recorded results. An empty factory goes back to MySQL.
+        //  Prepared statements, StreamQuery and DB_EXECUTION_EVENT_LOOP only work with MySQL.
+        void SetBackend(DatabaseBackendFactory factory) { m_fnBackendFactory = factory; }
+
+        // After Initialize, before anything is queued: opens poolSize blocking connections to a read replica, same infoString format.
+        //  Blocking reads (Query, QueryInt32, queryArgs, queryRows, StreamQuery, QueryStatement) and queued ones with nobody
+        //  depending on their order (callbacks, QueryAsync) go to the replicas, see SetReadPolicy. Reads that lock rows, CachedQuery
+        //  misses and DB_EXECUTION_EVENT_LOOP mode stay on the primary.
+        bool AddReplica(const char* infoString, const uint32 poolSize = 1);
+
+        // DB_READ_ROUND_ROBIN by default. A replica more than maxLagMs behind (or not replicating) gets nothing until it catches up,
+        //  reads fall back on the primary when no replica qualifies. Lag is checked about once a second.
+        void SetReadPolicy(const DbReadPolicy policy, const uint32 maxLagMs = 5000)
+        {
+            m_uiMaxReplicaLagMs = maxLagMs;
+            m_eReadPolicy = policy;
+        }
+
+        // DB_RYW_OFF by default. windowMs counts from when the write finished, and should be longer than the replicas usually lag.
+        void SetReadYourWrites(const DbReadYourWrites mode, const uint32 windowMs = 1000)
+        {
+            m_uiReadYourWritesMs = windowMs;
+            m_eReadYourWrites = mode;
+        }
+
+        // True for SELECT, SHOW, DESCRIBE and EXPLAIN, unless it's a locking read (FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE).
+        static bool isReadQuery(const char* query);
+        
+		// Query: Blocking, returns upon completion.
+        int32 QueryInt32(const char* format, ...);
+
+		// Query: Blocking, returns upon completion.
+        std::shared_ptr<QueryResult> Query(const char* format, ...);
+
+		// Query: Blocking until the first row arrives, the rest are read as the stream is iterated.
+        //  The connection stays reserved until the stream is drained or destroyed, by the calling thread (see QueryStream).
+        //  Null if there are no rows or it failed, getStreamError tells which.
+        std::unique_ptr<QueryStream> StreamQuery(const char* format, ...);
+
+        // The error number of the calling thread's last StreamQuery, 0 if it succeeded or just had no rows.
+        static uint32 getStreamError() { return streamError(); }
+
+        // Registers sql, with '?' for each parameter, under id. Each connection prepares it the first time it's used.
+        //  Returns false if id is already taken.
+        bool RegisterStatement(const uint32 id, const char* sql);
+
+		// Statement: Non-blocking, adds to the async queue
+        bool QueueExecuteStatement(const PreparedStatement& stmt, const uint64 shardKey = 0);
+
+		// Statement: Blocking, returns upon completion.
+        bool ExecuteStatementInstant(const PreparedStatement& stmt);
+
+		// Statement: Blocking, returns upon completion.
+        std::shared_ptr<QueryResult> QueryStatement(const PreparedStatement& stmt);
+
+		// Query: Blocking on a miss, a hit is answered from memory without touching a connection.
+        //  The result is shared by every caller for ttlMs (0 for no limit), or until a write through this Database
+        //  touches one of tags (comma separated table names, may be null). See SetCacheLimit.
+        std::shared_ptr<QueryResult> CachedQuery(const uint32 ttlMs, const char* tags, const char* format, ...);
+
+		// Statement: Same as CachedQuery, keyed by the statement and its parameters.
+        std::shared_ptr<QueryResult> CachedQueryStatement(const PreparedStatement& stmt, const uint32 ttlMs, const char* tags);
+
+        // Memory the cached results may use, the least recently used go first. 0 (the default) turns caching off.
+        void SetCacheLimit(const size_t maxBytes) { m_cache.SetLimit(maxBytes); }
+
+        // For writes that don't go through this Database. Null drops everything.
+        void InvalidateCache(const char* tag) { m_cache.Invalidate(tag); }
+
+        QueryCacheStats getCacheStats() const { return m_cache.getStats(); }
+
+        // When enabled (and not in DB_EXECUTION_EVENT_LOOP mode), workers merge single row INSERTs queued back to back into the same table and columns
+        //  into one multi row INSERT of at most maxBytes (and never more than the server's max_allowed_packet).
+        //  If a merged insert fails, its rows are retried one by one when nothing was written: it was turned down as a whole,
+        //  or the table is InnoDB. Not after a lost connection, or a failed row on a non-transactional table.
+        void SetInsertCoalescing(const bool enable, const uint32 maxBytes = 1024 * 1024)
+        {
+            m_uiCoalesceMaxBytes = maxBytes;
+            m_bCoalesceInserts = enable;
+        }
+
+        // While lanes are all busy, each worker runs this many objects from each in turn, interactive first (16, 4 and 1 by default).
+        //  A lane weighted 0 only runs when the others are empty, or waiting on it.
+        void SetPriorityWeights(const uint32 interactive, const uint32 normal, const uint32 bulk)
+        {
+            m_uiPriorityWeights[DB_PRIORITY_INTERACTIVE] = interactive;
+            m_uiPriorityWeights[DB_PRIORITY_NORMAL] = normal;
+            m_uiPriorityWeights[DB_PRIORITY_BULK] = bulk;
+        }
+
+        void getPriorityWeights(uint32 (&weights)[DB_PRIORITY_COUNT]) const
+        {
+            for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+                weights[i] = m_uiPriorityWeights[i];
+        }
+
+        // Caps what's queued (and running) at maxItems objects and maxBytes of their SQL or data, 0 for no limit (the default for both).
+        //  Over it, queue calls do what policy says: wait up to blockTimeoutMs for room, give up right away, or write plain SQL
+        //  to spillPath (a temporary file if null) until there's room. A call turned away returns false, a future gets a null result
+        //  and CommitManyQueries' onComplete false. Worker threads (and callbacks run on them) never wait, they go over the limit.
+        //  Returns false if the spill file can't be opened. The spill file doesn't survive a crash.
+        bool SetQueueLimits(const uint32 maxItems, const uint64 maxBytes, const DbQueuePolicy policy = DB_QUEUE_BLOCK, const uint32 blockTimeoutMs = 1000, const char* spillPath = nullptr)
+        {
+            return m_pQueueLimiter->SetLimits(maxItems, maxBytes, policy, blockTimeoutMs, spillPath);
+        }
+
+        // Records queued writes in memory-mapped segment files of directory (which has to exist) before they're queued, so writes
+        //  left undone by a crash are queued again by the next Initialize, in the order they were queued. Call before Initialize,
+        //  null turns it off. Only plain SQL and transactions of plain SQL are recorded: not prepared statements, callbacks, bulk
+        //  loads or write-behind rows, and CommitManyQueries' onComplete isn't called again on replay.
+        //  A process crash loses nothing recorded. Power loss loses at most the last syncIntervalMs, 0 waits in the queue call
+        //  for the sync instead (one sync covers every caller waiting). A write that failed, even on a lost connection, isn't replayed:
+        //  newer writes to the same rows would already have run. Replay isn't held to SetQueueLimits.
+        //  A write may run twice (it ran but the crash came before it was marked done), so replayed SQL should be idempotent.
+        //  Returns false if called after Initialize, or not on Linux.
+        bool SetWriteSpool(const char* directory, const uint32 segmentBytes = 64 * 1024 * 1024, const uint32 syncIntervalMs = 10);
+
+        WriteSpoolStats getWriteSpoolStats();
+
+        // Latency per statement fingerprint, queue depth and age, lock waits, rows, bytes, errors and reconnects since Initialize.
+        //  Cheap enough to poll every few seconds, nothing that records the metrics waits on it.
+        void getMetrics(DatabaseMetricsSnapshot& result);
+
+        uint32 getPoolSize() const { return uint32(m_vConnections.size()); }
+        uint32 getReplicaCount() const { return uint32(m_vReplicas.size()); }
+
+        operator bool () const { return !m_vConnections.empty(); }
+        
+    private:        
+        static uint32& streamError()
+        {
+            static thread_local uint32 s_uiError = 0;
+            return s_uiError;
+        }
+
+        void WorkerThread(const uint32 index);
+
+        // Coalesces (if enabled) and sorts queries into lanes, queries is left empty.
+        void TakeQueries(const uint32 index, DatabaseConnection& conn, std::vector<std::shared_ptr<QueryObj>>& queries, QueryLanes& lanes);
+        void CallbackResult(const uint64 id, std::shared_ptr<CallbackQueryObj::ResultQueryHolder> result);
+
+        // Records pObj in the write spool (if set), counts it against the queue limits, then queues it.
+        //  Returns false if the limits turned it away.
+        bool PushQuery(std::shared_ptr<QueryObj> pObj);
+
+        // Queues pObj on the worker (or event loop connection) owning its shard key.
+        void EnqueueQuery(std::shared_ptr<QueryObj> pObj);
+
+        // Locks an idle connection if there is one, otherwise waits on the next one in rotation.
+        DatabaseConnection& BorrowConnection(std::unique_lock<std::mutex>& lock);
+
+        // Locks a connection of a replica the read policy allows, or returns null if the read should run on the primary.
+        //  Without bWait it only takes an idle connection.
+        DatabaseConnection* BorrowReplica(std::unique_lock<std::mutex>& lock, const bool bWait);
+
+        // BorrowReplica for a blocking read outside the read-your-writes window, BorrowConnection for everything else.
+        DatabaseConnection& BorrowQueryConnection(std::unique_lock<std::mutex>& lock, const bool bRead);
+
+        // True while a write with key (or by this thread) is queued or running, and for the read-your-writes window after.
+        //  Decided by whoever queues or calls, workers never write down their own writes.
+        bool ReadsPrimary(const uint64 key) const;
+        void NoteWrite(const uint64 key);
+
+        // The calling thread's window for DB_RYW_CALLER, key's for DB_RYW_KEY, null while off.
+        DbWriteWindow* FindWriteWindow(const uint64 key) const;
+
+        static bool ParseInfoString(const char* infoString, std::string& strHost, std::string& strPortOrSocket, std::string& strUser, std::string& strPassword, std::string& strDbName);
+
+        std::shared_ptr<QueryResult> LockedPerformQuery(const std::string& strQuery);
+
+        // What QueryFormatter escapes strings with, the same connection as EscapeString. Needs a connection.
+        DatabaseBackend* getEscaper() const { return &m_vConnections[0]->getBackend(); }
+
+        template <class Key, class... Args>
+        bool queueRowWrite(const bool bUpsert, const char* table, const char* keyColumn, const Key& key, const Args&... columns)
+        {
+            static_assert(sizeof...(Args) > 0 && sizeof...(Args) % 2 == 0, "Row writes take name and value pairs.");
+            ASSERT(table && keyColumn);
+
+            std::string strKey;
+            std::vector<std::pair<std::string, std::string>> vColumns;
+
+            if (m_vConnections.empty() || !QueryFormatter::Format(strKey, getEscaper(), "?", key) || !addColumns(vColumns, getEscaper(), columns...))
+                return false;
+
+            m_pWriteBehind->Write(table, keyColumn, strKey, bUpsert, vColumns);
+            return true;
+        }
+
+        static bool addColumns(std::vector<std::pair<std::string, std::string>>& /*vColumns*/, DatabaseBackend* /*pEscaper*/) { return true; }
+
+        template <class Value, class... Args>
+        static bool addColumns(std::vector<std::pair<std::string, std::string>>& vColumns, DatabaseBackend* pEscaper, const char* name, const Value& value, const Args&... columns)
+        {
+            ASSERT(name);
+            vColumns.emplace_back(name, std::string());
+            return QueryFormatter::Format(vColumns.back().second, pEscaper, "?", value) && addColumns(vColumns, pEscaper, columns...);
+        }
+
+        // Queues strQuery, or adds it to the transaction between BeginManyQueries and CommitManyQueries.
+        bool PushExecuteQuery(const std::string& strQuery, const uint64 shardKey);
+
+        // Queues a read of strQuery with its result handed to onResult, see QueryAsyncThen.
+        bool PushAsyncQuery(const std::string& strQuery, AsyncQueryObj::ResultHandler onResult, DbExecutor executor, const uint64 shardKey);
+
+        bool getStatementSql(const uint32 id, std::string& result);
+        bool isReadStatement(const uint32 id);
+        
+        bool m_bInit;
+
+        // When true, execute queries get added to m_vTransactionQueries.
+        bool m_bQueriesTransaction;
+
+        static size_t m_stDatabaseCount;
+        
+        std::mutex m_mutexStatements;
+
+        // Index i of each of these belong together: worker i drains queue i on connection i.
+        std::vector<std::unique_ptr<DatabaseConnection>> m_vConnections;
+        std::vector<std::unique_ptr<SafeQueue<std::shared_ptr<QueryObj>>>> m_vQueueQueries;
+        std::vector<std::thread> m_vThreadWorkers;
+
+        // Replaces the queues and workers above in DB_EXECUTION_EVENT_LOOP mode.
+        std::unique_ptr<AsyncEngine> m_pEngine;
+
+        std::atomic<bool> m_bCoalesceInserts;
+        std::atomic<uint32> m_uiCoalesceMaxBytes;
+
+        std::atomic<uint32> m_uiPriorityWeights[DB_PRIORITY_COUNT];
+
+        std::atomic<uint32> m_uiBulkChunkBytes;
+        std::atomic<uint32> m_uiBulkMaxInFlight;
+
+        std::unique_ptr<WriteBehind> m_pWriteBehind;
+        std::unique_ptr<QueueLimiter> m_pQueueLimiter;
+        std::unique_ptr<WriteSpool> m_pSpool;
+
+        QueryCache m_cache;
+        DatabaseMetrics m_metrics;
+
+        // Empty for MySQL.
+        DatabaseBackendFactory m_fnBackendFactory;
+
+        // Where BorrowConnection starts looking.
+        std::atomic<uint32> m_uiNextConnection;
+
+        struct Replica
+        {
+            Replica() : iLagMs(0), iCheckedUs(0), bLegacyStatus(false), uiNextConnection(0) {}
+
+            std::vector<std::unique_ptr<DatabaseConnection>> vConnections;
+
+            // Seconds behind the primary as of iCheckedUs, -1 if replication is stopped or the check failed.
+            std::atomic<int64> iLagMs;
+            std::atomic<int64> iCheckedUs;
+
+            // Servers older than MySQL 8.0.22 and MariaDB 10.5 only know SHOW SLAVE STATUS.
+            std::atomic<bool> bLegacyStatus;
+
+            std::atomic<uint32> uiNextConnection;
+        };
+
+        // Takes iCheckedUs if a check is due and runs it on an idle connection of replica, if there is one.
+        void RefreshReplicaLag(Replica& replica, const int64 iNowUs);
+
+        std::vector<std::unique_ptr<Replica>> m_vReplicas;
+        std::atomic<uint32> m_uiNextReplica;
+
+        std::atomic<DbReadPolicy> m_eReadPolicy;
+        std::atomic<uint32> m_uiMaxReplicaLagMs;
+
+        std::atomic<DbReadYourWrites> m_eReadYourWrites;
+        std::atomic<uint32> m_uiReadYourWritesMs;
+
+        // The writes of each shard key (modulo the size), for DB_RYW_KEY. Shared with the queued writes holding them open.
+        std::shared_ptr<DbWriteWindow[]> m_pKeyWrites;
+
+        // Begin -> Commit, a way to do a bunch of queries at the same time without waiting in queue.
+        std::vector<std::shared_ptr<QueryObj>> m_vTransactionQueries;
+
+        // Registered statement id -> sql.
+        std::unordered_map<uint32, std::string> m_uoStatements;
+
+        // Registered statements that are reads, see isReadQuery.
+        std::unordered_set<uint32> m_usReadStatements;
+
+        // The results of queued queries with callbacks, in the order they finished.
+        SafeQueue<DbCallbackResult> m_queueCallbackResults;
+
+        // Signalled when m_queueCallbackResults stops being empty, once getCallbackEventFd made it.
+        std::atomic<int> m_iCallbackEventFd;
+        std::once_flag m_onceCallbackEventFd;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef DATABASEBACKEND_H
+#define DATABASEBACKEND_H
+
+#include "QueryResult.h"
+
+#include <mysql.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class DatabaseMetrics;
+
+// What a DatabaseConnection sends its SQL through. MysqlBackend is the client library,
+// ReplayBackend answers from recorded results without a server.
+// Each connection has its own instance, only used while the connection's mutex is held.
+class DatabaseBackend
+{
+    public:
+        virtual ~DatabaseBackend() {}
+
+        virtual bool Open(const std::string& strHost, const std::string& strPortOrSocket, const std::string& strUser, const std::string& strPassword, const std::string& strDbName, const bool bNonBlocking) = 0;
+        virtual void Close() = 0;
+
+        // Returns true if success, false if fail (see getErrno and getError).
+        //  A successful query's rows must be taken with StoreResult, StoreResultCopy or DiscardResult before the next one.
+        virtual bool Query(const std::string& strQuery) = 0;
+
+        // Null when there are no rows. The rows (and the bytes read from them) are added to pMetrics if given.
+        virtual std::shared_ptr<QueryResult> StoreResult(DatabaseMetrics* pMetrics) = 0;
+
+        // The rows in a form several results can share, storage is left null when there are none.
+        //  Returns false if they couldn't be read.
+        virtual bool StoreResultCopy(std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount) = 0;
+
+        virtual void DiscardResult() = 0;
+
+        // Several ';' separated statements in one go. Needs SetMultiStatements(true).
+        //  With pResults each statement's rows (null for none) are appended in order, as StoreResult would, otherwise they're discarded.
+        //  Returns false at the first statement that failed, failedStatement is its position (from 1).
+        virtual bool MultiQuery(const std::string& strStatements, uint32& failedStatement, std::vector<std::shared_ptr<QueryResult>>* pResults, DatabaseMetrics* pMetrics) = 0;
+        virtual void SetMultiStatements(const bool bEnable) = 0;
+
+        // Runs strStatement, a LOAD DATA LOCAL INFILE, with the file's contents read from data instead of a file.
+        //  Returns false if it failed (see getErrno), rows is how many were loaded.
+        virtual bool LoadData(const std::string& strStatement, const char* data, const size_t length, uint64& rows) = 0;
+
+        virtual bool Ping() = 0;
+
+        // Whether a lost connection is opened again by the next call. Only for backends that do that on their own.
+        virtual void SetReconnect(const bool /*bEnable*/) {}
+
+        // Of the last call that failed.
+        virtual uint32 getErrno() const = 0;
+        virtual const char* getError() const = 0;
+
+        // Changes when the backend reconnected on its own.
+        virtual unsigned long getThreadId() const = 0;
+
+        // to must have room for length * 2 + 1 chars. Returns the escaped length.
+        virtual size_t EscapeString(char* to, const char* from, const size_t length) = 0;
+
+        // For what only the client library can do: prepared statements, StreamQuery and DB_EXECUTION_EVENT_LOOP.
+        //  Null for every other backend.
+        virtual MYSQL* getMysql() const { return nullptr; }
+};
+
+// Makes one backend per connection, see Database::SetBackend.
+typedef std::function<std::unique_ptr<DatabaseBackend>()> DatabaseBackendFactory;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,585 @@
+#include "Database.h"
+#include "DatabaseConnection.h"
+#include "MysqlBackend.h"
+
+DatabaseConnection::DatabaseConnection(std::unique_ptr<DatabaseBackend> pBackend) :
+    m_pBackend(pBackend ? std::move(pBackend) : std::unique_ptr<DatabaseBackend>(new MysqlBackend())),
+    m_bOpen(false),
+    m_bMultiStatements(false),
+    m_uiLastError(0),
+    m_uiThreadId(0),
+    m_uiMaxAllowedPacket(MAX_QUERY_LEN),
+    m_pCache(nullptr),
+    m_pMetrics(nullptr)
+{
+
+}
+
+DatabaseConnection::~DatabaseConnection()
+{
+    Close();
+}
+
+bool DatabaseConnection::Open(const std::string& strHost, const std::string& strPortOrSocket, const std::string& strUser, const std::string& strPassword, const std::string& strDbName, const bool bNonBlocking)
+{
+    if (!m_pBackend->Open(strHost, strPortOrSocket, strUser, strPassword, strDbName, bNonBlocking))
+        return false;
+
+    m_bOpen = true;
+
+    // Anything else seen later means the library reconnected us.
+    m_uiThreadId = m_pBackend->getThreadId();
+
+    // No worker is running yet, so these go straight to the server.
+    RawMysqlQueryCall("SET NAMES `utf8`", true);
+    RawMysqlQueryCall("SET CHARACTER SET `utf8`", true);
+
+    if (std::shared_ptr<QueryResult> result = PerformQuery("SELECT @@max_allowed_packet"))
+        m_uiMaxAllowedPacket = (*result)[0].getUInt64();
+
+    return true;
+}
+
+void DatabaseConnection::Close()
+{
+    ClearStatements();
+
+    if (m_bOpen)
+        m_pBackend->Close();
+
+    m_bOpen = false;
+}
+
+std::shared_ptr<QueryResult> DatabaseConnection::PerformQuery(const std::string& strQuery)
+{
+    ASSERT(m_bOpen);
+
+    const int64 iStartUs = DatabaseMetrics::NowUs();
+    
+    if (!SendQuery(strQuery))
+    {
+        RecordQuery(strQuery, iStartUs, false);
+        return nullptr;
+    }
+
+    std::shared_ptr<QueryResult> result = m_pBackend->StoreResult(m_pMetrics);
+    RecordQuery(strQuery, iStartUs, true);
+    return result;
+}
+
+bool DatabaseConnection::PerformQueryToStorage(const std::string& strQuery, std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount)
+{
+    ASSERT(m_bOpen);
+
+    const int64 iStartUs = DatabaseMetrics::NowUs();
+
+    if (!SendQuery(strQuery))
+    {
+        RecordQuery(strQuery, iStartUs, false);
+        return false;
+    }
+
+    const bool bSuccess = m_pBackend->StoreResultCopy(storage, fieldCount);
+
+    if (m_pMetrics && storage && fieldCount)
+    {
+        m_pMetrics->RecordRows(storage->vCells.size() / fieldCount);
+        m_pMetrics->RecordBytes(storage->vData.size());
+    }
+
+    RecordQuery(strQuery, iStartUs, bSuccess);
+    return bSuccess;
+}
+
+MYSQL_RES* DatabaseConnection::PerformStreamQuery(const std::string& strQuery)
+{
+    ASSERT(m_bOpen);
+
+    MYSQL* pMysql = getMysql();
+
+    if (!pMysql)
+    {
+        printf("DatabaseConnection::PerformStreamQuery - The backend can't stream results.");
+        return nullptr;
+    }
+    
+    if (!RawMysqlQueryCall(strQuery))
+        return nullptr;
+
+    MYSQL_RES* pResult = mysql_use_result(pMysql);
+
+    if (pResult && !mysql_num_fields(pResult))
+    {
+        mysql_free_result(pResult);
+        return nullptr;
+    }
+
+    return pResult;
+}
+
+bool DatabaseConnection::isTransactionalTable(const std::string& strTable)
+{
+    auto itr = m_uoTransactionalTables.find(strTable);
+
+    if (itr != m_uoTransactionalTables.end())
+        return itr->second;
+
+    std::string strEscaped(strTable.size() * 2 + 1, '\0');
+    strEscaped.resize(m_pBackend->EscapeString(&strEscaped[0], strTable.c_str(), strTable.size()));
+
+    std::shared_ptr<QueryResult> result = PerformQuery("SELECT ENGINE FROM information_schema.TABLES WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = '" + strEscaped + "'");
+
+    // Asked again next time, the lookup itself may have failed.
+    if (!result)
+        return false;
+
+    const bool bTransactional = result->fetchCurrentRow()[0].getCppString() == "InnoDB";
+    m_uoTransactionalTables[strTable] = bTransactional;
+    return bTransactional;
+}
+
+bool DatabaseConnection::ExecuteMultiStatement(const std::string& strStatements, std::vector<std::shared_ptr<QueryResult>>* pResults)
+{
+    ASSERT(m_bOpen);
+
+    SetMultiStatements(true);
+    m_uiLastError = 0;
+    uint32 uiStatement = 0;
+
+    // Batches are never the same twice, they're all timed as one kind of statement.
+    static const std::string s_strBatch = "<multi statement batch>";
+    static const uint64 s_uiBatchFingerprint = DatabaseMetrics::Fingerprint(s_strBatch.data(), s_strBatch.size());
+    const int64 iStartUs = DatabaseMetrics::NowUs();
+
+    if (m_pBackend->MultiQuery(strStatements, uiStatement, pResults, m_pMetrics))
+    {
+        CheckReconnect();
+
+        if (m_pMetrics)
+            m_pMetrics->RecordStatement(s_uiBatchFingerprint, s_strBatch, uint64(DatabaseMetrics::NowUs() - iStartUs), true);
+
+        return true;
+    }
+
+    m_uiLastError = m_pBackend->getErrno();
+    printf("SQL Error: '%s'.", m_pBackend->getError());
+    printf("In statement %u of a multi statement batch.", uiStatement);
+
+    if (m_pMetrics)
+        m_pMetrics->RecordStatement(s_uiBatchFingerprint, s_strBatch, uint64(DatabaseMetrics::NowUs() - iStartUs), false);
+
+    CheckReconnect();
+    return false;
+}
+
+bool DatabaseConnection::RawMysqlQueryCall(const std::string& strQuery, const bool bDeleteGatheredData)
+{    
+    ASSERT(m_bOpen);
+
+    const int64 iStartUs = DatabaseMetrics::NowUs();
+
+    if (!SendQuery(strQuery))
+    {
+        RecordQuery(strQuery, iStartUs, false);
+        return false;
+    }
+
+    if (bDeleteGatheredData)
+        m_pBackend->DiscardResult();
+
+    RecordQuery(strQuery, iStartUs, true);
+    return true;
+}
+
+bool DatabaseConnection::LoadData(const std::string& strStatement, const std::string& strData, uint64& rows)
+{
+    ASSERT(m_bOpen);
+
+    m_uiLastError = 0;
+    rows = 0;
+
+    const int64 iStartUs = DatabaseMetrics::NowUs();
+
+    if (!m_pBackend->LoadData(strStatement, strData.data(), strData.size(), rows))
+    {
+        m_uiLastError = m_pBackend->getErrno();
+        printf("SQL Error: '%s'.", m_pBackend->getError());
+        printf("Query: '%s'.", strStatement.c_str());
+        CheckReconnect();
+        RecordQuery(strStatement, iStartUs, false);
+        return false;
+    }
+
+    CheckReconnect();
+    NotifyWrite(strStatement);
+    RecordQuery(strStatement, iStartUs, true);
+    return true;
+}
+
+bool DatabaseConnection::SendQuery(const std::string& strQuery)
+{
+    SetMultiStatements(false);
+    m_uiLastError = 0;
+
+    if (!m_pBackend->Query(strQuery))
+    {
+        m_uiLastError = m_pBackend->getErrno();
+        printf("SQL Error: '%s'.", m_pBackend->getError());
+        printf("Query: '%s'.", strQuery.c_str());
+        CheckReconnect();
+        return false;
+    }
+
+    CheckReconnect();
+    NotifyWrite(strQuery);
+    return true;
+}
+
+void DatabaseConnection::RecordQuery(const std::string& strQuery, const int64 iStartUs, const bool bSuccess)
+{
+    if (m_pMetrics)
+        m_pMetrics->RecordQuery(strQuery, uint64(DatabaseMetrics::NowUs() - iStartUs), bSuccess);
+}
+
+void DatabaseConnection::CheckReconnect()
+{
+    if (m_pBackend->getThreadId() == m_uiThreadId)
+        return;
+
+    // Statements don't survive a reconnect, the old handles are useless. The new session starts with multi statements off.
+    ClearStatements();
+    m_uiThreadId = m_pBackend->getThreadId();
+    m_bMultiStatements = false;
+
+    if (m_pMetrics)
+        m_pMetrics->RecordReconnect();
+}
+
+
+void DatabaseConnection::ClearStatements()
+{
+    for (auto itr = m_uoStatements.begin(); itr != m_uoStatements.end(); ++itr)
+        mysql_stmt_close(itr->second);
+
+    m_uoStatements.clear();
+}
+
+MYSQL_STMT* DatabaseConnection::GetStatement(Database& db, const uint32 id)
+{
+    ASSERT(m_bOpen);
+
+    if (!getMysql())
+    {
+        printf("DatabaseConnection::GetStatement - The backend has no prepared statements, can't run statement %u.", id);
+        return nullptr;
+    }
+
+    CheckReconnect();
+
+    auto itr = m_uoStatements.find(id);
+
+    if (itr != m_uoStatements.end())
+        return itr->second;
+
+    std::string strSql;
+
+    if (!db.getStatementSql(id, strSql))
+    {
+        printf("DatabaseConnection::GetStatement - Statement %u was never registered.", id);
+        return nullptr;
+    }
+
+    MYSQL_STMT* pStmt = mysql_stmt_init(getMysql());
+
+    if (!pStmt)
+    {
+        printf("DatabaseConnection::GetStatement - Could not initialize statement %u.", id);
+        return nullptr;
+    }
+
+    if (mysql_stmt_prepare(pStmt, strSql.c_str(), (unsigned long)strSql.size()))
+    {
+        printf("SQL Error: '%s'.", mysql_stmt_error(pStmt));
+        printf("Statement: '%s'.", strSql.c_str());
+        mysql_stmt_close(pStmt);
+        return nullptr;
+    }
+
+    if (m_uoStatementInfo.find(id) == m_uoStatementInfo.end())
+    {
+        StatementInfo& info = m_uoStatementInfo[id];
+        info.strSql = strSql;
+        info.strTable = QueryCache::getWrittenTable(strSql);
+        info.uiFingerprint = DatabaseMetrics::Fingerprint(strSql.data(), strSql.size());
+    }
+
+    // So the result buffers can be sized from the stored rows.
+    my_bool my_true = (my_bool)1;
+    mysql_stmt_attr_set(pStmt, STMT_ATTR_UPDATE_MAX_LENGTH, &my_true);
+
+    m_uoStatements[id] = pStmt;
+    return pStmt;
+}
+
+bool DatabaseConnection::ExecuteStatement(Database& db, const PreparedStatement& stmt, std::shared_ptr<QueryResult>* pResult)
+{
+    const int64 iStartUs = DatabaseMetrics::NowUs();
+    const bool bSuccess = RunStatement(db, stmt, pResult);
+
+    if (m_pMetrics)
+    {
+        auto itr = m_uoStatementInfo.find(stmt.getId());
+
+        // Never prepared, so there's nothing to put it under.
+        if (itr == m_uoStatementInfo.end())
+            m_pMetrics->RecordError();
+        else
+            m_pMetrics->RecordStatement(itr->second.uiFingerprint, itr->second.strSql, uint64(DatabaseMetrics::NowUs() - iStartUs), bSuccess);
+    }
+
+    return bSuccess;
+}
+
+bool DatabaseConnection::RunStatement(Database& db, const PreparedStatement& stmt, std::shared_ptr<QueryResult>* pResult)
+{
+    MYSQL_STMT* pStmt = GetStatement(db, stmt.getId());
+
+    if (!pStmt)
+        return false;
+
+    if (!BindAndExecute(pStmt, stmt))
+    {
+        // The handle is gone (ER_UNKNOWN_STMT_HANDLER, CR_NO_PREPARE_STMT), or the connection was lost under the statement.
+        //  Ping so it reconnects, then prepare it again once. A write that was lost with the connection may have run already,
+        //  so only reads are run again then.
+        const uint32 uiError = mysql_stmt_errno(pStmt);
+        const bool bLost = isConnectionLost(uiError);
+
+        if (!bLost && uiError != 2030 && uiError != 1243)
+            return false;
+
+        m_pBackend->Ping();
+        CheckReconnect();
+        ClearStatements();
+
+        if (bLost && !db.isReadStatement(stmt.getId()))
+            return false;
+
+        if (!(pStmt = GetStatement(db, stmt.getId())) || !BindAndExecute(pStmt, stmt))
+            return false;
+    }
+
+    NotifyStatementWrite(stmt.getId());
+
+    bool bSuccess = true;
+
+    if (mysql_stmt_field_count(pStmt))
+    {
+        if (pResult)
+            bSuccess = StoreStatementResult(pStmt, *pResult);
+
+        mysql_stmt_free_result(pStmt);
+    }
+
+    return bSuccess;
+}
+
+void DatabaseConnection::NotifyStatementWrite(const uint32 id)
+{
+    if (!m_pCache || !m_pCache->isEnabled())
+        return;
+
+    auto itr = m_uoStatementInfo.find(id);
+
+    if (itr != m_uoStatementInfo.end() && !itr->second.strTable.empty())
+        m_pCache->Invalidate(itr->second.strTable.c_str());
+}
+
+bool DatabaseConnection::BindAndExecute(MYSQL_STMT* pStmt, const PreparedStatement& stmt)
+{
+    const std::vector<PreparedValue>& vValues = stmt.getValues();
+
+    if (vValues.size() != mysql_stmt_param_count(pStmt))
+    {
+        printf("DatabaseConnection::BindAndExecute - Statement %u expects %lu parameters, got %u.", stmt.getId(), mysql_stmt_param_count(pStmt), uint32(vValues.size()));
+        return false;
+    }
+
+    std::vector<MYSQL_BIND> vBinds(vValues.size());
+    std::vector<unsigned long> vLengths(vValues.size());
+
+    for (size_t i = 0; i < vValues.size(); ++i)
+    {
+        const PreparedValue& value = vValues[i];
+        MYSQL_BIND& bind = vBinds[i];
+
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = value.eType;
+        bind.is_unsigned = value.bUnsigned;
+
+        // The library only reads parameter buffers.
+        switch (value.eType)
+        {
+            case MYSQL_TYPE_LONGLONG:
+                bind.buffer = const_cast<uint64*>(&value.uiValue);
+                break;
+            case MYSQL_TYPE_FLOAT:
+                bind.buffer = const_cast<float*>(&value.fValue);
+                break;
+            case MYSQL_TYPE_DOUBLE:
+                bind.buffer = const_cast<double*>(&value.dValue);
+                break;
+            case MYSQL_TYPE_STRING:
+                vLengths[i] = (unsigned long)value.strValue.size();
+                bind.buffer = const_cast<char*>(value.strValue.data());
+                bind.buffer_length = vLengths[i];
+                bind.length = &vLengths[i];
+                break;
+            default:
+                break;
+        }
+    }
+
+    m_uiLastError = 0;
+
+    if ((!vBinds.empty() && mysql_stmt_bind_param(pStmt, vBinds.data())) || mysql_stmt_execute(pStmt))
+    {
+        m_uiLastError = mysql_stmt_errno(pStmt);
+        printf("SQL Error: '%s'.", mysql_stmt_error(pStmt));
+        printf("Statement: '%u'.", stmt.getId());
+        return false;
+    }
+
+    return true;
+}
+
+bool DatabaseConnection::StoreStatementResult(MYSQL_STMT* pStmt, std::shared_ptr<QueryResult>& result)
+{
+    if (mysql_stmt_store_result(pStmt))
+    {
+        printf("SQL Error: '%s'.", mysql_stmt_error(pStmt));
+        return false;
+    }
+
+    const uint32 uiNumFields = mysql_stmt_field_count(pStmt);
+
+    if (!mysql_stmt_num_rows(pStmt))
+        return true;
+
+    MYSQL_RES* pMeta = mysql_stmt_result_metadata(pStmt);
+
+    if (!pMeta)
+        return false;
+
+    MYSQL_FIELD* pFields = mysql_fetch_fields(pMeta);
+
+    // Integer and floating point columns are fetched as 64 bit binary values, decoded once here rather than on every getter.
+    // Everything else comes back as text, sized to the longest value in the stored rows.
+    std::vector<MYSQL_BIND> vBinds(uiNumFields);
+    std::vector<DbFieldType> vTypes(uiNumFields, DB_FIELD_TEXT);
+    std::vector<bool> vFloats(uiNumFields, false);
+    std::vector<DbBinaryValue> vBinary(uiNumFields);
+    std::vector<std::vector<char>> vBuffers(uiNumFields);
+    std::vector<unsigned long> vLengths(uiNumFields);
+    std::vector<my_bool> vNulls(uiNumFields);
+
+    for (uint32 i = 0; i < uiNumFields; ++i)
+    {
+        memset(&vBinds[i], 0, sizeof(MYSQL_BIND));
+        vBinds[i].length = &vLengths[i];
+        vBinds[i].is_null = &vNulls[i];
+
+        switch (pFields[i].type)
+        {
+            case MYSQL_TYPE_TINY:
+            case MYSQL_TYPE_SHORT:
+            case MYSQL_TYPE_INT24:
+            case MYSQL_TYPE_LONG:
+            case MYSQL_TYPE_LONGLONG:
+            case MYSQL_TYPE_YEAR:
+                vTypes[i] = (pFields[i].flags & UNSIGNED_FLAG) ? DB_FIELD_UINT64 : DB_FIELD_INT64;
+                vBinds[i].buffer_type = MYSQL_TYPE_LONGLONG;
+                vBinds[i].is_unsigned = (pFields[i].flags & UNSIGNED_FLAG) != 0;
+                vBinds[i].buffer = &vBinary[i];
+                break;
+            case MYSQL_TYPE_FLOAT:
+            case MYSQL_TYPE_DOUBLE:
+                vTypes[i] = DB_FIELD_DOUBLE;
+                vFloats[i] = pFields[i].type == MYSQL_TYPE_FLOAT;
+                vBinds[i].buffer_type = MYSQL_TYPE_DOUBLE;
+                vBinds[i].buffer = &vBinary[i];
+                break;
+            default:
+                vBuffers[i].resize(pFields[i].max_length + 1);
+                vBinds[i].buffer_type = MYSQL_TYPE_STRING;
+                vBinds[i].buffer = vBuffers[i].data();
+                vBinds[i].buffer_length = (unsigned long)vBuffers[i].size();
+                break;
+        }
+    }
+
+    std::shared_ptr<QueryResultStorage> pStorage = std::make_shared<QueryResultStorage>();
+    pStorage->vCells.reserve(size_t(mysql_stmt_num_rows(pStmt)) * uiNumFields);
+
+    for (uint32 i = 0; i < uiNumFields; ++i)
+        pStorage->vColumns.push_back(pFields[i].name);
+
+    mysql_free_result(pMeta);
+
+    if (mysql_stmt_bind_result(pStmt, vBinds.data()))
+    {
+        printf("SQL Error: '%s'.", mysql_stmt_error(pStmt));
+        return false;
+    }
+
+
+    int iStatus;
+
+    while ((iStatus = mysql_stmt_fetch(pStmt)) == 0 || iStatus == MYSQL_DATA_TRUNCATED)
+    {
+        for (uint32 i = 0; i < uiNumFields; ++i)
+        {
+            if (vNulls[i])
+            {
+                pStorage->addNull();
+                continue;
+            }
+
+            // Keep a text form too, so getString works on every column.
+            char szNumber[32];
+            std::to_chars_result res;
+
+            switch (vTypes[i])
+            {
+                case DB_FIELD_INT64:
+                    res = std::to_chars(szNumber, szNumber + sizeof(szNumber), vBinary[i].iValue);
+                    break;
+                case DB_FIELD_UINT64:
+                    res = std::to_chars(szNumber, szNumber + sizeof(szNumber), vBinary[i].uiValue);
+                    break;
+                case DB_FIELD_DOUBLE:
+                    if (vFloats[i])
+                        res = std::to_chars(szNumber, szNumber + sizeof(szNumber), float(vBinary[i].dValue));
+                    else
+                        res = std::to_chars(szNumber, szNumber + sizeof(szNumber), vBinary[i].dValue);
+                    break;
+                default:
+                    pStorage->addCell(vBuffers[i].data(), std::min<size_t>(vLengths[i], vBuffers[i].size() - 1));
+                    continue;
+            }
+
+            pStorage->addBinaryCell(szNumber, res.ptr - szNumber, vTypes[i], vBinary[i]);
+        }
+    }
+
+    if (m_pMetrics)
+    {
+        m_pMetrics->RecordRows(mysql_stmt_num_rows(pStmt));
+        m_pMetrics->RecordBytes(pStorage->vData.size());
+    }
+
+    if (!pStorage->vCells.empty())
+        result = std::make_shared<QueryResult>(pStorage, uiNumFields);
+
+    return true;
+}
\ No newline at end of file
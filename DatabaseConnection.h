@@ -0,0 +1,171 @@
+#ifndef DATABASECONNECTION_H
+#define DATABASECONNECTION_H
+
+#include "QueryResult.h"
+#include "PreparedStatement.h"
+#include "QueryCache.h"
+#include "DatabaseMetrics.h"
+#include "DatabaseBackend.h"
+
+#include <mysql.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class Database;
+
+// One backend connection (normally a MYSQL handle) plus the mutex that serializes its use.
+// Database owns a pool of these, one per worker thread.
+class DatabaseConnection
+{
+    friend class Database;
+    friend class AsyncEngine;
+
+    public:
+        // Talks to MySQL unless another backend is given (see Database::SetBackend).
+        DatabaseConnection(std::unique_ptr<DatabaseBackend> pBackend = nullptr);
+        ~DatabaseConnection();
+
+        // bNonBlocking enables MariaDB's non-blocking API on the handle (the blocking calls keep working too).
+        bool Open(const std::string& strHost, const std::string& strPortOrSocket, const std::string& strUser, const std::string& strPassword, const std::string& strDbName, const bool bNonBlocking = false);
+        void Close();
+
+        // It's assumed that m_mutex is already locked in scope when any of these functions are called.
+        
+        // Returns true if success, false if fail.
+        bool RawMysqlQueryCall(const std::string& strQuery, const bool bDeleteGatheredData = false);
+
+        std::shared_ptr<QueryResult> PerformQuery(const std::string& strQuery);
+
+        // Same as PerformQuery, but the rows are copied out so several results can share them (see QueryCache).
+        //  Returns true if success, false if fail. storage is left null when there are no rows.
+        bool PerformQueryToStorage(const std::string& strQuery, std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount);
+
+        // Sends several ';' separated statements in one packet and reads every result, into pResults (in order, null for no rows) if given.
+        //  Returns true if success, false if any statement failed, the server doesn't run the ones after it.
+        //  pResults then holds the results of the ones before it.
+        bool ExecuteMultiStatement(const std::string& strStatements, std::vector<std::shared_ptr<QueryResult>>* pResults = nullptr);
+
+        // Multi statements are only on for ExecuteMultiStatement. They're switched on for it and off again before the next single query,
+        //  so batches back to back don't pay a round trip each. Only needed before sending SQL some other way.
+        // Runs strStatement, a LOAD DATA LOCAL INFILE, reading the file from strData. rows is how many it loaded.
+        //  Returns true if success, false if fail.
+        bool LoadData(const std::string& strStatement, const std::string& strData, uint64& rows);
+
+        void SetMultiStatements(const bool bEnable)
+        {
+            if (m_bMultiStatements == bEnable)
+                return;
+
+            m_pBackend->SetMultiStatements(bEnable);
+            m_bMultiStatements = bEnable;
+        }
+
+        // Returns the unbuffered result, the caller must read or free it before using the connection again.
+        //  Needs a MySQL backend, like ExecuteStatement.
+        MYSQL_RES* PerformStreamQuery(const std::string& strQuery);
+
+        // Returns true if success, false if fail. When pResult is given, the rows (if any) are copied into it.
+        // The statement is prepared on this connection the first time it's used, and again after a reconnect.
+        bool ExecuteStatement(Database& db, const PreparedStatement& stmt, std::shared_ptr<QueryResult>* pResult = nullptr);
+
+        // Null unless the backend is the MySQL client library.
+        MYSQL* getMysql() const { return m_pBackend->getMysql(); }
+
+        DatabaseBackend& getBackend() const { return *m_pBackend; }
+
+        // The error number from the last failed call above, 0 if it succeeded.
+        uint32 getLastError() const { return m_uiLastError; }
+
+        // For failures found some other way, e.g. the session changing under a transaction.
+        void SetLastError(const uint32 error) { m_uiLastError = error; }
+
+        // The server side session id, it changes when the library reconnected.
+        unsigned long getThreadId() const { return m_pBackend->getThreadId(); }
+
+        // Off while a transaction runs, see TransactionQueryObj.
+        void SetReconnect(const bool bEnable) { m_pBackend->SetReconnect(bEnable); }
+
+        // CR_CONNECTION_ERROR, CR_CONN_HOST_ERROR, CR_SERVER_GONE_ERROR, CR_SERVER_LOST and CR_SERVER_LOST_EXTENDED:
+        //  the server may not have seen the statement at all.
+        static bool isConnectionLost(const uint32 error) { return error == 2002 || error == 2003 || error == 2006 || error == 2013 || error == 2055; }
+
+        // True if strTable (in the connection's database) is InnoDB, where a failed statement leaves nothing behind.
+        //  Looked up once per table, false if it can't be.
+        bool isTransactionalTable(const std::string& strTable);
+
+        // The server's max_allowed_packet, read when the connection was opened.
+        uint64 getMaxAllowedPacket() const { return m_uiMaxAllowedPacket; }
+
+        // Lets the cache (if any) drop what strQuery just changed.
+        void NotifyWrite(const std::string& strQuery) { if (m_pCache) m_pCache->OnWrite(strQuery); }
+        void NotifyStatementWrite(const uint32 id);
+
+        // For a statement that ran in an ExecuteMultiStatement batch, which only times the batch as a whole:
+        //  lets the cache know about it and records it under its own fingerprint, us being its share of the batch.
+        void RecordBatchedStatement(const std::string& strQuery, const uint64 us)
+        {
+            NotifyWrite(strQuery);
+
+            if (m_pMetrics)
+                m_pMetrics->RecordQuery(strQuery, us, true);
+        }
+
+        operator bool () const { return m_bOpen; }
+
+    private:
+        // The query part of the calls above: sets m_uiLastError, reports errors and lets the cache know about writes.
+        bool SendQuery(const std::string& strQuery);
+        void RecordQuery(const std::string& strQuery, const int64 iStartUs, const bool bSuccess);
+
+        // Picks up a reconnect done by the library, the statements prepared before it are gone.
+        void CheckReconnect();
+
+        bool RunStatement(Database& db, const PreparedStatement& stmt, std::shared_ptr<QueryResult>* pResult);
+        MYSQL_STMT* GetStatement(Database& db, const uint32 id);
+        bool BindAndExecute(MYSQL_STMT* pStmt, const PreparedStatement& stmt);
+        bool StoreStatementResult(MYSQL_STMT* pStmt, std::shared_ptr<QueryResult>& result);
+        void ClearStatements();
+
+        std::unique_ptr<DatabaseBackend> m_pBackend;
+        bool m_bOpen;
+
+        // What the server was last told, see SetMultiStatements.
+        bool m_bMultiStatements;
+        std::mutex m_mutex;
+
+        uint32 m_uiLastError;
+
+        // Statement id -> handle prepared on this connection.
+        std::unordered_map<uint32, MYSQL_STMT*> m_uoStatements;
+
+        // Server side id of the session m_uoStatements were prepared in, it changes when we reconnect.
+        unsigned long m_uiThreadId;
+
+        uint64 m_uiMaxAllowedPacket;
+
+        // The Database's result cache, told about every write that succeeds here.
+        QueryCache* m_pCache;
+
+        // Where this Database's metrics go.
+        DatabaseMetrics* m_pMetrics;
+
+        struct StatementInfo
+        {
+            std::string strSql;
+
+            // The table it writes to, empty if it doesn't.
+            std::string strTable;
+
+            uint64 uiFingerprint;
+        };
+
+        // Statement id -> what's worked out from its SQL when it's first prepared, kept across reconnects.
+        std::unordered_map<uint32, StatementInfo> m_uoStatementInfo;
+
+        // Table -> whether it's transactional, see isTransactionalTable.
+        std::unordered_map<std::string, bool> m_uoTransactionalTables;
+};
+
+#endif
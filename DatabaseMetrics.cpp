@@ -0,0 +1,324 @@
+#include "Database.h"
+#include "DatabaseMetrics.h"
+
+#include <chrono>
+#include <cctype>
+
+static bool IsIdentifierChar(const char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
+
+uint64 DbLatencySnapshot::getPercentileUs(const double p) const
+{
+    if (!uiCount)
+        return 0;
+
+    const uint64 uiTarget = std::max<uint64>(1, uint64(p * double(uiCount) + 0.999999));
+    uint64 uiSeen = 0;
+
+    for (uint32 i = 0; i < DB_HISTOGRAM_BUCKETS - 1; ++i)
+    {
+        uiSeen += uiBuckets[i];
+
+        if (uiSeen >= uiTarget)
+            return std::min<uint64>(uint64(1) << i, uiMaxUs);
+    }
+
+    return uiMaxUs;
+}
+
+DbHistogram::DbHistogram() :
+    m_uiCount(0),
+    m_uiTotalUs(0),
+    m_uiMaxUs(0)
+{
+    for (uint32 i = 0; i < DB_HISTOGRAM_BUCKETS; ++i)
+        m_uiBuckets[i] = 0;
+}
+
+void DbHistogram::Record(const uint64 us)
+{
+    uint32 uiBucket = 0;
+
+    for (uint64 uiRest = us; uiRest && uiBucket < DB_HISTOGRAM_BUCKETS - 1; uiRest >>= 1)
+        ++uiBucket;
+
+    m_uiBuckets[uiBucket].fetch_add(1, std::memory_order_relaxed);
+    m_uiCount.fetch_add(1, std::memory_order_relaxed);
+    m_uiTotalUs.fetch_add(us, std::memory_order_relaxed);
+
+    uint64 uiMax = m_uiMaxUs.load(std::memory_order_relaxed);
+
+    while (us > uiMax && !m_uiMaxUs.compare_exchange_weak(uiMax, us, std::memory_order_relaxed))
+        ;
+}
+
+void DbHistogram::Snapshot(DbLatencySnapshot& result) const
+{
+    // Not one consistent moment, but every counter only grows, so it's never far off.
+    result.uiCount = 0;
+
+    for (uint32 i = 0; i < DB_HISTOGRAM_BUCKETS; ++i)
+    {
+        result.uiBuckets[i] = m_uiBuckets[i].load(std::memory_order_relaxed);
+        result.uiCount += result.uiBuckets[i];
+    }
+
+    result.uiTotalUs = m_uiTotalUs.load(std::memory_order_relaxed);
+    result.uiMaxUs = m_uiMaxUs.load(std::memory_order_relaxed);
+}
+
+DatabaseMetrics::DatabaseMetrics() :
+    m_pStatements(new StatementSlot[DB_METRICS_STATEMENTS]),
+    m_uiLaneCount(0),
+    m_uiRows(0),
+    m_uiBytes(0),
+    m_uiErrors(0),
+    m_uiReconnects(0),
+    m_uiReplicaReads(0),
+    m_uiReplicaFallbacks(0)
+{
+    
+}
+
+int64 DatabaseMetrics::NowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64 DatabaseMetrics::Fingerprint(const char* query, const size_t length, char* normalized, const size_t normalizedSize)
+{
+    // FNV-1a of the query as if literals were '?', keywords lower case, only the spaces between words kept
+    // and "?, ?, ?" squashed into one '?'.
+    // normalized (if given) gets the same characters that are hashed, cut to fit with its NUL.
+    uint64 uiHash = 14695981039346656037ULL;
+    size_t uiWritten = 0;
+
+    auto add = [&](const char c)
+    {
+        uiHash = (uiHash ^ uint8(c)) * 1099511628211ULL;
+
+        if (normalized && uiWritten + 1 < normalizedSize)
+            normalized[uiWritten++] = c;
+    };
+
+    char cLast = ',';
+    bool bSpace = false;
+    bool bComma = false;
+
+    for (size_t i = 0; i < length; )
+    {
+        const char c = query[i];
+
+        if (isspace((unsigned char)c))
+        {
+            bSpace = true;
+            ++i;
+            continue;
+        }
+
+        bool bLiteral = false;
+
+        if (c == '\'' || c == '"')
+        {
+            // Past the closing quote, skipping escaped and doubled ones.
+            for (++i; i < length; ++i)
+            {
+                if (query[i] == '\\')
+                    ++i;
+                else if (query[i] == c && !(i + 1 < length && query[i + 1] == c))
+                    break;
+                else if (query[i] == c)
+                    ++i;
+            }
+
+            ++i;
+            bLiteral = true;
+        }
+        else if (c == '?')
+        {
+            // Prepared statement placeholders, so they match the same query sent as text.
+            ++i;
+            bLiteral = true;
+        }
+        else if (isdigit((unsigned char)c) && (bSpace || !IsIdentifierChar(cLast)))
+        {
+            // Also takes in hex, decimals and exponents.
+            while (i < length && (IsIdentifierChar(query[i]) || query[i] == '.'))
+                ++i;
+
+            bLiteral = true;
+        }
+
+        if (bLiteral)
+        {
+            bSpace = false;
+
+            // Another value in the list.
+            if (bComma)
+            {
+                bComma = false;
+                continue;
+            }
+
+            cLast = '?';
+            add('?');
+            continue;
+        }
+
+        ++i;
+
+        if (c == ',' && cLast == '?' && !bComma)
+        {
+            bComma = true;
+            bSpace = false;
+            continue;
+        }
+
+        if (bComma)
+        {
+            add(',');
+            cLast = ',';
+            bComma = false;
+        }
+
+        if (bSpace && IsIdentifierChar(cLast) && IsIdentifierChar(c))
+            add(' ');
+
+        bSpace = false;
+        cLast = char(tolower((unsigned char)c));
+        add(cLast);
+    }
+
+    if (normalized && normalizedSize)
+        normalized[uiWritten] = '\0';
+
+    // 0 marks a free slot.
+    return uiHash ? uiHash : 1;
+}
+
+void DatabaseMetrics::SetLanes(const uint32 count)
+{
+    m_pLanes.reset(new Lane[count]);
+    m_uiLaneCount = count;
+}
+
+void DatabaseMetrics::SetLaneBacklog(const uint32 lane, const QueryLanes& backlog)
+{
+    ASSERT(lane < m_uiLaneCount);
+
+    for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+        m_pLanes[lane].uiBacklog[i].store(backlog.getDepth(DbPriority(i)), std::memory_order_relaxed);
+
+    m_pLanes[lane].iOldestQueuedUs.store(backlog.getOldestQueuedUs(), std::memory_order_relaxed);
+}
+
+DatabaseMetrics::StatementSlot& DatabaseMetrics::FindSlot(const uint64 fingerprint, const std::string& strSample)
+{
+    for (uint32 i = 0; i < DB_METRICS_STATEMENTS; ++i)
+    {
+        StatementSlot& slot = m_pStatements[(fingerprint + i) % DB_METRICS_STATEMENTS];
+        uint64 uiCurrent = slot.uiFingerprint.load(std::memory_order_acquire);
+
+        if (uiCurrent == fingerprint)
+            return slot;
+
+        if (uiCurrent)
+            continue;
+
+        if (slot.uiFingerprint.compare_exchange_strong(uiCurrent, fingerprint, std::memory_order_acq_rel))
+        {
+            // The literals could be names or other private values, only the shape of the query is kept.
+            Fingerprint(strSample.data(), strSample.size(), slot.szSample, DB_METRICS_SAMPLE_LEN);
+            slot.bSampleReady.store(true, std::memory_order_release);
+            return slot;
+        }
+
+        // Someone else just claimed it, maybe for the same fingerprint.
+        if (uiCurrent == fingerprint)
+            return slot;
+    }
+
+    return m_otherStatements;
+}
+
+void DatabaseMetrics::RecordQuery(const std::string& strQuery, const uint64 us, const bool success)
+{
+    RecordStatement(Fingerprint(strQuery.data(), strQuery.size()), strQuery, us, success);
+}
+
+void DatabaseMetrics::RecordStatement(const uint64 fingerprint, const std::string& strSample, const uint64 us, const bool success)
+{
+    StatementSlot& slot = FindSlot(fingerprint, strSample);
+    slot.latency.Record(us);
+
+    if (!success)
+    {
+        slot.uiErrors.fetch_add(1, std::memory_order_relaxed);
+        RecordError();
+    }
+}
+
+void DatabaseMetrics::Snapshot(DatabaseMetricsSnapshot& result) const
+{
+    const int64 iNow = NowUs();
+
+    result.uiQueueDepth = 0;
+    result.uiOldestQueuedUs = 0;
+
+    for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+        result.uiPriorityDepth[i] = 0;
+
+    for (uint32 i = 0; i < m_uiLaneCount; ++i)
+    {
+        for (uint32 j = 0; j < DB_PRIORITY_COUNT; ++j)
+        {
+            const uint64 uiBacklog = m_pLanes[i].uiBacklog[j].load(std::memory_order_relaxed);
+            result.uiPriorityDepth[j] += uiBacklog;
+            result.uiQueueDepth += uiBacklog;
+        }
+
+        const int64 iOldest = m_pLanes[i].iOldestQueuedUs.load(std::memory_order_relaxed);
+
+        if (iOldest && iNow > iOldest)
+            result.uiOldestQueuedUs = std::max<uint64>(result.uiOldestQueuedUs, uint64(iNow - iOldest));
+    }
+
+    m_queueWait.Snapshot(result.queueWait);
+    m_callerLockWait.Snapshot(result.callerLockWait);
+    m_workerLockWait.Snapshot(result.workerLockWait);
+
+    result.uiRows = m_uiRows.load(std::memory_order_relaxed);
+    result.uiBytes = m_uiBytes.load(std::memory_order_relaxed);
+    result.uiErrors = m_uiErrors.load(std::memory_order_relaxed);
+    result.uiReconnects = m_uiReconnects.load(std::memory_order_relaxed);
+    result.uiReplicaReads = m_uiReplicaReads.load(std::memory_order_relaxed);
+    result.uiReplicaFallbacks = m_uiReplicaFallbacks.load(std::memory_order_relaxed);
+
+    result.vStatements.clear();
+
+    for (uint32 i = 0; i <= DB_METRICS_STATEMENTS; ++i)
+    {
+        const StatementSlot& slot = i < DB_METRICS_STATEMENTS ? m_pStatements[i] : m_otherStatements;
+        const uint64 uiFingerprint = slot.uiFingerprint.load(std::memory_order_acquire);
+
+        if (i < DB_METRICS_STATEMENTS && !uiFingerprint)
+            continue;
+
+        DbStatementSnapshot statement;
+        statement.uiFingerprint = uiFingerprint;
+        statement.uiErrors = slot.uiErrors.load(std::memory_order_relaxed);
+        slot.latency.Snapshot(statement.latency);
+
+        if (!statement.latency.uiCount)
+            continue;
+
+        if (slot.bSampleReady.load(std::memory_order_acquire))
+            statement.strSample = slot.szSample;
+        else if (i == DB_METRICS_STATEMENTS)
+            statement.strSample = "other";
+
+        result.vStatements.push_back(statement);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,191 @@
+#ifndef DATABASEMETRICS_H
+#define DATABASEMETRICS_H
+
+#include "DbField.h"
+#include "QueryLanes.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Bucket i holds samples of less than 2^i microseconds (the last one holds everything longer).
+#define DB_HISTOGRAM_BUCKETS 32
+
+// Distinct statement fingerprints tracked, anything past that is counted under one "other" entry.
+#define DB_METRICS_STATEMENTS 512
+
+#define DB_METRICS_SAMPLE_LEN 128
+
+struct DbLatencySnapshot
+{
+    uint64 uiCount;
+    uint64 uiTotalUs;
+    uint64 uiMaxUs;
+    uint64 uiBuckets[DB_HISTOGRAM_BUCKETS];
+
+    // The upper bound of the bucket the p'th (0 to 1) sample falls in, so within a factor of 2.
+    uint64 getPercentileUs(const double p) const;
+    uint64 getMeanUs() const { return uiCount ? uiTotalUs / uiCount : 0; }
+};
+
+// Log2 latency histogram, every member is a relaxed atomic so any thread can record without locking.
+class DbHistogram
+{
+    public:
+        DbHistogram();
+
+        void Record(const uint64 us);
+        void Snapshot(DbLatencySnapshot& result) const;
+
+    private:
+        std::atomic<uint64> m_uiCount;
+        std::atomic<uint64> m_uiTotalUs;
+        std::atomic<uint64> m_uiMaxUs;
+        std::atomic<uint64> m_uiBuckets[DB_HISTOGRAM_BUCKETS];
+};
+
+struct DbStatementSnapshot
+{
+    // 0 for the "other" entry.
+    uint64 uiFingerprint;
+
+    // The first query seen with this fingerprint with its literals as '?' (the text that was hashed), cut to DB_METRICS_SAMPLE_LEN.
+    std::string strSample;
+
+    uint64 uiErrors;
+    DbLatencySnapshot latency;
+};
+
+struct DatabaseMetricsSnapshot
+{
+    // Queued objects that haven't started yet, and how long the oldest of them has been waiting.
+    uint64 uiQueueDepth;
+    uint64 uiOldestQueuedUs;
+
+    // uiQueueDepth split by DbPriority.
+    uint64 uiPriorityDepth[DB_PRIORITY_COUNT];
+
+    // From being queued to starting.
+    DbLatencySnapshot queueWait;
+
+    // Blocking calls waiting for a connection, and workers waiting for theirs behind blocking calls.
+    DbLatencySnapshot callerLockWait;
+    DbLatencySnapshot workerLockWait;
+
+    // Rows from the server, and the bytes of them that were read.
+    uint64 uiRows;
+    uint64 uiBytes;
+
+    uint64 uiErrors;
+    uint64 uiReconnects;
+
+    // Queued objects not destroyed yet (so running ones too) and the bytes of SQL or data they hold, as counted
+    //  against Database::SetQueueLimits, and the most there ever were at once.
+    uint64 uiQueuedItems;
+    uint64 uiQueuedBytes;
+    uint64 uiQueuedItemsHighWater;
+    uint64 uiQueuedBytesHighWater;
+
+    // Queue calls that waited for room and how long, and the ones turned away.
+    DbLatencySnapshot queueBlocked;
+    uint64 uiQueueRejected;
+
+    // Plain SQL written to the spill file so far, and how much of it (and how many bytes of file) is still waiting there.
+    uint64 uiSpilled;
+    uint64 uiSpillPending;
+    uint64 uiSpillBytes;
+
+    // Reads sent to a replica, and reads that went to the primary because no replica was within the lag limit (or idle, for workers).
+    uint64 uiReplicaReads;
+    uint64 uiReplicaFallbacks;
+
+    // Per replica in the order they were added, as of the last check. -1 if it isn't replicating.
+    std::vector<int64> vReplicaLagMs;
+
+    // Every fingerprint seen so far.
+    std::vector<DbStatementSnapshot> vStatements;
+};
+
+// Everything Database::getMetrics reports. Recording never locks or allocates, so it's always on.
+class DatabaseMetrics
+{
+    public:
+        DatabaseMetrics();
+
+        static int64 NowUs();
+
+        // Hash of the query with its literals taken out, so "id = 1" and "id = 2" (and IN lists of any length) share one.
+        //  The text that was hashed ("select name from players where id=?") goes in normalized if given, cut to normalizedSize.
+        static uint64 Fingerprint(const char* query, const size_t length, char* normalized = nullptr, const size_t normalizedSize = 0);
+
+        // One lane per worker queue (or event loop connection), called before any of them start.
+        void SetLanes(const uint32 count);
+
+        // Called by whoever drains lane with the objects it has taken but not started.
+        void SetLaneBacklog(const uint32 lane, const QueryLanes& backlog);
+
+        void RecordQuery(const std::string& strQuery, const uint64 us, const bool success);
+        void RecordStatement(const uint64 fingerprint, const std::string& strSample, const uint64 us, const bool success);
+        void RecordQueueWait(const uint64 us) { m_queueWait.Record(us); }
+        void RecordCallerLockWait(const uint64 us) { m_callerLockWait.Record(us); }
+        void RecordWorkerLockWait(const uint64 us) { m_workerLockWait.Record(us); }
+        void RecordRows(const uint64 rows) { m_uiRows.fetch_add(rows, std::memory_order_relaxed); }
+        void RecordBytes(const uint64 bytes) { m_uiBytes.fetch_add(bytes, std::memory_order_relaxed); }
+        void RecordError() { m_uiErrors.fetch_add(1, std::memory_order_relaxed); }
+        void RecordReconnect() { m_uiReconnects.fetch_add(1, std::memory_order_relaxed); }
+        void RecordReplicaRead() { m_uiReplicaReads.fetch_add(1, std::memory_order_relaxed); }
+        void RecordReplicaFallback() { m_uiReplicaFallbacks.fetch_add(1, std::memory_order_relaxed); }
+
+        // Fills everything, the queue depth only with what the lanes reported, but vReplicaLagMs.
+        void Snapshot(DatabaseMetricsSnapshot& result) const;
+
+    private:
+        struct StatementSlot
+        {
+            StatementSlot() : uiFingerprint(0), bSampleReady(false), uiErrors(0) { szSample[0] = '\0'; }
+
+            std::atomic<uint64> uiFingerprint;
+
+            // Set once szSample is written, by whoever claimed the slot.
+            std::atomic<bool> bSampleReady;
+            char szSample[DB_METRICS_SAMPLE_LEN];
+
+            DbHistogram latency;
+            std::atomic<uint64> uiErrors;
+        };
+
+        struct Lane
+        {
+            Lane() : iOldestQueuedUs(0)
+            {
+                for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+                    uiBacklog[i] = 0;
+            }
+
+            std::atomic<uint64> uiBacklog[DB_PRIORITY_COUNT];
+            std::atomic<int64> iOldestQueuedUs;
+        };
+
+        // Open addressing on the fingerprint, slots are claimed for good.
+        StatementSlot& FindSlot(const uint64 fingerprint, const std::string& strSample);
+
+        std::unique_ptr<StatementSlot[]> m_pStatements;
+        StatementSlot m_otherStatements;
+
+        std::unique_ptr<Lane[]> m_pLanes;
+        uint32 m_uiLaneCount;
+
+        DbHistogram m_queueWait;
+        DbHistogram m_callerLockWait;
+        DbHistogram m_workerLockWait;
+
+        std::atomic<uint64> m_uiRows;
+        std::atomic<uint64> m_uiBytes;
+        std::atomic<uint64> m_uiErrors;
+        std::atomic<uint64> m_uiReconnects;
+        std::atomic<uint64> m_uiReplicaReads;
+        std::atomic<uint64> m_uiReplicaFallbacks;
+};
+
+#endif
\ No newline at end of file
@@ -1,51 +1,59 @@
-#include "DbField.h"
-#include "Database.h"
-
-DbField::DbField() : 
-    m_pData(nullptr)
-{
-
-}
-
-DbField::DbField(DbField &f)
-{
-    const char* value = nullptr;
-    value = f.getString();
-
-    if (value && (m_pData = new char[strlen(value) + 1]))
-        strcpy(m_pData, value);
-    else
-        m_pData = nullptr;
-}
-
-DbField::DbField(const char* value) 
-{
-    if (value && (m_pData = new char[strlen(value) + 1]))
-        strcpy(m_pData, value);
-    else
-        m_pData = nullptr;
-}
-
-DbField::~DbField()
-{
-    if (m_pData)
-        delete [] m_pData;
-}
-
-void DbField::SetValue(const char* value)
-{
-    if (m_pData)
-        delete [] m_pData;
-
-    if (value)
-    {
-        m_pData = new char[strlen(value) + 1];
-        strcpy(m_pData, value);
-    }
-    else
-    {
-        m_pData = nullptr;
-    }
-}
-
-
+#include "DbField.h"
+#include "Database.h"
+
+DbField::DbField() : 
+    m_pData(nullptr),
+    m_uiLength(0),
+    m_eType(DB_FIELD_TEXT),
+    m_bOwner(false)
+{
+
+}
+
+DbField::DbField(DbField &f) :
+    m_pData(nullptr),
+    m_uiLength(0),
+    m_eType(DB_FIELD_TEXT),
+    m_bOwner(false)
+{
+    SetValue(f.getString(), f.getLength());
+    m_eType = f.m_eType;
+    m_binary = f.m_binary;
+}
+
+DbField::DbField(const char* value) :
+    m_pData(nullptr),
+    m_uiLength(0),
+    m_eType(DB_FIELD_TEXT),
+    m_bOwner(false)
+{
+    SetValue(value);
+}
+
+DbField::~DbField()
+{
+    ReleaseValue();
+}
+
+void DbField::SetValue(const char* value)
+{
+    SetValue(value, value ? strlen(value) : 0);
+}
+
+void DbField::SetValue(const char* value, const size_t length)
+{
+    ReleaseValue();
+
+    if (value)
+    {
+        m_pData = new char[length + 1];
+        memcpy(m_pData, value, length);
+        m_pData[length] = '\0';
+        m_uiLength = length;
+        m_bOwner = true;
+    }
+    else
+    {
+        m_uiLength = 0;
+    }
+}
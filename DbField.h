@@ -1,56 +1,233 @@
-#ifndef _DBFIELD_H
-#define _DBFIELD_H
-
-#include <string>
-
-typedef signed __int64 int64;
-typedef int int32;
-typedef short int16;
-typedef char int8;
-
-typedef unsigned __int64 uint64;
-typedef unsigned int uint32;
-typedef unsigned short uint16;
-typedef unsigned char uint8;
-
-class DbField
-{
-    public:
-        DbField();
-        DbField(DbField &f);
-        DbField(const char* value);
-        ~DbField();
-
-        void SetValue(const char* value);
-        
-        const char* getString() const { return m_pData; }        
-        bool getBool() const { return m_pData ? atoi(m_pData) > 0 : false; }        
-        float getFloat() const { return m_pData ? static_cast<float>(atof(m_pData)) : 0.0f; }
-        double getDouble() const { return m_pData ? static_cast<double>(atof(m_pData)) : 0.0f; }     
-        int16 getInt16() const { return m_pData ? static_cast<int16>(atol(m_pData)) : int16(0); }        
-        int32 getInt32() const { return m_pData ? static_cast<int32>(atol(m_pData)) : int32(0); }        
-        uint8 getUInt8() const { return m_pData ? static_cast<uint8>(atol(m_pData)) : uint8(0); }        
-        uint16 getUInt16() const {  return m_pData ? static_cast<uint16>(atol(m_pData)) : uint16(0); }
-        uint32 getUInt32() const { return m_pData ? static_cast<uint32>(atol(m_pData)) : uint32(0); }
-        
-        uint64 getUInt64() const
-        {
-            if (m_pData)
-            {
-                uint64 value;
-                sscanf(m_pData, "%llu", &value);
-                return value;
-            }
-            
-            return 0;
-        }
-
-        std::string getCppString() const { return m_pData ? m_pData : ""; }
-
-    private:
-        char* m_pData;
-};
-
-#endif
-
-
+#ifndef _DBFIELD_H
+#define _DBFIELD_H
+
+#include <string>
+#include <cstring>
+#include <charconv>
+#include <limits>
+#include <type_traits>
+
+typedef signed __int64 int64;
+typedef int int32;
+typedef short int16;
+typedef char int8;
+
+typedef unsigned __int64 uint64;
+typedef unsigned int uint32;
+typedef unsigned short uint16;
+typedef unsigned char uint8;
+
+// How a field's value arrived. Text protocol results are always DB_FIELD_TEXT,
+// prepared statement results carry their numbers already decoded from the binary protocol.
+enum DbFieldType
+{
+    DB_FIELD_TEXT,
+    DB_FIELD_INT64,
+    DB_FIELD_UINT64,
+    DB_FIELD_DOUBLE
+};
+
+union DbBinaryValue
+{
+    int64 iValue;
+    uint64 uiValue;
+    double dValue;
+};
+
+class DbField
+{
+    public:
+        DbField();
+        DbField(DbField &f);
+        DbField(const char* value);
+        ~DbField();
+
+        // Copies value, the field owns its own buffer.
+        void SetValue(const char* value);
+        void SetValue(const char* value, const size_t length);
+
+        // Points at value without copying, it must outlive this field (or the next Set*).
+        void SetView(const char* value, const size_t length)
+        {
+            ReleaseValue();
+            m_pData = const_cast<char*>(value);
+            m_uiLength = value ? length : 0;
+        }
+
+        // Same as SetView, for a number that also comes already decoded. value is its text form.
+        void SetBinaryView(const char* value, const size_t length, const DbFieldType type, const DbBinaryValue binary)
+        {
+            SetView(value, length);
+            m_eType = value ? type : DB_FIELD_TEXT;
+            m_binary = binary;
+        }
+        
+        const char* getString() const { return m_pData; }        
+        size_t getLength() const { return m_uiLength; }
+        DbFieldType getType() const { return m_eType; }
+        bool isNull() const { return m_pData == nullptr; }
+
+        bool getBool() const { return getNumber<int64>() > 0; }        
+        float getFloat() const { return getNumber<float>(); }
+        double getDouble() const { return getNumber<double>(); }     
+        int16 getInt16() const { return getNumber<int16>(); }        
+        int32 getInt32() const { return getNumber<int32>(); }        
+        int64 getInt64() const { return getNumber<int64>(); }        
+        uint8 getUInt8() const { return getNumber<uint8>(); }        
+        uint16 getUInt16() const { return getNumber<uint16>(); }
+        uint32 getUInt32() const { return getNumber<uint32>(); }
+        uint64 getUInt64() const { return getNumber<uint64>(); }
+
+        // Unchecked: NULL or text that isn't a number gives 0, integers too big for T are truncated like a cast.
+        //  A double is clamped to T's range instead (NaN gives 0), casting it out of range is undefined.
+        template <class T>
+        T getNumber() const
+        {
+            switch (m_eType)
+            {
+                case DB_FIELD_INT64:
+                    return static_cast<T>(m_binary.iValue);
+                case DB_FIELD_UINT64:
+                    return static_cast<T>(m_binary.uiValue);
+                case DB_FIELD_DOUBLE:
+                    return clampedCast<T>(m_binary.dValue);
+                default:
+                    break;
+            }
+
+            if (!m_pData)
+                return T(0);
+
+            if constexpr (std::is_floating_point<T>::value)
+            {
+                double value = 0.0;
+                std::from_chars(m_pData, m_pData + m_uiLength, value);
+                return static_cast<T>(value);
+            }
+            else if constexpr (std::is_unsigned<T>::value)
+            {
+                uint64 value = 0;
+
+                // Negative text into an unsigned type wraps, the same as the old atol based getters.
+                if (std::from_chars(m_pData, m_pData + m_uiLength, value).ec != std::errc())
+                    return static_cast<T>(uint64(getNumber<int64>()));
+
+                return static_cast<T>(value);
+            }
+            else
+            {
+                int64 value = 0;
+                std::from_chars(m_pData, m_pData + m_uiLength, value);
+                return static_cast<T>(value);
+            }
+        }
+
+        // Checked: false if the field is NULL, isn't entirely a number, or doesn't fit in T. value is only set on success.
+        template <class T>
+        bool tryGetNumber(T& value) const
+        {
+            switch (m_eType)
+            {
+                case DB_FIELD_INT64:
+                    return checkedCast(m_binary.iValue, value);
+                case DB_FIELD_UINT64:
+                    return checkedCast(m_binary.uiValue, value);
+                case DB_FIELD_DOUBLE:
+                    return checkedCast(m_binary.dValue, value);
+                default:
+                    break;
+            }
+
+            if (!m_pData || !m_uiLength)
+                return false;
+
+            T result;
+            std::from_chars_result res = std::from_chars(m_pData, m_pData + m_uiLength, result);
+
+            if (res.ec != std::errc() || res.ptr != m_pData + m_uiLength)
+                return false;
+
+            value = result;
+            return true;
+        }
+
+        // Keeps embedded NULs, so it's also good for BLOB columns.
+        std::string getCppString() const { return m_pData ? std::string(m_pData, m_uiLength) : ""; }
+
+    private:
+        void ReleaseValue()
+        {
+            if (m_bOwner)
+                delete [] m_pData;
+
+            m_pData = nullptr;
+            m_bOwner = false;
+            m_eType = DB_FIELD_TEXT;
+        }
+
+        template <class T>
+        static T clampedCast(const double from)
+        {
+            if constexpr (std::is_floating_point<T>::value)
+            {
+                return static_cast<T>(from);
+            }
+            else
+            {
+                // NaN.
+                if (from != from)
+                    return T(0);
+
+                if (from <= static_cast<double>(std::numeric_limits<T>::min()))
+                    return std::numeric_limits<T>::min();
+
+                // max + 1 is exact even where max itself doesn't fit in a double.
+                if (from >= static_cast<double>(std::numeric_limits<T>::max()) + 1.0)
+                    return std::numeric_limits<T>::max();
+
+                return static_cast<T>(from);
+            }
+        }
+
+        template <class V, class T>
+        static bool checkedCast(const V from, T& value)
+        {
+            if constexpr (std::is_floating_point<T>::value)
+            {
+                value = static_cast<T>(from);
+                return true;
+            }
+            else if constexpr (std::is_floating_point<V>::value)
+            {
+                // max + 1 is exact even where max itself doesn't fit in a double.
+                if (!(from >= static_cast<V>(std::numeric_limits<T>::min()) && from < static_cast<V>(std::numeric_limits<T>::max()) + V(1)))
+                    return false;
+            }
+            else if constexpr (std::is_signed<V>::value)
+            {
+                if (from < 0 ? (std::is_unsigned<T>::value || from < int64(std::numeric_limits<T>::min())) : uint64(from) > uint64(std::numeric_limits<T>::max()))
+                    return false;
+            }
+            else
+            {
+                if (from > uint64(std::numeric_limits<T>::max()))
+                    return false;
+            }
+
+            value = static_cast<T>(from);
+            return true;
+        }
+
+        char* m_pData;
+        size_t m_uiLength;
+
+        DbFieldType m_eType;
+        DbBinaryValue m_binary;
+
+        // False when m_pData is a view into someone else's buffer.
+        bool m_bOwner;
+};
+
+#endif
+
+
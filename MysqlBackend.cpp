@@ -0,0 +1,309 @@
+#include "Database.h"
+#include "MysqlBackend.h"
+
+#include <algorithm>
+
+// CR_UNKNOWN_ERROR, reported when an infile handler fails.
+#define INFILE_ERROR 2000
+
+// What LoadData hands the client library for the file it's asked for.
+struct InfileSource
+{
+    const char* pData;
+    size_t uiLength;
+    size_t uiOffset;
+};
+
+static int MemoryInfileInit(void** ptr, const char* /*filename*/, void* userdata)
+{
+    *ptr = userdata;
+    return 0;
+}
+
+static int MemoryInfileRead(void* ptr, char* buf, unsigned int buf_len)
+{
+    InfileSource* pSource = static_cast<InfileSource*>(ptr);
+    const size_t uiCount = std::min<size_t>(buf_len, pSource->uiLength - pSource->uiOffset);
+
+    memcpy(buf, pSource->pData + pSource->uiOffset, uiCount);
+    pSource->uiOffset += uiCount;
+    return int(uiCount);
+}
+
+static void MemoryInfileEnd(void* /*ptr*/)
+{
+
+}
+
+static int MemoryInfileError(void* /*ptr*/, char* error_msg, unsigned int error_msg_len)
+{
+    snprintf(error_msg, error_msg_len, "Could not read the bulk load buffer");
+    return INFILE_ERROR;
+}
+
+// Installed the rest of the time, so a server can never make us send a local file.
+static int RefuseInfileInit(void** ptr, const char* /*filename*/, void* /*userdata*/)
+{
+    *ptr = nullptr;
+    return 1;
+}
+
+static int RefuseInfileRead(void* /*ptr*/, char* /*buf*/, unsigned int /*buf_len*/)
+{
+    return -1;
+}
+
+static int RefuseInfileError(void* /*ptr*/, char* error_msg, unsigned int error_msg_len)
+{
+    snprintf(error_msg, error_msg_len, "LOCAL INFILE is only sent for BulkLoader");
+    return INFILE_ERROR;
+}
+
+MysqlBackend::MysqlBackend() :
+    m_pMYSQL(nullptr),
+    m_uiDrainedErrno(0)
+{
+
+}
+
+MysqlBackend::~MysqlBackend()
+{
+    Close();
+}
+
+bool MysqlBackend::Open(const std::string& strHost, const std::string& strPortOrSocket, const std::string& strUser, const std::string& strPassword, const std::string& strDbName, const bool bNonBlocking)
+{
+    MYSQL* pMyqlInit = mysql_init(NULL);
+
+    if (!pMyqlInit)
+    {
+        printf("MysqlBackend::Open - Could not initialize Mysql connection");
+        return false;
+    }
+
+    mysql_options(pMyqlInit, MYSQL_SET_CHARSET_NAME, "utf8");
+
+    // For LoadData, nothing else is ever read, see RefuseInfileInit.
+    uint32 uiLocalInfile = 1;
+    mysql_options(pMyqlInit, MYSQL_OPT_LOCAL_INFILE, &uiLocalInfile);
+
+#ifdef LIBMARIADB
+    if (bNonBlocking)
+        mysql_options(pMyqlInit, MYSQL_OPT_NONBLOCK, 0);
+#else
+    ASSERT(!bNonBlocking);
+#endif
+    
+    int32 port = 0;
+
+    // Named pipe use option (Windows)
+    if (strHost == ".") 
+    {
+        uint32 opt = MYSQL_PROTOCOL_PIPE;
+        mysql_options(pMyqlInit, MYSQL_OPT_PROTOCOL, (char const*)&opt);
+        port = 0;
+    }
+
+    // Generic case
+    else
+    {
+        port = atoi(strPortOrSocket.c_str());
+    }
+
+    m_pMYSQL = mysql_real_connect(pMyqlInit, strHost.c_str(), strUser.c_str(), strPassword.c_str(), strDbName.c_str(), port, NULL, 0);
+
+    if (!m_pMYSQL)
+    {
+        printf("MysqlBackend::Open - Could not connect to MySQL database %s at %s\n", strDbName.c_str(), strHost.c_str());
+        mysql_close(pMyqlInit);
+        return false;
+    }
+
+    static uint32 minMysqlVersion = 50003;
+
+    if (MYSQL_VERSION_ID < minMysqlVersion)
+    {
+        printf("MysqlBackend::Open - Your MySQL is out of date. Your have %d when a minimum of %d is required.", MYSQL_VERSION_ID, minMysqlVersion);
+        Close();
+        return false;
+    }
+
+    mysql_autocommit(m_pMYSQL, 1);
+    mysql_set_local_infile_handler(m_pMYSQL, RefuseInfileInit, RefuseInfileRead, MemoryInfileEnd, RefuseInfileError, nullptr);
+
+    my_bool my_true = (my_bool)1;
+    mysql_options(m_pMYSQL, MYSQL_OPT_RECONNECT, &my_true);
+
+    return true;
+}
+
+void MysqlBackend::Close()
+{
+    if (m_pMYSQL)
+        mysql_close(m_pMYSQL);
+
+    m_pMYSQL = nullptr;
+}
+
+bool MysqlBackend::Query(const std::string& strQuery)
+{
+    m_uiDrainedErrno = 0;
+    return mysql_real_query(m_pMYSQL, strQuery.c_str(), (unsigned long)strQuery.size()) == 0;
+}
+
+std::shared_ptr<QueryResult> MysqlBackend::StoreResult(DatabaseMetrics* pMetrics)
+{
+    return WrapResult(m_pMYSQL, mysql_store_result(m_pMYSQL), pMetrics);
+}
+
+bool MysqlBackend::StoreResultCopy(std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount)
+{
+    MYSQL_RES* pResult = mysql_store_result(m_pMYSQL);
+
+    if (!pResult)
+        return mysql_field_count(m_pMYSQL) == 0;
+
+    fieldCount = mysql_num_fields(pResult);
+
+    if (mysql_num_rows(pResult) && fieldCount)
+    {
+        std::shared_ptr<QueryResultStorage> pStorage = std::make_shared<QueryResultStorage>();
+        pStorage->vCells.reserve(size_t(mysql_num_rows(pResult)) * fieldCount);
+
+        MYSQL_FIELD* pFields = mysql_fetch_fields(pResult);
+
+        for (uint32 i = 0; i < fieldCount; ++i)
+            pStorage->vColumns.push_back(pFields[i].name);
+
+        while (MYSQL_ROW row = mysql_fetch_row(pResult))
+        {
+            unsigned long* pLengths = mysql_fetch_lengths(pResult);
+
+            for (uint32 i = 0; i < fieldCount; ++i)
+            {
+                if (row[i])
+                    pStorage->addCell(row[i], pLengths[i]);
+                else
+                    pStorage->addNull();
+            }
+        }
+
+        storage = pStorage;
+    }
+
+    mysql_free_result(pResult);
+    return true;
+}
+
+void MysqlBackend::DiscardResult()
+{
+    if (MYSQL_RES* pResult = mysql_store_result(m_pMYSQL))
+        mysql_free_result(pResult);
+}
+
+bool MysqlBackend::MultiQuery(const std::string& strStatements, uint32& failedStatement, std::vector<std::shared_ptr<QueryResult>>* pResults, DatabaseMetrics* pMetrics)
+{
+    failedStatement = 1;
+
+    if (!Query(strStatements))
+        return false;
+
+    // Every statement has a result (or at least a status) to read, even the ones we don't care about.
+    int32 iNext;
+
+    do
+    {
+        MYSQL_RES* pResult = mysql_store_result(m_pMYSQL);
+
+        if (!pResult && mysql_field_count(m_pMYSQL))
+        {
+            DrainResults();
+            return false;
+        }
+
+        if (pResults)
+            pResults->push_back(WrapResult(m_pMYSQL, pResult, pMetrics));
+        else if (pResult)
+            mysql_free_result(pResult);
+
+        ++failedStatement;
+    }
+    while ((iNext = mysql_next_result(m_pMYSQL)) == 0);
+
+    // -1 means there were no more results, the server stops at the first failing statement.
+    return iNext == -1;
+}
+
+void MysqlBackend::DrainResults()
+{
+    // The error of the statement that failed, reading on overwrites it.
+    const uint32 uiErrno = mysql_errno(m_pMYSQL);
+    const std::string strError = mysql_error(m_pMYSQL);
+
+    while (mysql_more_results(m_pMYSQL) && mysql_next_result(m_pMYSQL) == 0)
+    {
+        if (MYSQL_RES* pResult = mysql_store_result(m_pMYSQL))
+            mysql_free_result(pResult);
+    }
+
+    m_uiDrainedErrno = uiErrno;
+    m_strDrainedError = strError;
+}
+
+bool MysqlBackend::LoadData(const std::string& strStatement, const char* data, const size_t length, uint64& rows)
+{
+    InfileSource source = { data, length, 0 };
+    mysql_set_local_infile_handler(m_pMYSQL, MemoryInfileInit, MemoryInfileRead, MemoryInfileEnd, MemoryInfileError, &source);
+
+    const bool bSuccess = Query(strStatement);
+    mysql_set_local_infile_handler(m_pMYSQL, RefuseInfileInit, RefuseInfileRead, MemoryInfileEnd, RefuseInfileError, nullptr);
+
+    if (!bSuccess)
+        return false;
+
+    rows = mysql_affected_rows(m_pMYSQL);
+    return true;
+}
+
+void MysqlBackend::SetReconnect(const bool bEnable)
+{
+    my_bool my_reconnect = (my_bool)bEnable;
+    mysql_options(m_pMYSQL, MYSQL_OPT_RECONNECT, &my_reconnect);
+}
+
+void MysqlBackend::SetMultiStatements(const bool bEnable)
+{
+    mysql_set_server_option(m_pMYSQL, bEnable ? MYSQL_OPTION_MULTI_STATEMENTS_ON : MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+}
+
+size_t MysqlBackend::EscapeString(char* to, const char* from, const size_t length)
+{
+    return mysql_real_escape_string(m_pMYSQL, to, from, (unsigned long)length);
+}
+
+std::shared_ptr<QueryResult> MysqlBackend::WrapResult(MYSQL* pMysql, MYSQL_RES* pResult, DatabaseMetrics* pMetrics)
+{
+    if (!pResult)
+        return nullptr;
+
+    uint64 uiNumRows = mysql_affected_rows(pMysql);
+
+    if (!uiNumRows)
+    {
+        mysql_free_result(pResult);
+        return nullptr;
+    }
+
+    uint32 uiNumFields = mysql_field_count(pMysql);
+
+    if (!uiNumFields)
+    {
+        mysql_free_result(pResult);
+        return nullptr;
+    }
+
+    if (pMetrics)
+        pMetrics->RecordRows(uiNumRows);
+
+    return std::make_shared<QueryResult>(pResult, mysql_fetch_fields(pResult), uiNumRows, uiNumFields, pMetrics);
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef MYSQLBACKEND_H
+#define MYSQLBACKEND_H
+
+#include "DatabaseBackend.h"
+
+// The default backend, libmysqlclient or MariaDB Connector/C.
+class MysqlBackend : public DatabaseBackend
+{
+    public:
+        MysqlBackend();
+        virtual ~MysqlBackend();
+
+        // bNonBlocking enables MariaDB's non-blocking API on the handle (the blocking calls keep working too).
+        virtual bool Open(const std::string& strHost, const std::string& strPortOrSocket, const std::string& strUser, const std::string& strPassword, const std::string& strDbName, const bool bNonBlocking) final;
+        virtual void Close() final;
+
+        virtual bool Query(const std::string& strQuery) final;
+        virtual std::shared_ptr<QueryResult> StoreResult(DatabaseMetrics* pMetrics) final;
+        virtual bool StoreResultCopy(std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount) final;
+        virtual void DiscardResult() final;
+
+        virtual bool MultiQuery(const std::string& strStatements, uint32& failedStatement, std::vector<std::shared_ptr<QueryResult>>* pResults, DatabaseMetrics* pMetrics) final;
+        virtual void SetMultiStatements(const bool bEnable) final;
+
+        // The server needs local_infile on. Between loads the handle refuses every file the server asks for.
+        virtual bool LoadData(const std::string& strStatement, const char* data, const size_t length, uint64& rows) final;
+
+        virtual bool Ping() final { return mysql_ping(m_pMYSQL) == 0; }
+        virtual void SetReconnect(const bool bEnable) final;
+
+        // A failed MultiQuery's error is kept until the next query, reading past it would clear it.
+        virtual uint32 getErrno() const final { return m_uiDrainedErrno ? m_uiDrainedErrno : mysql_errno(m_pMYSQL); }
+        virtual const char* getError() const final { return m_uiDrainedErrno ? m_strDrainedError.c_str() : mysql_error(m_pMYSQL); }
+        virtual unsigned long getThreadId() const final { return mysql_thread_id(m_pMYSQL); }
+
+        virtual size_t EscapeString(char* to, const char* from, const size_t length) final;
+
+        virtual MYSQL* getMysql() const final { return m_pMYSQL; }
+
+        // Takes ownership of pResult, returns null (and frees it) when there are no rows or fields.
+        static std::shared_ptr<QueryResult> WrapResult(MYSQL* pMysql, MYSQL_RES* pResult, DatabaseMetrics* pMetrics = nullptr);
+
+    private:
+        // Reads and frees what's left of a failed multi statement batch, so the connection can take the next query.
+        void DrainResults();
+
+        MYSQL* m_pMYSQL;
+
+        uint32 m_uiDrainedErrno;
+        std::string m_strDrainedError;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,123 @@
+#ifndef PREPAREDSTATEMENT_H
+#define PREPAREDSTATEMENT_H
+
+#include "DbField.h"
+
+#include <mysql.h>
+#include <string>
+#include <vector>
+
+// One bound parameter. Integers are all sent as 64 bit, the server converts them to the column type.
+struct PreparedValue
+{
+    PreparedValue() :
+        eType(MYSQL_TYPE_NULL),
+        bUnsigned(false),
+        uiValue(0)
+    {}
+
+    enum_field_types eType;
+    bool bUnsigned;
+
+    union
+    {
+        uint64 uiValue;
+        int64 iValue;
+        float fValue;
+        double dValue;
+    };
+
+    std::string strValue;
+};
+
+// The parameters for one execution of a statement registered with Database::RegisterStatement.
+// Indices are the position of the '?' in the registered SQL, starting at 0.
+class PreparedStatement
+{
+    public:
+        PreparedStatement(const uint32 id) :
+            m_uiId(id)
+        {}
+
+        void setBool(const uint8 index, const bool value) { setUInt64(index, value ? 1 : 0); }
+        void setUInt8(const uint8 index, const uint8 value) { setUInt64(index, value); }
+        void setUInt16(const uint8 index, const uint16 value) { setUInt64(index, value); }
+        void setUInt32(const uint8 index, const uint32 value) { setUInt64(index, value); }
+        void setInt8(const uint8 index, const int8 value) { setInt64(index, value); }
+        void setInt16(const uint8 index, const int16 value) { setInt64(index, value); }
+        void setInt32(const uint8 index, const int32 value) { setInt64(index, value); }
+
+        void setUInt64(const uint8 index, const uint64 value)
+        {
+            PreparedValue& param = at(index);
+            param.eType = MYSQL_TYPE_LONGLONG;
+            param.bUnsigned = true;
+            param.uiValue = value;
+        }
+
+        void setInt64(const uint8 index, const int64 value)
+        {
+            PreparedValue& param = at(index);
+            param.eType = MYSQL_TYPE_LONGLONG;
+            param.bUnsigned = false;
+            param.iValue = value;
+        }
+
+        void setFloat(const uint8 index, const float value)
+        {
+            PreparedValue& param = at(index);
+            param.eType = MYSQL_TYPE_FLOAT;
+            param.fValue = value;
+        }
+
+        void setDouble(const uint8 index, const double value)
+        {
+            PreparedValue& param = at(index);
+            param.eType = MYSQL_TYPE_DOUBLE;
+            param.dValue = value;
+        }
+
+        // No escaping needed, the value never becomes part of the SQL text.
+        void setString(const uint8 index, const std::string& value)
+        {
+            PreparedValue& param = at(index);
+            param.eType = MYSQL_TYPE_STRING;
+            param.strValue = value;
+        }
+
+        void setNull(const uint8 index)
+        {
+            PreparedValue& param = at(index);
+            param.eType = MYSQL_TYPE_NULL;
+            param.strValue.clear();
+        }
+
+        uint32 getId() const { return m_uiId; }
+
+        const std::vector<PreparedValue>& getValues() const { return m_vValues; }
+
+        // Bytes its values take, strings at their length and everything else at 8.
+        size_t getDataSize() const
+        {
+            size_t uiSize = 0;
+
+            for (size_t i = 0; i < m_vValues.size(); ++i)
+                uiSize += m_vValues[i].strValue.empty() ? sizeof(uint64) : m_vValues[i].strValue.size();
+
+            return uiSize;
+        }
+
+    private:
+        PreparedValue& at(const uint8 index)
+        {
+            if (index >= m_vValues.size())
+                m_vValues.resize(index + 1);
+
+            return m_vValues[index];
+        }
+
+        uint32 m_uiId;
+        std::vector<PreparedValue> m_vValues;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,411 @@
+#include "Database.h"
+#include "QueryCache.h"
+
+#include <chrono>
+#include <cctype>
+#include <functional>
+
+static int64 NowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string ToLower(std::string str)
+{
+    for (size_t i = 0; i < str.size(); ++i)
+        str[i] = char(tolower((unsigned char)str[i]));
+
+    return str;
+}
+
+// Reads a keyword or a (possibly `quoted` and database qualified) table name at pos, lower case, only the last part of db.table.
+static std::string ReadIdentifier(const std::string& strQuery, size_t& pos)
+{
+    while (pos < strQuery.size() && isspace((unsigned char)strQuery[pos]))
+        ++pos;
+
+    std::string strPart;
+
+    while (pos < strQuery.size())
+    {
+        if (strQuery[pos] == '`')
+        {
+            const size_t uiEnd = strQuery.find('`', pos + 1);
+
+            if (uiEnd == std::string::npos)
+                return "";
+
+            strPart.assign(strQuery, pos + 1, uiEnd - pos - 1);
+            pos = uiEnd + 1;
+        }
+        else
+        {
+            const size_t uiStart = pos;
+
+            while (pos < strQuery.size() && (isalnum((unsigned char)strQuery[pos]) || strQuery[pos] == '_' || strQuery[pos] == '$'))
+                ++pos;
+
+            strPart.assign(strQuery, uiStart, pos - uiStart);
+        }
+
+        if (pos >= strQuery.size() || strQuery[pos] != '.')
+            break;
+
+        ++pos;
+    }
+
+    return ToLower(strPart);
+}
+
+QueryCache::QueryCache() :
+    m_uiMaxBytes(0),
+    m_uiBytes(0),
+    m_uiGeneration(0),
+    m_pTableGenerations(new std::atomic<uint64>[QUERY_CACHE_TABLE_SLOTS]),
+    m_uiClearGeneration(0),
+    m_uiEntryCount(0),
+    m_uiHits(0),
+    m_uiMisses(0),
+    m_uiEvictions(0),
+    m_uiInvalidations(0)
+{
+    for (uint32 i = 0; i < QUERY_CACHE_TABLE_SLOTS; ++i)
+        m_pTableGenerations[i] = 0;
+}
+
+void QueryCache::SetLimit(const size_t maxBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_uiMaxBytes = maxBytes;
+
+    while (m_uiBytes > maxBytes && !m_lEntries.empty())
+    {
+        Erase(std::prev(m_lEntries.end()));
+        ++m_uiEvictions;
+    }
+}
+
+bool QueryCache::Find(const std::string& strKey, std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount, uint64& generation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    generation = m_uiGeneration;
+
+    auto itr = m_uoEntries.find(strKey);
+
+    if (itr == m_uoEntries.end())
+    {
+        ++m_uiMisses;
+        return false;
+    }
+
+    Entry& entry = *itr->second;
+
+    if (entry.iExpireMs != -1 && NowMs() >= entry.iExpireMs)
+    {
+        Erase(itr->second);
+        ++m_uiMisses;
+        return false;
+    }
+
+    // Most recently used to the front.
+    m_lEntries.splice(m_lEntries.begin(), m_lEntries, itr->second);
+
+    storage = entry.storage;
+    fieldCount = entry.uiFieldCount;
+    ++m_uiHits;
+    return true;
+}
+
+void QueryCache::Insert(const std::string& strKey, std::shared_ptr<const QueryResultStorage> storage, const uint32 fieldCount, const uint32 ttlMs, const char* tags, const uint64 generation)
+{
+    Entry entry;
+    entry.strKey = strKey;
+    entry.storage = storage;
+    entry.uiFieldCount = fieldCount;
+    entry.iExpireMs = ttlMs ? NowMs() + ttlMs : -1;
+    entry.uiBytes = sizeof(Entry) + strKey.size() * 2;
+
+    if (storage)
+        entry.uiBytes += storage->vData.capacity() + storage->vCells.capacity() * sizeof(QueryResultStorage::Cell);
+
+    for (const char* pTag = tags; pTag && *pTag; )
+    {
+        const char* pEnd = strchr(pTag, ',');
+
+        if (!pEnd)
+            pEnd = pTag + strlen(pTag);
+
+        size_t pos = 0;
+        std::string strTag = ReadIdentifier(std::string(pTag, pEnd), pos);
+
+        if (!strTag.empty())
+        {
+            entry.uiBytes += strTag.size() + strKey.size();
+            entry.vTags.push_back(strTag);
+        }
+
+        pTag = *pEnd ? pEnd + 1 : pEnd;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (entry.uiBytes > m_uiMaxBytes)
+        return;
+
+    // Counted before the stamps are read: a write stamping after that sees an entry, and waits for the lock to invalidate it.
+    ++m_uiEntryCount;
+
+    if (isStale(entry.vTags, generation))
+    {
+        --m_uiEntryCount;
+        return;
+    }
+
+    auto itr = m_uoEntries.find(strKey);
+
+    if (itr != m_uoEntries.end())
+        Erase(itr->second);
+
+    m_lEntries.push_front(std::move(entry));
+    m_uoEntries[strKey] = m_lEntries.begin();
+
+    for (size_t i = 0; i < m_lEntries.front().vTags.size(); ++i)
+        m_uoTags[m_lEntries.front().vTags[i]].insert(strKey);
+
+    m_uiBytes += m_lEntries.front().uiBytes;
+
+    while (m_uiBytes > m_uiMaxBytes)
+    {
+        Erase(std::prev(m_lEntries.end()));
+        ++m_uiEvictions;
+    }
+}
+
+void QueryCache::Invalidate(const char* tag)
+{
+    size_t pos = 0;
+    const std::string strTable = tag ? ReadIdentifier(tag, pos) : "";
+
+    if (tag && strTable.empty())
+        return;
+
+    StampWrite(strTable);
+
+    if (!m_uiEntryCount)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (tag)
+    {
+        InvalidateTable(strTable);
+        return;
+    }
+
+    m_uiInvalidations += m_lEntries.size();
+    m_lEntries.clear();
+    m_uoEntries.clear();
+    m_uoTags.clear();
+    m_uiBytes = 0;
+    m_uiEntryCount = 0;
+}
+
+void QueryCache::OnWrite(const std::string& strQuery)
+{
+    if (!isEnabled())
+        return;
+
+    const std::string strTable = getWrittenTable(strQuery);
+
+    if (strTable.empty())
+        return;
+
+    // Stamped even when nothing is cached yet, a query that's running right now may be about to store what this changed.
+    StampWrite(strTable);
+
+    if (!m_uiEntryCount)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    InvalidateTable(strTable);
+}
+
+void QueryCache::StampWrite(const std::string& strTable)
+{
+    const uint64 uiGeneration = ++m_uiGeneration;
+    std::atomic<uint64>& slot = strTable.empty() ? m_uiClearGeneration : m_pTableGenerations[std::hash<std::string>()(strTable) % QUERY_CACHE_TABLE_SLOTS];
+
+    // Writes can stamp out of order, the slot keeps the newest.
+    uint64 uiCurrent = slot;
+
+    while (uiCurrent < uiGeneration && !slot.compare_exchange_weak(uiCurrent, uiGeneration));
+}
+
+bool QueryCache::isStale(const std::vector<std::string>& vTags, const uint64 generation) const
+{
+    // Only writes to its own tables make it stale, the rest of the database can be busy meanwhile.
+    if (m_uiClearGeneration > generation)
+        return true;
+
+    for (size_t i = 0; i < vTags.size(); ++i)
+    {
+        if (m_pTableGenerations[std::hash<std::string>()(vTags[i]) % QUERY_CACHE_TABLE_SLOTS] > generation)
+            return true;
+    }
+
+    return false;
+}
+
+void QueryCache::InvalidateTable(const std::string& strTable)
+{
+    auto itr = m_uoTags.find(strTable);
+
+    if (itr == m_uoTags.end())
+        return;
+
+    std::unordered_set<std::string> keys;
+    keys.swap(itr->second);
+    m_uoTags.erase(itr);
+
+    for (auto key = keys.begin(); key != keys.end(); ++key)
+    {
+        auto entry = m_uoEntries.find(*key);
+
+        if (entry != m_uoEntries.end())
+        {
+            Erase(entry->second);
+            ++m_uiInvalidations;
+        }
+    }
+}
+
+void QueryCache::Erase(EntryItr itr)
+{
+    for (size_t i = 0; i < itr->vTags.size(); ++i)
+    {
+        auto tag = m_uoTags.find(itr->vTags[i]);
+
+        if (tag == m_uoTags.end())
+            continue;
+
+        tag->second.erase(itr->strKey);
+
+        if (tag->second.empty())
+            m_uoTags.erase(tag);
+    }
+
+    m_uiBytes -= itr->uiBytes;
+    --m_uiEntryCount;
+
+    m_uoEntries.erase(itr->strKey);
+    m_lEntries.erase(itr);
+}
+
+QueryCacheStats QueryCache::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    QueryCacheStats stats;
+    stats.uiHits = m_uiHits;
+    stats.uiMisses = m_uiMisses;
+    stats.uiEvictions = m_uiEvictions;
+    stats.uiInvalidations = m_uiInvalidations;
+    stats.uiEntries = m_lEntries.size();
+    stats.uiBytes = m_uiBytes;
+    return stats;
+}
+
+std::string QueryCache::MakeStatementKey(const PreparedStatement& stmt)
+{
+    // SQL text never starts with a NUL.
+    std::string strKey(1, '\0');
+
+    const uint32 uiId = stmt.getId();
+    strKey.append(reinterpret_cast<const char*>(&uiId), sizeof(uiId));
+
+    const std::vector<PreparedValue>& vValues = stmt.getValues();
+
+    for (size_t i = 0; i < vValues.size(); ++i)
+    {
+        const PreparedValue& value = vValues[i];
+        strKey.push_back(char(value.eType));
+
+        switch (value.eType)
+        {
+            case MYSQL_TYPE_LONGLONG:
+                strKey.push_back(char(value.bUnsigned));
+                strKey.append(reinterpret_cast<const char*>(&value.uiValue), sizeof(value.uiValue));
+                break;
+            case MYSQL_TYPE_FLOAT:
+                strKey.append(reinterpret_cast<const char*>(&value.fValue), sizeof(value.fValue));
+                break;
+            case MYSQL_TYPE_DOUBLE:
+                strKey.append(reinterpret_cast<const char*>(&value.dValue), sizeof(value.dValue));
+                break;
+            case MYSQL_TYPE_STRING:
+            {
+                const uint32 uiLength = uint32(value.strValue.size());
+                strKey.append(reinterpret_cast<const char*>(&uiLength), sizeof(uiLength));
+                strKey.append(value.strValue);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    return strKey;
+}
+
+std::string QueryCache::getWrittenTable(const std::string& strQuery)
+{
+    size_t pos = 0;
+    const std::string strVerb = ReadIdentifier(strQuery, pos);
+
+    // Modifiers that can come between the verb and the table.
+    const char* const* pSkip;
+
+    static const char* const s_insertSkip[] = { "low_priority", "delayed", "high_priority", "ignore", "into", nullptr };
+    static const char* const s_updateSkip[] = { "low_priority", "ignore", nullptr };
+    static const char* const s_deleteSkip[] = { "low_priority", "quick", "ignore", "from", nullptr };
+    static const char* const s_truncateSkip[] = { "table", nullptr };
+    static const char* const s_loadSkip[] = { "replace", "ignore", "into", "table", nullptr };
+
+    if (strVerb == "insert" || strVerb == "replace")
+        pSkip = s_insertSkip;
+    else if (strVerb == "update")
+        pSkip = s_updateSkip;
+    else if (strVerb == "delete")
+        pSkip = s_deleteSkip;
+    else if (strVerb == "truncate")
+        pSkip = s_truncateSkip;
+    else if (strVerb == "load")
+    {
+        // LOAD DATA [LOCAL] INFILE 'file' [REPLACE | IGNORE] INTO TABLE, the table comes after the file name.
+        const size_t uiOpen = strQuery.find('\'', pos);
+        const size_t uiClose = uiOpen == std::string::npos ? uiOpen : strQuery.find('\'', uiOpen + 1);
+
+        if (uiClose == std::string::npos)
+            return "";
+
+        pos = uiClose + 1;
+        pSkip = s_loadSkip;
+    }
+    else
+        return "";
+
+    std::string strWord;
+
+    while (!(strWord = ReadIdentifier(strQuery, pos)).empty())
+    {
+        bool bModifier = false;
+
+        for (const char* const* pWord = pSkip; *pWord && !bModifier; ++pWord)
+            bModifier = strWord == *pWord;
+
+        if (!bModifier)
+            break;
+    }
+
+    return strWord;
+}
\ No newline at end of file
@@ -0,0 +1,120 @@
+#ifndef QUERYCACHE_H
+#define QUERYCACHE_H
+
+#include "QueryResult.h"
+#include "PreparedStatement.h"
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Tables told apart when checking a result for writes that happened while it was read, the rest share a slot with one of them.
+#define QUERY_CACHE_TABLE_SLOTS 1024
+
+struct QueryCacheStats
+{
+    uint64 uiHits;
+    uint64 uiMisses;
+
+    // Dropped to stay under the memory limit.
+    uint64 uiEvictions;
+
+    // Dropped because a table they were tagged with was written to, or invalidated by hand.
+    uint64 uiInvalidations;
+
+    uint64 uiEntries;
+    uint64 uiBytes;
+};
+
+// Results of Database::CachedQuery and CachedQueryStatement, shared by every caller until they go stale.
+// Entries expire after their TTL, are dropped when a table they're tagged with is written to,
+// and the least recently used ones go first to stay under the memory limit.
+class QueryCache
+{
+    public:
+        QueryCache();
+
+        // 0 (the default) disables the cache and drops everything in it.
+        void SetLimit(const size_t maxBytes);
+        bool isEnabled() const { return m_uiMaxBytes != 0; }
+
+        // Returns false on a miss. A hit can have a null storage, the query returned no rows.
+        //  generation is to be passed to Insert once the query has been run.
+        bool Find(const std::string& strKey, std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount, uint64& generation);
+
+        // Not stored if one of its tags was written to (or everything invalidated) since the Find that gave generation,
+        //  the result could predate it.
+        //  ttlMs 0 never expires. tags are comma separated table names, may be null.
+        void Insert(const std::string& strKey, std::shared_ptr<const QueryResultStorage> storage, const uint32 fieldCount, const uint32 ttlMs, const char* tags, const uint64 generation);
+
+        // Drops every entry tagged with tag, or everything when tag is null.
+        void Invalidate(const char* tag);
+
+        // Called once strQuery has run, invalidates its table if it's an INSERT, REPLACE, UPDATE, DELETE or TRUNCATE.
+        void OnWrite(const std::string& strQuery);
+
+        QueryCacheStats getStats() const;
+
+        // The key a statement with these parameters is cached under, it can't collide with SQL text.
+        static std::string MakeStatementKey(const PreparedStatement& stmt);
+
+        // The table a write statement targets, lower case and without quotes or database name. Empty if it's not a write.
+        //  Multi table UPDATE and DELETE only give the first table.
+        static std::string getWrittenTable(const std::string& strQuery);
+
+    private:
+        struct Entry
+        {
+            std::string strKey;
+            std::shared_ptr<const QueryResultStorage> storage;
+            uint32 uiFieldCount;
+            int64 iExpireMs;
+            size_t uiBytes;
+            std::vector<std::string> vTags;
+        };
+
+        typedef std::list<Entry>::iterator EntryItr;
+
+        // Moves the clock on and stamps strTable's slot with it (or every slot's floor when strTable is empty), lock free.
+        void StampWrite(const std::string& strTable);
+
+        // m_mutex expected to be locked. True if a write to one of tags (or a clear) was stamped after generation.
+        bool isStale(const std::vector<std::string>& vTags, const uint64 generation) const;
+
+        // m_mutex expected to be locked.
+        void InvalidateTable(const std::string& strTable);
+        void Erase(EntryItr itr);
+
+        mutable std::mutex m_mutex;
+
+        // Most recently used first.
+        std::list<Entry> m_lEntries;
+        std::unordered_map<std::string, EntryItr> m_uoEntries;
+
+        // Tag -> keys of the entries carrying it.
+        std::unordered_map<std::string, std::unordered_set<std::string>> m_uoTags;
+
+        std::atomic<size_t> m_uiMaxBytes;
+        size_t m_uiBytes;
+
+        // Bumped by every write and invalidation, read without the lock. Find hands it out as the generation.
+        std::atomic<uint64> m_uiGeneration;
+
+        // The generation of the last write to each table slot, and of the last Invalidate of everything.
+        std::unique_ptr<std::atomic<uint64>[]> m_pTableGenerations;
+        std::atomic<uint64> m_uiClearGeneration;
+
+        // Lets writes skip the lock while there's nothing to drop.
+        std::atomic<size_t> m_uiEntryCount;
+
+        uint64 m_uiHits;
+        uint64 m_uiMisses;
+        uint64 m_uiEvictions;
+        uint64 m_uiInvalidations;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "QueryFormatter.h"
+#include "DatabaseBackend.h"
+
+#include <cstdio>
+
+void QueryFormatter::FormatV(std::string& output, const size_t sizeHint, const char* format, va_list ap)
+{
+    va_list copy;
+    va_copy(copy, ap);
+
+    output.resize(sizeHint);
+
+    const int iLength = vsnprintf(&output[0], output.size(), format, ap);
+
+    if (iLength < 0)
+    {
+        printf("QueryFormatter::FormatV - Bad format '%s'.", format);
+        output.clear();
+    }
+    else if (size_t(iLength) >= output.size())
+    {
+        // Too long for what we had, now we know exactly how long.
+        output.resize(size_t(iLength) + 1);
+        vsnprintf(&output[0], output.size(), format, copy);
+        output.resize(size_t(iLength));
+    }
+    else
+    {
+        output.resize(size_t(iLength));
+    }
+
+    va_end(copy);
+}
+
+size_t QueryFormatter::EscapeString(char* to, const char* from, const size_t length)
+{
+    char* pOut = to;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        char escaped = 0;
+
+        switch (from[i])
+        {
+            case '\0':   escaped = '0'; break;
+            case '\n':   escaped = 'n'; break;
+            case '\r':   escaped = 'r'; break;
+            case '\\':   escaped = '\\'; break;
+            case '\'':   escaped = '\''; break;
+            case '"':    escaped = '"'; break;
+            case '\032': escaped = 'Z'; break;
+            default: break;
+        }
+
+        if (escaped)
+        {
+            *pOut++ = '\\';
+            *pOut++ = escaped;
+        }
+        else
+        {
+            *pOut++ = from[i];
+        }
+    }
+
+    *pOut = '\0';
+    return size_t(pOut - to);
+}
+
+void QueryFormatter::AppendQuoted(std::string& output, DatabaseBackend* pEscaper, const char* from, const size_t length)
+{
+    // Room for the worst case, then trimmed to what was written.
+    const size_t uiStart = output.size();
+    output.resize(uiStart + length * 2 + 3);
+
+    output[uiStart] = '\'';
+    const size_t uiEscaped = pEscaper ? pEscaper->EscapeString(&output[uiStart + 1], from, length) : EscapeString(&output[uiStart + 1], from, length);
+    output[uiStart + 1 + uiEscaped] = '\'';
+
+    output.resize(uiStart + uiEscaped + 2);
+}
+
+bool QueryFormatter::CopyToPlaceholder(std::string& output, const char*& pos)
+{
+    const char* pStart = pos;
+    char quote = 0;
+
+    for (; *pos; ++pos)
+    {
+        if (quote)
+        {
+            if (*pos == '\\' && quote != '`' && pos[1])
+                ++pos;
+            else if (*pos == quote)
+                quote = 0;
+        }
+        else if (*pos == '\'' || *pos == '"' || *pos == '`')
+        {
+            quote = *pos;
+        }
+        else if (*pos == '?')
+        {
+            output.append(pStart, pos - pStart);
+            ++pos;
+            return true;
+        }
+    }
+
+    output.append(pStart, pos - pStart);
+    return false;
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+#ifndef QUERYFORMATTER_H
+#define QUERYFORMATTER_H
+
+#include "DbField.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdarg>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+class DatabaseBackend;
+
+// Goes into a query as is, without quotes or escaping. For table names, or a batch of VALUES built separately.
+struct SqlRaw
+{
+    explicit SqlRaw(const std::string& str) : strView(str) {}
+    explicit SqlRaw(const char* str) : strView(str) {}
+
+    std::string_view strView;
+};
+
+// Builds queries from SQL with a '?' (outside quotes) for each argument, in order:
+//  integers, enums and floating point numbers as numbers (bool is 1 or 0, char is a number too),
+//  strings quoted and escaped, nullptr and null char pointers as NULL, and SqlRaw as is.
+// Any other argument type doesn't compile. Strings are escaped by the connection's backend they're for, so its character set
+// and NO_BACKSLASH_ESCAPES are taken into account.
+class QueryFormatter
+{
+    public:
+        // Returns false (and says why) if the number of '?' doesn't match the number of arguments.
+        //  pEscaper is the backend of the connection the query goes to, null uses EscapeString.
+        template <class... Args>
+        static bool Format(std::string& output, DatabaseBackend* pEscaper, const char* sql, const Args&... args)
+        {
+            output.clear();
+
+            const char* pos = sql;
+            bool bSuccess = true;
+
+            ((bSuccess = bSuccess && CopyToPlaceholder(output, pos) && (appendArg(output, pEscaper, args), true)), ...);
+
+            if (bSuccess && CopyToPlaceholder(output, pos))
+                bSuccess = false;
+
+            if (!bSuccess)
+                printf("QueryFormatter::Format - '%s' doesn't have one '?' for each of its %u arguments.", sql, uint32(sizeof...(Args)));
+
+            return bSuccess;
+        }
+
+        // The buffer a thread builds its queries in, it's reused so a query costs no allocations once it's big enough.
+        static std::string& getThreadBuffer()
+        {
+            static thread_local std::string s_strBuffer;
+            return s_strBuffer;
+        }
+
+        // printf style, for the varargs Database calls. Grows output past sizeHint if the query is longer.
+        static void FormatV(std::string& output, const size_t sizeHint, const char* format, va_list ap);
+
+        // The same escaping as mysql_real_escape_string with a utf8 connection in the default sql_mode (backslash escapes on),
+        //  to must have room for length * 2 + 1 chars. Returns the escaped length.
+        static size_t EscapeString(char* to, const char* from, const size_t length);
+
+        // Appends from quoted and escaped by pEscaper, or EscapeString if it's null.
+        static void AppendQuoted(std::string& output, DatabaseBackend* pEscaper, const char* from, const size_t length);
+
+    private:
+        // Copies sql from pos up to the next '?' outside quotes, pos is left after it.
+        //  Returns false if there was none, pos is left at the end.
+        static bool CopyToPlaceholder(std::string& output, const char*& pos);
+
+        template <class T>
+        struct DependentFalse : std::false_type {};
+
+        template <class T>
+        static void appendArg(std::string& output, DatabaseBackend* pEscaper, const T& value)
+        {
+            typedef typename std::decay<T>::type Type;
+
+            if constexpr (std::is_same<Type, bool>::value)
+            {
+                output += value ? '1' : '0';
+            }
+            else if constexpr (std::is_enum<Type>::value)
+            {
+                appendArg(output, pEscaper, static_cast<typename std::underlying_type<Type>::type>(value));
+            }
+            else if constexpr (std::is_arithmetic<Type>::value)
+            {
+                // There's no literal for these in SQL.
+                if constexpr (std::is_floating_point<Type>::value)
+                {
+                    if (!std::isfinite(value))
+                    {
+                        output += "NULL";
+                        return;
+                    }
+                }
+
+                char szNumber[32];
+                std::to_chars_result res = std::to_chars(szNumber, szNumber + sizeof(szNumber), value);
+                output.append(szNumber, res.ptr - szNumber);
+            }
+            else if constexpr (std::is_same<Type, const char*>::value || std::is_same<Type, char*>::value)
+            {
+                if (value)
+                    AppendQuoted(output, pEscaper, value, strlen(value));
+                else
+                    output += "NULL";
+            }
+            else if constexpr (std::is_same<Type, std::string>::value || std::is_same<Type, std::string_view>::value)
+            {
+                AppendQuoted(output, pEscaper, value.data(), value.size());
+            }
+            else if constexpr (std::is_same<Type, SqlRaw>::value)
+            {
+                output.append(value.strView.data(), value.strView.size());
+            }
+            else if constexpr (std::is_same<Type, std::nullptr_t>::value)
+            {
+                output += "NULL";
+            }
+            else
+            {
+                static_assert(DependentFalse<Type>::value, "QueryFormatter can't format this type, convert it or wrap SQL in SqlRaw.");
+            }
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "Database.h"
+#include "QueryLanes.h"
+
+QueryLanes::QueryLanes()
+{
+
+}
+
+void QueryLanes::Add(Database& db, std::vector<std::shared_ptr<QueryObj>>& vObjs)
+{
+    for (size_t i = 0; i < vObjs.size(); ++i)
+    {
+        const uint32 uiLane = vObjs[i]->getPriority();
+        KeyCounts& counts = m_uoKeys[vObjs[i]->getShardKey()];
+
+        Waiting waiting;
+        waiting.bRead = vObjs[i]->isRead(db);
+
+        for (uint32 j = 0; j < DB_PRIORITY_COUNT; ++j)
+            waiting.uiAfter[j] = waiting.bRead ? counts.uiAddedWrites[j] : counts.uiAdded[j];
+
+        ++counts.uiAdded[uiLane];
+
+        if (!waiting.bRead)
+            ++counts.uiAddedWrites[uiLane];
+
+        waiting.pObj = std::move(vObjs[i]);
+        m_lanes[uiLane].vObjs.push_back(std::move(waiting));
+    }
+
+    vObjs.clear();
+}
+
+std::shared_ptr<QueryObj> QueryLanes::Next(const uint32 (&weights)[DB_PRIORITY_COUNT])
+{
+    // Once every lane with work has used up its share, a new round starts.
+    for (uint32 uiRound = 0; uiRound < 2; ++uiRound)
+    {
+        for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+        {
+            if (m_lanes[i].uiCredit && isReady(i))
+            {
+                --m_lanes[i].uiCredit;
+                return Take(i);
+            }
+        }
+
+        for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+            m_lanes[i].uiCredit = weights[i];
+    }
+
+    // Only lanes weighted 0 have anything ready, or the others wait on them. The oldest object of all is always ready.
+    for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+    {
+        if (isReady(i))
+            return Take(i);
+    }
+
+    return nullptr;
+}
+
+bool QueryLanes::isReady(const uint32 lane) const
+{
+    const Lane& ownLane = m_lanes[lane];
+
+    if (ownLane.uiNext == ownLane.vObjs.size())
+        return false;
+
+    // Its own lane is in order already, only the others can hold something of its key from before it.
+    const Waiting& waiting = ownLane.vObjs[ownLane.uiNext];
+    const KeyCounts& counts = m_uoKeys.find(waiting.pObj->getShardKey())->second;
+
+    for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+    {
+        if (i != lane && (waiting.bRead ? counts.uiTakenWrites[i] : counts.uiTaken[i]) < waiting.uiAfter[i])
+            return false;
+    }
+
+    return true;
+}
+
+std::shared_ptr<QueryObj> QueryLanes::Take(const uint32 lane)
+{
+    Lane& ownLane = m_lanes[lane];
+    Waiting& waiting = ownLane.vObjs[ownLane.uiNext++];
+
+    auto itr = m_uoKeys.find(waiting.pObj->getShardKey());
+    KeyCounts& counts = itr->second;
+
+    ++counts.uiTaken[lane];
+
+    if (!waiting.bRead)
+        ++counts.uiTakenWrites[lane];
+
+    bool bWaiting = false;
+
+    for (uint32 i = 0; i < DB_PRIORITY_COUNT && !bWaiting; ++i)
+        bWaiting = counts.uiTaken[i] != counts.uiAdded[i];
+
+    if (!bWaiting)
+        m_uoKeys.erase(itr);
+
+    std::shared_ptr<QueryObj> pObj = std::move(waiting.pObj);
+
+    if (ownLane.uiNext == ownLane.vObjs.size())
+    {
+        ownLane.vObjs.clear();
+        ownLane.uiNext = 0;
+    }
+
+    return pObj;
+}
+
+size_t QueryLanes::size() const
+{
+    size_t uiSize = 0;
+
+    for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+        uiSize += getDepth(DbPriority(i));
+
+    return uiSize;
+}
+
+int64 QueryLanes::getOldestQueuedUs() const
+{
+    int64 iOldest = 0;
+
+    // Each lane is in the order it was queued, only the first of each can be the oldest.
+    for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+    {
+        const Lane& lane = m_lanes[i];
+
+        if (lane.uiNext < lane.vObjs.size() && (!iOldest || lane.vObjs[lane.uiNext].pObj->m_iQueuedUs < iOldest))
+            iOldest = lane.vObjs[lane.uiNext].pObj->m_iQueuedUs;
+    }
+
+    return iOldest;
+}
\ No newline at end of file
@@ -0,0 +1,135 @@
+#ifndef QUERYLANES_H
+#define QUERYLANES_H
+
+#include "DbField.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Database;
+class QueryObj;
+
+// Which lane of its worker a queued object waits in, see Database::SetPriorityWeights.
+enum DbPriority
+{
+    // Reads someone is waiting on: callbacks, QueryAsync and the like.
+    DB_PRIORITY_INTERACTIVE,
+
+    // Everything else queued, unless a DbPriorityScope says otherwise.
+    DB_PRIORITY_NORMAL,
+
+    // Saves and cleanups that can wait.
+    DB_PRIORITY_BULK,
+
+    DB_PRIORITY_COUNT
+};
+
+// While one exists, everything this thread queues goes in its priority (the innermost one wins).
+//  { DbPriorityScope bulk(DB_PRIORITY_BULK); SaveAllPlayers(); }
+class DbPriorityScope
+{
+    public:
+        explicit DbPriorityScope(const DbPriority priority) :
+            m_iPrevious(current())
+        {
+            current() = int32(priority);
+        }
+
+        ~DbPriorityScope() { current() = m_iPrevious; }
+
+        // False when no scope is open on this thread.
+        static bool getPriority(DbPriority& priority)
+        {
+            if (current() < 0)
+                return false;
+
+            priority = DbPriority(current());
+            return true;
+        }
+
+    private:
+        DbPriorityScope(const DbPriorityScope&);
+        void operator=(const DbPriorityScope&);
+
+        static int32& current()
+        {
+            static thread_local int32 s_iPriority = -1;
+            return s_iPriority;
+        }
+
+        int32 m_iPrevious;
+};
+
+// What a worker (or event loop connection) took from its queue but hasn't started, one FIFO per priority.
+// Lanes only reorder objects with different shard keys, or reads: an object never runs ahead of one queued before it with
+// the same shard key, unless both only read. A callback can't read past an earlier write to its key, and a bulk write can't
+// be overtaken by a later normal write to the same rows.
+class QueryLanes
+{
+    public:
+        QueryLanes();
+
+        // vObjs is left empty. db tells reads from writes.
+        void Add(Database& db, std::vector<std::shared_ptr<QueryObj>>& vObjs);
+
+        // Null when every lane is empty. While several lanes have work, each round takes up to weights[p] objects
+        //  from lane p, highest priority first. A lane weighted 0 only runs when the others have nothing.
+        //  A lane whose next object has to wait for one in another lane (see above) is passed over until it doesn't.
+        std::shared_ptr<QueryObj> Next(const uint32 (&weights)[DB_PRIORITY_COUNT]);
+
+        bool empty() const { return size() == 0; }
+        size_t size() const;
+        size_t getDepth(const DbPriority priority) const { return m_lanes[priority].vObjs.size() - m_lanes[priority].uiNext; }
+
+        // When the oldest object still waiting was queued, 0 for none.
+        int64 getOldestQueuedUs() const;
+
+    private:
+        struct Waiting
+        {
+            std::shared_ptr<QueryObj> pObj;
+            bool bRead;
+
+            // Per lane, how many objects (only writes, if this is a read) with its key had been added there before it.
+            //  It waits until that many were taken.
+            uint64 uiAfter[DB_PRIORITY_COUNT];
+        };
+
+        // Counts of a shard key's objects per lane, forgotten once it has none waiting.
+        struct KeyCounts
+        {
+            KeyCounts()
+            {
+                for (uint32 i = 0; i < DB_PRIORITY_COUNT; ++i)
+                    uiAdded[i] = uiAddedWrites[i] = uiTaken[i] = uiTakenWrites[i] = 0;
+            }
+
+            uint64 uiAdded[DB_PRIORITY_COUNT];
+            uint64 uiAddedWrites[DB_PRIORITY_COUNT];
+            uint64 uiTaken[DB_PRIORITY_COUNT];
+            uint64 uiTakenWrites[DB_PRIORITY_COUNT];
+        };
+
+        struct Lane
+        {
+            Lane() : uiNext(0), uiCredit(0) {}
+
+            // Run from uiNext on, cleared (keeping its capacity) once it's all run.
+            std::vector<Waiting> vObjs;
+            size_t uiNext;
+
+            // What's left of this round's weight.
+            uint32 uiCredit;
+        };
+
+        // True if lane has an object that nothing queued before it has to run ahead of.
+        bool isReady(const uint32 lane) const;
+
+        std::shared_ptr<QueryObj> Take(const uint32 lane);
+
+        Lane m_lanes[DB_PRIORITY_COUNT];
+        std::unordered_map<uint64, KeyCounts> m_uoKeys;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,157 @@
+#ifndef QUERYMAPPING_H
+#define QUERYMAPPING_H
+
+#include "QueryResult.h"
+#include "QueryStream.h"
+
+#include <array>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Binds a member of T to the column called szName.
+template <class T, class M>
+struct DbColumn
+{
+    const char* szName;
+    M T::* pMember;
+};
+
+template <class T, class M>
+constexpr DbColumn<T, M> dbColumn(const char* name, M T::* member) { return { name, member }; }
+
+// Specialized once for each struct loaded from rows, columns() returns a tuple of dbColumn:
+//
+//  template <> struct DbMapping<Player>
+//  {
+//      static auto columns() { return std::make_tuple(dbColumn("guid", &Player::uiGuid), dbColumn("name", &Player::strName)); }
+//  };
+template <class T>
+struct DbMapping;
+
+// Fills structs from the rows of a QueryResult or QueryStream through their DbMapping.
+// Columns are found by name once per result, and each member is read with the getter for its type, picked when compiling:
+//  numbers, enums, bool, std::string and std::optional of those (empty for NULL). Any other member type doesn't compile.
+// Columns without a binding are ignored, members without one are left default constructed.
+class QueryMapping
+{
+    public:
+        // Appends a T for each row left in result (a shared_ptr, unique_ptr or pointer) to vRows. Null has no rows.
+        //  Returns false, with nothing added, if a bound column isn't in the result.
+        template <class T, class ResultPtr>
+        static bool mapRows(const ResultPtr& result, std::vector<T>& vRows)
+        {
+            return forEachRow<T>(result, [&vRows](T& row) { vRows.push_back(std::move(row)); });
+        }
+
+        // Same as mapRows, visitor is called with a T& for each row instead.
+        template <class T, class ResultPtr, class Visitor>
+        static bool forEachRow(const ResultPtr& result, Visitor visitor)
+        {
+            if (!result || !result->fetchCurrentRow())
+                return true;
+
+            const auto columns = DbMapping<T>::columns();
+            typedef std::make_index_sequence<std::tuple_size<typename std::decay<decltype(columns)>::type>::value> Sequence;
+
+            std::array<int32, Sequence::size()> indices;
+
+            if (!resolveColumns(*result, columns, indices, Sequence()))
+                return false;
+
+            do
+            {
+                const DbField* pFields = result->fetchCurrentRow();
+
+                T row = T();
+                readRow(pFields, columns, indices, row, Sequence());
+                visitor(row);
+            }
+            while (result->NextRow());
+
+            return true;
+        }
+
+    private:
+        template <class M>
+        struct isOptional : std::false_type {};
+
+        template <class M>
+        struct isOptional<std::optional<M>> : std::true_type {};
+
+        template <class M>
+        struct DependentFalse : std::false_type {};
+
+        template <class Result, class Columns, size_t... I>
+        static bool resolveColumns(const Result& result, const Columns& columns, std::array<int32, sizeof...(I)>& indices, std::index_sequence<I...>)
+        {
+            bool bFound = true;
+
+            ((bFound = resolveColumn(result, std::get<I>(columns).szName, indices[I]) && bFound), ...);
+            return bFound;
+        }
+
+        template <class Result>
+        static bool resolveColumn(const Result& result, const char* name, int32& index)
+        {
+            index = result.getColumnIndex(name);
+
+            if (index < 0)
+                printf("QueryMapping::resolveColumn - There's no column '%s' in the result.", name);
+
+            return index >= 0;
+        }
+
+        template <class T, class Columns, size_t... I>
+        static void readRow(const DbField* pFields, const Columns& columns, const std::array<int32, sizeof...(I)>& indices, T& row, std::index_sequence<I...>)
+        {
+            (readField(pFields[indices[I]], row.*(std::get<I>(columns).pMember)), ...);
+        }
+
+        template <class M>
+        static void readField(const DbField& field, M& value)
+        {
+            if constexpr (std::is_same<M, std::string>::value)
+            {
+                if (field.isNull())
+                    value.clear();
+                else
+                    value.assign(field.getString(), field.getLength());
+            }
+            else if constexpr (std::is_same<M, bool>::value)
+            {
+                value = field.getBool();
+            }
+            else if constexpr (std::is_enum<M>::value)
+            {
+                value = static_cast<M>(field.getNumber<typename std::underlying_type<M>::type>());
+            }
+            else if constexpr (std::is_arithmetic<M>::value)
+            {
+                value = field.getNumber<M>();
+            }
+            else if constexpr (isOptional<M>::value)
+            {
+                if (field.isNull())
+                {
+                    value.reset();
+                }
+                else
+                {
+                    typename M::value_type inner = typename M::value_type();
+                    readField(field, inner);
+                    value = std::move(inner);
+                }
+            }
+            else
+            {
+                static_assert(DependentFalse<M>::value, "QueryMapping can't read a column into this member type.");
+            }
+        }
+};
+
+#endif
\ No newline at end of file
@@ -1,28 +1,620 @@
-#include "Database.h"
-
-#include <ctime>
-#include <iostream>
-#include <fstream>
-
-// It's assumed that Database::m_mutexMysql will already be locked in scope when any of these functions are called
-//
-
-void QueryObj::RunQuery(Database& db)
-{
-    // Would be nonsensical for this to be empty.
-    ASSERT(!m_strQuery.empty());
-    db.RawMysqlQueryCall(m_strQuery, true);
-}
-
-void CallbackQueryObj::RunQuery(Database& db)
-{
-    std::shared_ptr<ResultQueryHolder> result(new ResultQueryHolder(m_strMsgToSelf));
-    
-    // Would be nonsensical for this to be empty.
-    ASSERT(!m_uoQueries.empty());
-
-    for (auto itr = m_uoQueries.begin(); itr != m_uoQueries.end(); ++itr)
-        result->setResult(itr->first, db.PerformQuery(itr->second));
-
-    db.CallbackResult(m_uiId, result);
+#include "Database.h"
+#include "BulkLoader.h"
+
+#include <ctime>
+#include <iostream>
+#include <fstream>
+#include <typeinfo>
+#include <thread>
+#include <chrono>
+
+// It's assumed that the DatabaseConnection's mutex will already be locked in scope when any of these functions are called
+//
+
+QueryObj::~QueryObj()
+{
+    if (m_pSpool)
+        m_pSpool->MarkDone(m_uiSpoolRecord);
+
+    if (m_pLimiter)
+        m_pLimiter->Release(m_uiQueuedBytes);
+
+    if (m_pWriteWindow)
+    {
+        m_pWriteWindow->iLastUs.store(DatabaseMetrics::NowUs(), std::memory_order_relaxed);
+        m_pWriteWindow->uiPending.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void QueryObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    // Would be nonsensical for this to be empty.
+    ASSERT(!m_strQuery.empty());
+    conn.RawMysqlQueryCall(m_strQuery, true);
+}
+
+void CallbackQueryObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    std::shared_ptr<ResultQueryHolder> result(new ResultQueryHolder(m_strMsgToSelf));
+    
+    // Would be nonsensical for this to be empty.
+    ASSERT(!m_uoQueries.empty());
+
+    // Several queries go in one round trip, the ones the batch didn't get to run one at a time.
+    std::unordered_map<uint8, std::string>::const_iterator itr = m_uoQueries.begin();
+
+    if (m_uoQueries.size() > 1)
+        itr = RunBatch(conn, *result);
+
+    for (; itr != m_uoQueries.end(); ++itr)
+        result->setResult(itr->first, conn.PerformQuery(itr->second));
+
+    db.CallbackResult(m_uiId, result);
+}
+
+std::unordered_map<uint8, std::string>::const_iterator CallbackQueryObj::RunBatch(DatabaseConnection& conn, ResultQueryHolder& result) const
+{
+    std::string strBatch;
+
+    for (auto itr = m_uoQueries.begin(); itr != m_uoQueries.end(); ++itr)
+    {
+        const std::string& strQuery = itr->second;
+        const size_t uiEnd = strQuery.find_last_not_of(" \t\r\n;");
+
+        // A ';' inside (even quoted) would throw off which result is whose.
+        if (uiEnd == std::string::npos || strQuery.find(';') < uiEnd)
+            return m_uoQueries.begin();
+
+        if (!strBatch.empty())
+            strBatch += ';';
+
+        strBatch.append(strQuery, 0, uiEnd + 1);
+    }
+
+    if (strBatch.size() + 1024 > conn.getMaxAllowedPacket())
+        return m_uoQueries.begin();
+
+    std::vector<std::shared_ptr<QueryResult>> vResults;
+    const int64 iStartUs = DatabaseMetrics::NowUs();
+    const bool bSuccess = conn.ExecuteMultiStatement(strBatch, &vResults);
+
+    // Each one that ran gets an even share of the time. The one that failed is already counted as the batch's error.
+    const uint64 uiShareUs = vResults.empty() ? 0 : uint64(DatabaseMetrics::NowUs() - iStartUs) / vResults.size();
+    auto itr = m_uoQueries.begin();
+
+    for (size_t i = 0; i < vResults.size(); ++i, ++itr)
+    {
+        conn.RecordBatchedStatement(itr->second, uiShareUs);
+        result.setResult(itr->first, vResults[i]);
+    }
+
+    // The server stopped at the one that failed, it gets no result like it would on its own.
+    if (!bSuccess && itr != m_uoQueries.end())
+        ++itr;
+
+    return itr;
+}
+
+bool CallbackQueryObj::GetStatements(std::vector<std::string>& vStatements)
+{
+    ASSERT(!m_uoQueries.empty());
+
+    m_pPendingResult.reset(new ResultQueryHolder(m_strMsgToSelf));
+    m_vStatementKeys.clear();
+
+    for (auto itr = m_uoQueries.begin(); itr != m_uoQueries.end(); ++itr)
+    {
+        m_vStatementKeys.push_back(itr->first);
+        vStatements.push_back(itr->second);
+    }
+
+    return true;
+}
+
+void CallbackQueryObj::OnStatementResult(const size_t index, std::shared_ptr<QueryResult> result)
+{
+    m_pPendingResult->setResult(m_vStatementKeys[index], result);
+}
+
+void CallbackQueryObj::OnStatementsDone(Database& db)
+{
+    db.CallbackResult(m_uiId, m_pPendingResult);
+    m_pPendingResult.reset();
+}
+
+bool CallbackQueryObj::isRead(Database& db) const
+{
+    for (auto itr = m_uoQueries.begin(); itr != m_uoQueries.end(); ++itr)
+    {
+        if (!Database::isReadQuery(itr->second.c_str()))
+            return false;
+    }
+
+    return true;
+}
+
+size_t CallbackQueryObj::getQueuedBytes() const
+{
+    size_t uiBytes = 0;
+
+    for (auto itr = m_uoQueries.begin(); itr != m_uoQueries.end(); ++itr)
+        uiBytes += itr->second.size();
+
+    return uiBytes;
+}
+
+void PreparedQueryObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    conn.ExecuteStatement(db, m_stmt);
+}
+
+void BulkLoadObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    uint64 uiRows = 0;
+    const bool bSuccess = conn.LoadData(m_pState->strStatement, m_strData, uiRows);
+
+    // Let go of the chunk before reporting, the loader may be waiting to fill another one.
+    std::string().swap(m_strData);
+    m_pState->OnChunkDone(bSuccess, uiRows);
+}
+
+void WriteBehindObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    // Leave room for the packet header.
+    const size_t uiMaxPacket = size_t(conn.getMaxAllowedPacket() - 1024);
+
+    size_t i = 0;
+    std::string strBatch;
+    std::vector<std::shared_ptr<QueryResult>> vResults;
+
+    while (i < m_vStatements.size())
+    {
+        size_t uiEnd = i;
+        strBatch.clear();
+
+        while (uiEnd < m_vStatements.size() && (strBatch.empty() || strBatch.size() + m_vStatements[uiEnd].size() + 1 <= uiMaxPacket))
+        {
+            if (!strBatch.empty())
+                strBatch += ';';
+
+            strBatch += m_vStatements[uiEnd++];
+        }
+
+        if (uiEnd == i + 1)
+        {
+            conn.RawMysqlQueryCall(m_vStatements[i], true);
+            ++i;
+            continue;
+        }
+
+        vResults.clear();
+
+        if (conn.ExecuteMultiStatement(strBatch, &vResults))
+        {
+            for (; i < uiEnd; ++i)
+                conn.NotifyWrite(m_vStatements[i]);
+
+            continue;
+        }
+
+        // The server stopped at the one that failed, the ones before it ran. Carry on after it.
+        const size_t uiFailed = i + vResults.size();
+
+        for (; i < uiFailed; ++i)
+            conn.NotifyWrite(m_vStatements[i]);
+
+        i = uiFailed + 1;
+    }
+
+    if (m_fnOnFlushed)
+        m_fnOnFlushed();
+}
+
+size_t WriteBehindObj::getQueuedBytes() const
+{
+    size_t uiBytes = 0;
+
+    for (size_t i = 0; i < m_vStatements.size(); ++i)
+        uiBytes += m_vStatements[i].size();
+
+    return uiBytes;
+}
+
+bool WriteBehindObj::GetStatements(std::vector<std::string>& vStatements)
+{
+    vStatements.insert(vStatements.end(), m_vStatements.begin(), m_vStatements.end());
+    return true;
+}
+
+void AsyncQueryObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    std::shared_ptr<QueryResult> result;
+
+    if (m_pStmt)
+        conn.ExecuteStatement(db, *m_pStmt, &result);
+    else
+        result = conn.PerformQuery(m_strQuery);
+
+    Deliver(result);
+}
+
+bool AsyncQueryObj::GetStatements(std::vector<std::string>& vStatements)
+{
+    // Prepared statements need RunQuery.
+    return !m_pStmt && QueryObj::GetStatements(vStatements);
+}
+
+bool AsyncQueryObj::isRead(Database& db) const
+{
+    return m_pStmt ? db.isReadStatement(m_pStmt->getId()) : Database::isReadQuery(m_strQuery.c_str());
+}
+
+void AsyncQueryObj::Deliver(std::shared_ptr<QueryResult> result)
+{
+    if (!m_fnOnResult)
+        return;
+
+    if (m_fnExecutor)
+    {
+        ResultHandler fnOnResult = m_fnOnResult;
+        m_fnExecutor([fnOnResult, result]() { fnOnResult(result); });
+    }
+    else
+    {
+        m_fnOnResult(result);
+    }
+}
+
+static bool StartsWithNoCase(const char* str, const char* prefix)
+{
+    for (; *prefix; ++str, ++prefix)
+    {
+        if (toupper((unsigned char)*str) != toupper((unsigned char)*prefix))
+            return false;
+    }
+
+    return true;
+}
+
+CoalescedInsertObj::CoalescedInsertObj(std::shared_ptr<QueryObj> pFirst, const size_t prefixLength, const size_t valuesStart, const size_t valuesEnd) :
+    QueryObj("", pFirst->getShardKey()),
+    m_uiPrefixLength(prefixLength)
+{
+    const std::string& strFirst = pFirst->m_strQuery;
+
+    m_strQuery.reserve(strFirst.size() * 4);
+    m_strQuery.append(strFirst, 0, prefixLength);
+    m_strQuery.append(strFirst, valuesStart, valuesEnd - valuesStart);
+    m_vOriginals.push_back(pFirst);
+
+    // Rows only get added after this one, it's the oldest.
+    m_iQueuedUs = pFirst->m_iQueuedUs;
+    m_ePriority = pFirst->m_ePriority;
+}
+
+bool CoalescedInsertObj::TryAdd(std::shared_ptr<QueryObj> pObj, const size_t prefixLength, const size_t valuesStart, const size_t valuesEnd, const size_t maxBytes)
+{
+    const std::string& strQuery = pObj->m_strQuery;
+
+    // Merging across lanes would run the lower one's rows early, or the higher one's late.
+    //  Across shard keys, the rows would be ordered against the first one's key instead of their own.
+    if (pObj->m_ePriority != m_ePriority || pObj->getShardKey() != getShardKey())
+        return false;
+
+    if (prefixLength != m_uiPrefixLength || strQuery.compare(0, prefixLength, m_strQuery, 0, m_uiPrefixLength) != 0)
+        return false;
+
+    if (m_strQuery.size() + 1 + valuesEnd - valuesStart > maxBytes)
+        return false;
+
+    m_strQuery += ',';
+    m_strQuery.append(strQuery, valuesStart, valuesEnd - valuesStart);
+    m_vOriginals.push_back(pObj);
+    return true;
+}
+
+// ER_PARSE_ERROR, ER_BAD_FIELD_ERROR, ER_WRONG_VALUE_COUNT_ON_ROW, ER_NO_SUCH_TABLE and ER_FIELD_SPECIFIED_TWICE:
+// the statement was turned down before any row was written, whatever the engine.
+static bool IsRejectedStatementError(const uint32 error)
+{
+    return error == 1064 || error == 1054 || error == 1136 || error == 1146 || error == 1110;
+}
+
+void CoalescedInsertObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    if (conn.RawMysqlQueryCall(m_strQuery, true))
+        return;
+
+    // The rows are only tried one by one when the combined insert is known to have left nothing behind.
+    //  After a lost connection it may have run, and a non-transactional table keeps the rows before a bad one.
+    const uint32 uiError = conn.getLastError();
+
+    if (DatabaseConnection::isConnectionLost(uiError))
+        return;
+
+    if (!IsRejectedStatementError(uiError) && !conn.isTransactionalTable(QueryCache::getWrittenTable(m_strQuery)))
+    {
+        printf("CoalescedInsertObj::RunQuery - Combined insert of %u rows failed, some may have been written, they're not retried.", uint32(m_vOriginals.size()));
+        return;
+    }
+
+    for (size_t i = 0; i < m_vOriginals.size(); ++i)
+        m_vOriginals[i]->RunQuery(db, conn);
+}
+
+void CoalescedInsertObj::Coalesce(std::vector<std::shared_ptr<QueryObj>>& queries, const size_t maxBytes)
+{
+    std::vector<std::shared_ptr<QueryObj>> result;
+    result.reserve(queries.size());
+
+    std::shared_ptr<CoalescedInsertObj> pCurrent;
+
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+        std::shared_ptr<QueryObj>& pObj = queries[i];
+        size_t prefixLength, valuesStart, valuesEnd;
+
+        // Subclasses do more than run their string, leave them alone.
+        if (typeid(*pObj) != typeid(QueryObj) || !ParseInsert(pObj->m_strQuery, prefixLength, valuesStart, valuesEnd))
+        {
+            pCurrent.reset();
+            result.push_back(pObj);
+            continue;
+        }
+
+        if (pCurrent && pCurrent->TryAdd(pObj, prefixLength, valuesStart, valuesEnd, maxBytes))
+            continue;
+
+        pCurrent = std::make_shared<CoalescedInsertObj>(pObj, prefixLength, valuesStart, valuesEnd);
+        result.push_back(pCurrent);
+    }
+
+    // Nothing to gain from wrapping a lone insert.
+    for (size_t i = 0; i < result.size(); ++i)
+    {
+        if (CoalescedInsertObj* pCoalesced = dynamic_cast<CoalescedInsertObj*>(result[i].get()))
+        {
+            if (pCoalesced->m_vOriginals.size() == 1)
+                result[i] = pCoalesced->m_vOriginals[0];
+        }
+    }
+
+    queries.swap(result);
+}
+
+bool CoalescedInsertObj::ParseInsert(const std::string& strQuery, size_t& prefixLength, size_t& valuesStart, size_t& valuesEnd)
+{
+    const char* pQuery = strQuery.c_str();
+    const size_t uiLength = strQuery.size();
+
+    size_t i = 0;
+
+    while (i < uiLength && isspace((unsigned char)pQuery[i]))
+        ++i;
+
+    if (!StartsWithNoCase(pQuery + i, "INSERT") && !StartsWithNoCase(pQuery + i, "REPLACE"))
+        return false;
+
+    // Find the VALUES keyword outside of quotes and parentheses, then check exactly one row follows it.
+    char chQuote = 0;
+    int32 iDepth = 0;
+    bool bFoundValues = false;
+    size_t uiRowEnd = 0;
+
+    for (; i < uiLength; ++i)
+    {
+        const char ch = pQuery[i];
+
+        if (chQuote)
+        {
+            if (ch == '\\' && chQuote != '`')
+                ++i;
+            else if (ch == chQuote)
+                chQuote = 0;
+
+            continue;
+        }
+
+        if (ch == '\'' || ch == '"' || ch == '`')
+        {
+            chQuote = ch;
+            continue;
+        }
+
+        if (!bFoundValues)
+        {
+            if (ch == '(')
+                ++iDepth;
+            else if (ch == ')')
+                --iDepth;
+            else if (!iDepth && (ch == 'V' || ch == 'v') && i > 0 && !isalnum((unsigned char)pQuery[i - 1]) && pQuery[i - 1] != '_' &&
+                     StartsWithNoCase(pQuery + i, "VALUES") && (i + 6 == uiLength || !isalnum((unsigned char)pQuery[i + 6])))
+            {
+                bFoundValues = true;
+                i += 5;
+                prefixLength = i + 1;
+
+                size_t j = prefixLength;
+
+                while (j < uiLength && isspace((unsigned char)pQuery[j]))
+                    ++j;
+
+                if (j == uiLength || pQuery[j] != '(')
+                    return false;
+
+                valuesStart = j;
+            }
+
+            continue;
+        }
+
+        if (uiRowEnd)
+        {
+            // Only whitespace (or a final ';') may follow the row.
+            if (!isspace((unsigned char)ch) && !(ch == ';' && i + 1 == uiLength))
+                return false;
+
+            continue;
+        }
+
+        if (ch == '(')
+        {
+            ++iDepth;
+        }
+        else if (ch == ')')
+        {
+            if (--iDepth == 0)
+                uiRowEnd = i;
+        }
+    }
+
+    if (!uiRowEnd || chQuote)
+        return false;
+
+    valuesEnd = uiRowEnd + 1;
+    return true;
+}
+
+// ER_LOCK_DEADLOCK and ER_LOCK_WAIT_TIMEOUT, both safe to run again from the start after a rollback.
+//  So is a lost connection before COMMIT was sent, the server rolled back with the session.
+static bool IsRetryableTransactionError(const uint32 error, const bool bCommitSent)
+{
+    return error == 1213 || error == 1205 || (!bCommitSent && DatabaseConnection::isConnectionLost(error));
+}
+
+void TransactionQueryObj::RunQuery(Database& db, DatabaseConnection& conn)
+{
+    static const uint32 uiMaxAttempts = 3;
+
+    bool bCommitted = false;
+
+    if (!m_vQueries.empty())
+    {
+        for (uint32 i = 0; i < uiMaxAttempts && !bCommitted; ++i)
+        {
+            bool bCommitSent = false;
+
+            conn.SetReconnect(false);
+            bCommitted = TryCommit(db, conn, bCommitSent);
+            conn.SetReconnect(true);
+
+            if (bCommitted)
+                break;
+
+            // Reconnects now if the connection was lost.
+            const uint32 uiError = conn.getLastError();
+            conn.RawMysqlQueryCall("ROLLBACK", true);
+
+            if (!IsRetryableTransactionError(uiError, bCommitSent))
+                break;
+
+            printf("TransactionQueryObj::RunQuery - Lock conflict or lost connection, retrying transaction (attempt %u).", i + 2);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10 << i));
+        }
+    }
+    else
+    {
+        bCommitted = true;
+    }
+
+    if (m_fnOnComplete)
+        m_fnOnComplete(bCommitted);
+}
+
+size_t TransactionQueryObj::getQueuedBytes() const
+{
+    size_t uiBytes = 0;
+
+    for (size_t i = 0; i < m_vQueries.size(); ++i)
+        uiBytes += m_vQueries[i]->getQueuedBytes();
+
+    return uiBytes;
+}
+
+bool TransactionQueryObj::TryCommit(Database& db, DatabaseConnection& conn, bool& bCommitSent)
+{
+    if (!conn.RawMysqlQueryCall("START TRANSACTION", true))
+        return false;
+
+    // A backend that reconnects anyway would run the rest with autocommit on, and COMMIT would still succeed.
+    const unsigned long uiSession = conn.getThreadId();
+
+    auto sameSession = [&conn, uiSession]
+    {
+        if (conn.getThreadId() == uiSession)
+            return true;
+
+        printf("TransactionQueryObj::TryCommit - Reconnected in the middle of a transaction, it's rolled back.");
+        conn.SetLastError(2013);
+        return false;
+    };
+
+    // Leave room for the packet header.
+    const size_t uiMaxPacket = size_t(conn.getMaxAllowedPacket() - 1024);
+    std::string strBatch;
+
+    for (size_t i = 0; i < m_vQueries.size(); ++i)
+    {
+        QueryObj* pObj = m_vQueries[i].get();
+
+        if (typeid(*pObj) == typeid(QueryObj))
+        {
+            const std::string& strQuery = pObj->m_strQuery;
+            const size_t uiEnd = strQuery.find_last_not_of(" \t\r\n;");
+
+            if (uiEnd == std::string::npos)
+                continue;
+
+            if (!strBatch.empty() && strBatch.size() + uiEnd + 2 > uiMaxPacket)
+            {
+                if (!conn.ExecuteMultiStatement(strBatch) || !sameSession())
+                    return false;
+
+                strBatch.clear();
+            }
+
+            if (!strBatch.empty())
+                strBatch += ';';
+
+            strBatch.append(strQuery, 0, uiEnd + 1);
+            continue;
+        }
+
+        // Anything else runs on its own, after what was batched before it.
+        if (!strBatch.empty())
+        {
+            if (!conn.ExecuteMultiStatement(strBatch) || !sameSession())
+                return false;
+
+            strBatch.clear();
+        }
+
+        PreparedQueryObj* pPrepared = dynamic_cast<PreparedQueryObj*>(pObj);
+        ASSERT(pPrepared);
+
+        if (!conn.ExecuteStatement(db, pPrepared->m_stmt) || !sameSession())
+            return false;
+    }
+
+    if (!strBatch.empty() && !conn.ExecuteMultiStatement(strBatch))
+        return false;
+
+    if (!sameSession())
+        return false;
+
+    bCommitSent = true;
+
+    if (!conn.RawMysqlQueryCall("COMMIT", true))
+        return false;
+
+    // Only now can anyone else read what was written, cached results from before the commit are stale.
+    for (size_t i = 0; i < m_vQueries.size(); ++i)
+    {
+        if (typeid(*m_vQueries[i]) == typeid(QueryObj))
+            conn.NotifyWrite(m_vQueries[i]->m_strQuery);
+        else
+            conn.NotifyStatementWrite(static_cast<PreparedQueryObj*>(m_vQueries[i].get())->m_stmt.getId());
+    }
+
+    return true;
 }
\ No newline at end of file
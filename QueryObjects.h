@@ -1,91 +1,386 @@
-#ifndef QUERYOBJECTS_H
-#define QUERYOBJECTS_H
-
-class Database;
-class QueryResult;
-
-// Executes the query.
-class QueryObj
-{
-    friend class Database;
-
-    public:
-        QueryObj(const std::string str = "") :
-            m_strQuery(str)
-        {}
-
-        virtual ~QueryObj() {}
-
-        void operator=(const QueryObj &otherObj)
-        { 
-            m_strQuery = otherObj.m_strQuery;
-        }
-    
-    protected:
-        virtual void RunQuery(Database& db);
-
-        std::string m_strQuery;
-};
-
-class CallbackQueryObj : public QueryObj
-{
-    friend class Database;
-    
-    public:        
-        CallbackQueryObj(const uint64 id, const std::string msgToSlelf, const std::string query) :
-                m_uiId(id)
-        {
-            m_uoQueries[0] = query;
-        }
-
-        CallbackQueryObj(const uint64 id, const std::string msgToSlelf, const std::unordered_map<uint8, std::string>& queries) :
-                m_uoQueries(queries),
-                m_uiId(id)
-        {}
-
-        virtual ~CallbackQueryObj() {}
-        
-        class ResultQueryHolder
-        {
-            public:        
-                ResultQueryHolder(const std::string msgToSelf = "") :
-                    m_strMsgToSelf(msgToSelf)
-                {}
-
-                void setResult(const uint8 id, std::shared_ptr<QueryResult> value) { m_results[id] = value; }
-
-                std::shared_ptr<QueryResult> getResult(const uint8 id = 0) const
-                {
-                    auto itr = m_results.find(id);
-
-                    if (itr != m_results.end())
-                        return itr->second;
-
-                    return nullptr;
-                }
-
-                std::string getMsgToSelf() const { return m_strMsgToSelf; }
-
-            private:
-                const std::string m_strMsgToSelf;
-                std::unordered_map<uint8, std::shared_ptr<QueryResult>> m_results;
-        };
-
-        void operator=(const CallbackQueryObj &otherObj)
-        { 
-            m_uoQueries = otherObj.m_uoQueries;
-            m_strQuery = otherObj.m_strQuery;
-        }
-
-        uint64 getId() const { return m_uiId; }
-
-    protected:
-        virtual void RunQuery(Database& db) final;
-
-        const uint64 m_uiId;
-        const std::string m_strMsgToSelf;
-
-        std::unordered_map<uint8, std::string> m_uoQueries;
-};
-
+#ifndef QUERYOBJECTS_H
+#define QUERYOBJECTS_H
+
+#include "PreparedStatement.h"
+#include "QueryLanes.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+class Database;
+class DatabaseConnection;
+class QueryResult;
+class QueueLimiter;
+class WriteSpool;
+struct BulkLoadState;
+
+// Runs the given work somewhere else, e.g. posts it to the game loop's task list.
+typedef std::function<void(std::function<void()>)> DbExecutor;
+
+// Writes of one shard key (or one thread) that are queued or running, and when the last of them finished.
+//  See Database::SetReadYourWrites.
+struct DbWriteWindow
+{
+    DbWriteWindow() : uiPending(0), iLastUs(0) {}
+
+    std::atomic<uint32> uiPending;
+    std::atomic<int64> iLastUs;
+};
+
+// Executes the query.
+class QueryObj
+{
+    friend class Database;
+    friend class AsyncEngine;
+    friend class CoalescedInsertObj;
+    friend class TransactionQueryObj;
+    friend class QueryLanes;
+    friend class QueueLimiter;
+    friend class WriteSpool;
+
+    public:
+        QueryObj(const std::string& str = "", const uint64 shardKey = 0) :
+            m_strQuery(str),
+            m_uiShardKey(shardKey),
+            m_ePriority(DB_PRIORITY_NORMAL),
+            m_bReplicaRead(false),
+            m_iQueuedUs(0),
+            m_pLimiter(nullptr),
+            m_uiQueuedBytes(0),
+            m_pSpool(nullptr),
+            m_uiSpoolRecord(0)
+        {}
+
+        // Marks its write spool record done, gives its bytes back to the queue limits and closes its write, if it was counted.
+        virtual ~QueryObj();
+
+        void operator=(const QueryObj &otherObj)
+        { 
+            m_strQuery = otherObj.m_strQuery;
+            m_uiShardKey = otherObj.m_uiShardKey;
+            m_ePriority = otherObj.m_ePriority;
+        }
+
+        // Decides which worker runs this, objects with the same key (and priority) run in the order they were queued.
+        uint64 getShardKey() const { return m_uiShardKey; }
+
+        // Which lane of the worker it waits in. Reads with a caller waiting on them default to DB_PRIORITY_INTERACTIVE.
+        DbPriority getPriority() const { return m_ePriority; }
+    
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn);
+
+        // True if it only reads, and nothing queued after it depends on it having run. Those may run on a replica.
+        virtual bool isRead(Database& db) const { return false; }
+
+        // Bytes of SQL (or data) it holds, counted against Database::SetQueueLimits until it's destroyed.
+        virtual size_t getQueuedBytes() const { return m_strQuery.size(); }
+
+        // Used by AsyncEngine, which sends the statements itself without blocking.
+        //  Appends this object's SQL in the order it runs, returns false if it can only be run through RunQuery.
+        virtual bool GetStatements(std::vector<std::string>& vStatements)
+        {
+            if (m_strQuery.empty())
+                return false;
+
+            vStatements.push_back(m_strQuery);
+            return true;
+        }
+
+        // Called for each statement from GetStatements in order, result is null if it failed or returned no rows.
+        //  OnStatementsDone follows once they all ran.
+        virtual void OnStatementResult(const size_t index, std::shared_ptr<QueryResult> result) {}
+        virtual void OnStatementsDone(Database& db) {}
+
+        std::string m_strQuery;
+        uint64 m_uiShardKey;
+        DbPriority m_ePriority;
+
+        // Set by Database::PushQuery for reads outside the read-your-writes window, see Database::AddReplica.
+        bool m_bReplicaRead;
+
+        // When Database::PushQuery took it, see DatabaseMetrics.
+        int64 m_iQueuedUs;
+
+        // Set by QueueLimiter::Admit, with what it was counted as.
+        QueueLimiter* m_pLimiter;
+        uint64 m_uiQueuedBytes;
+
+        // Set by WriteSpool::Record.
+        WriteSpool* m_pSpool;
+        uint64 m_uiSpoolRecord;
+
+        // Set by Database::EnqueueQuery for writes, which hold the read-your-writes window open until they're destroyed.
+        std::shared_ptr<DbWriteWindow> m_pWriteWindow;
+};
+
+class CallbackQueryObj : public QueryObj
+{
+    friend class Database;
+    
+    public:        
+        CallbackQueryObj(const uint64 id, const std::string msgToSelf, const std::string query, const uint64 shardKey = 0) :
+                QueryObj("", shardKey),
+                m_uiId(id),
+                m_strMsgToSelf(msgToSelf)
+        {
+            m_uoQueries[0] = query;
+            m_ePriority = DB_PRIORITY_INTERACTIVE;
+        }
+
+        CallbackQueryObj(const uint64 id, const std::string msgToSelf, const std::unordered_map<uint8, std::string>& queries, const uint64 shardKey = 0) :
+                QueryObj("", shardKey),
+                m_uiId(id),
+                m_strMsgToSelf(msgToSelf),
+                m_uoQueries(queries)
+        {
+            m_ePriority = DB_PRIORITY_INTERACTIVE;
+        }
+
+        virtual ~CallbackQueryObj() {}
+        
+        class ResultQueryHolder
+        {
+            public:        
+                ResultQueryHolder(const std::string msgToSelf = "") :
+                    m_strMsgToSelf(msgToSelf)
+                {}
+
+                void setResult(const uint8 id, std::shared_ptr<QueryResult> value) { m_results[id] = value; }
+
+                std::shared_ptr<QueryResult> getResult(const uint8 id = 0) const
+                {
+                    auto itr = m_results.find(id);
+
+                    if (itr != m_results.end())
+                        return itr->second;
+
+                    return nullptr;
+                }
+
+                std::string getMsgToSelf() const { return m_strMsgToSelf; }
+
+            private:
+                const std::string m_strMsgToSelf;
+                std::unordered_map<uint8, std::shared_ptr<QueryResult>> m_results;
+        };
+
+        void operator=(const CallbackQueryObj &otherObj)
+        { 
+            m_uoQueries = otherObj.m_uoQueries;
+            m_strQuery = otherObj.m_strQuery;
+        }
+
+        uint64 getId() const { return m_uiId; }
+
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn) final;
+        virtual bool isRead(Database& db) const final;
+        virtual size_t getQueuedBytes() const final;
+
+        virtual bool GetStatements(std::vector<std::string>& vStatements) final;
+        virtual void OnStatementResult(const size_t index, std::shared_ptr<QueryResult> result) final;
+        virtual void OnStatementsDone(Database& db) final;
+
+        // Sends every query as one multi statement packet, returns the first query it didn't run.
+        //  That's the first one if they can't be batched, the results of the others are in result.
+        std::unordered_map<uint8, std::string>::const_iterator RunBatch(DatabaseConnection& conn, ResultQueryHolder& result) const;
+
+        const uint64 m_uiId;
+        const std::string m_strMsgToSelf;
+
+        std::unordered_map<uint8, std::string> m_uoQueries;
+
+        // While AsyncEngine runs us, which key each statement belongs to and the results so far.
+        std::vector<uint8> m_vStatementKeys;
+        std::shared_ptr<ResultQueryHolder> m_pPendingResult;
+};
+
+// A callback query's id and results, in the order they finished. See Database::GrabCallbackResults.
+typedef std::pair<uint64, std::shared_ptr<CallbackQueryObj::ResultQueryHolder>> DbCallbackResult;
+
+// Executes a registered prepared statement.
+class PreparedQueryObj : public QueryObj
+{
+    friend class Database;
+    friend class TransactionQueryObj;
+
+    public:
+        PreparedQueryObj(const PreparedStatement& stmt, const uint64 shardKey = 0) :
+            QueryObj("", shardKey),
+            m_stmt(stmt)
+        {}
+
+        virtual ~PreparedQueryObj() {}
+
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn) final;
+        virtual size_t getQueuedBytes() const final { return m_stmt.getDataSize(); }
+
+        PreparedStatement m_stmt;
+};
+
+// Several queued single row INSERTs into the same table and columns, sent as one multi row INSERT.
+// Only built from plain QueryObjs with the same shard key and priority that were next to each other in a worker's queue,
+// so nothing is reordered.
+class CoalescedInsertObj : public QueryObj
+{
+    friend class Database;
+
+    public:
+        CoalescedInsertObj(std::shared_ptr<QueryObj> pFirst, const size_t prefixLength, const size_t valuesStart, const size_t valuesEnd);
+
+        virtual ~CoalescedInsertObj() {}
+
+        // Replaces runs of compatible inserts in queries with CoalescedInsertObjs no longer than maxBytes.
+        static void Coalesce(std::vector<std::shared_ptr<QueryObj>>& queries, const size_t maxBytes);
+
+        // True for "INSERT|REPLACE ... VALUES (...)" with exactly one row and nothing after it.
+        //  The prefix up to prefixLength is everything before the row list, the row is [valuesStart, valuesEnd).
+        static bool ParseInsert(const std::string& strQuery, size_t& prefixLength, size_t& valuesStart, size_t& valuesEnd);
+
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn) final;
+
+        // Needs RunQuery, to fall back on the originals when the combined insert fails.
+        virtual bool GetStatements(std::vector<std::string>& vStatements) final { return false; }
+
+        bool TryAdd(std::shared_ptr<QueryObj> pObj, const size_t prefixLength, const size_t valuesStart, const size_t valuesEnd, const size_t maxBytes);
+
+        size_t m_uiPrefixLength;
+
+        // Kept to run one by one if the combined insert fails without writing anything, so one bad row doesn't lose the others.
+        std::vector<std::shared_ptr<QueryObj>> m_vOriginals;
+};
+
+// Runs what was queued between BeginManyQueries and CommitManyQueries as one transaction.
+// Plain queries are sent several per packet, prepared statements one at a time.
+// Retried from the start if the server picks it as a deadlock victim, otherwise rolled back on the first failure.
+class TransactionQueryObj : public QueryObj
+{
+    friend class Database;
+    friend class WriteSpool;
+
+    public:
+        // onComplete (may be empty) is called on the worker thread with true once committed, false if rolled back.
+        TransactionQueryObj(std::vector<std::shared_ptr<QueryObj>>& vQueries, std::function<void(bool)> onComplete, const uint64 shardKey = 0) :
+            QueryObj("", shardKey),
+            m_fnOnComplete(onComplete)
+        {
+            m_vQueries.swap(vQueries);
+        }
+
+        virtual ~TransactionQueryObj() {}
+
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn) final;
+        virtual size_t getQueuedBytes() const final;
+
+        // Returns true if committed. bCommitSent is set once COMMIT went out, after that a lost connection may have committed it.
+        //  The connection shouldn't reconnect meanwhile, what ran after a reconnect would be outside the transaction.
+        bool TryCommit(Database& db, DatabaseConnection& conn, bool& bCommitSent);
+
+        std::vector<std::shared_ptr<QueryObj>> m_vQueries;
+        std::function<void(bool)> m_fnOnComplete;
+};
+
+// One chunk of a BulkLoader, sent as a LOAD DATA LOCAL INFILE reading from memory. Bulk priority unless queued in a DbPriorityScope.
+class BulkLoadObj : public QueryObj
+{
+    public:
+        // strData is swapped out, the caller's string is left empty.
+        BulkLoadObj(std::shared_ptr<BulkLoadState> pState, std::string& strData, const uint64 shardKey = 0) :
+            QueryObj("", shardKey),
+            m_pState(pState)
+        {
+            m_strData.swap(strData);
+            m_ePriority = DB_PRIORITY_BULK;
+        }
+
+        virtual ~BulkLoadObj() {}
+
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn) final;
+        virtual size_t getQueuedBytes() const final { return m_strData.size(); }
+
+        // LOAD DATA needs the blocking API.
+        virtual bool GetStatements(std::vector<std::string>& vStatements) final { return false; }
+
+        std::shared_ptr<BulkLoadState> m_pState;
+        std::string m_strData;
+};
+
+// One flush of a WriteBehind: its batched statements, sent several per packet. A failed one is skipped, the rest still run.
+class WriteBehindObj : public QueryObj
+{
+    public:
+        // vStatements is swapped out. onFlushed (may be empty) is called on the worker thread once they all ran.
+        WriteBehindObj(std::vector<std::string>& vStatements, std::function<void()> onFlushed) :
+            m_fnOnFlushed(onFlushed)
+        {
+            m_vStatements.swap(vStatements);
+        }
+
+        virtual ~WriteBehindObj() {}
+
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn) final;
+        virtual size_t getQueuedBytes() const final;
+
+        virtual bool GetStatements(std::vector<std::string>& vStatements) final;
+        virtual void OnStatementsDone(Database& db) final { if (m_fnOnFlushed) m_fnOnFlushed(); }
+
+        std::vector<std::string> m_vStatements;
+        std::function<void()> m_fnOnFlushed;
+};
+
+// A read whose result is handed to a function instead of being stored under an id.
+class AsyncQueryObj : public QueryObj
+{
+    friend class Database;
+
+    public:
+        typedef std::function<void(std::shared_ptr<QueryResult>)> ResultHandler;
+
+        // onResult is called on the worker thread, or through executor when there is one.
+        AsyncQueryObj(const std::string& str, ResultHandler onResult, DbExecutor executor, const uint64 shardKey = 0) :
+            QueryObj(str, shardKey),
+            m_fnOnResult(onResult),
+            m_fnExecutor(executor)
+        {
+            m_ePriority = DB_PRIORITY_INTERACTIVE;
+        }
+
+        AsyncQueryObj(const PreparedStatement& stmt, ResultHandler onResult, DbExecutor executor, const uint64 shardKey = 0) :
+            QueryObj("", shardKey),
+            m_pStmt(new PreparedStatement(stmt)),
+            m_fnOnResult(onResult),
+            m_fnExecutor(executor)
+        {
+            m_ePriority = DB_PRIORITY_INTERACTIVE;
+        }
+
+        virtual ~AsyncQueryObj() {}
+
+    protected:
+        virtual void RunQuery(Database& db, DatabaseConnection& conn) final;
+        virtual bool isRead(Database& db) const final;
+        virtual size_t getQueuedBytes() const final { return m_pStmt ? m_pStmt->getDataSize() : m_strQuery.size(); }
+
+        virtual bool GetStatements(std::vector<std::string>& vStatements) final;
+        virtual void OnStatementResult(const size_t index, std::shared_ptr<QueryResult> result) final { m_pResult = result; }
+        virtual void OnStatementsDone(Database& db) final { Deliver(m_pResult); }
+
+        void Deliver(std::shared_ptr<QueryResult> result);
+
+        std::shared_ptr<QueryResult> m_pResult;
+
+        // Set instead of m_strQuery for a prepared statement.
+        std::unique_ptr<PreparedStatement> m_pStmt;
+
+        ResultHandler m_fnOnResult;
+        DbExecutor m_fnExecutor;
+};
+
 #endif
\ No newline at end of file
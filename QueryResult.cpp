@@ -1,56 +1,145 @@
-#include "Database.h"
-#include "QueryResult.h"
-
-QueryResult::QueryResult(MYSQL_RES* result, MYSQL_FIELD* fields, uint64 rowCount, uint32 fieldCount) : 
-    m_pResult(result), 
-    m_uiFieldCount(fieldCount), 
-    m_uiRowCount(rowCount)
-{
-    m_pCurrentRow = new DbField[m_uiFieldCount];
-
-    ASSERT(m_pCurrentRow);
-    NextRow();
-}
-
-QueryResult::~QueryResult()
-{
-    EndQuery();
-}
-
-bool QueryResult::NextRow()
-{
-    MYSQL_ROW row;
-
-    if (!m_pResult)
-        return false;
-
-    row = mysql_fetch_row(m_pResult);
-
-    if (!row)
-    {
-        EndQuery();
-        return false;
-    }
-
-    for (uint32 i = 0; i < m_uiFieldCount; i++)
-        m_pCurrentRow[i].SetValue(row[i]);
-
-    return true;
-}
-
-void QueryResult::EndQuery()
-{
-    if (m_pCurrentRow)
-    {
-        delete [] m_pCurrentRow;
-        m_pCurrentRow = 0;
-    }
-
-    if (m_pResult)
-    {
-        mysql_free_result(m_pResult);
-        m_pResult = 0;
-    }
-}
-
-
+#include "Database.h"
+#include "QueryResult.h"
+
+#include <cctype>
+
+QueryResult::QueryResult(MYSQL_RES* result, MYSQL_FIELD* fields, uint64 rowCount, uint32 fieldCount, DatabaseMetrics* metrics) : 
+    m_uiFieldCount(fieldCount), 
+    m_uiRowCount(rowCount),
+    m_pResult(result), 
+    m_pFields(fields),
+    m_pMetrics(metrics),
+    m_uiBytesRead(0),
+    m_uiStorageRow(0)
+{
+    m_pCurrentRow = new DbField[m_uiFieldCount];
+
+    ASSERT(m_pCurrentRow);
+    NextRow();
+}
+
+QueryResult::QueryResult(std::shared_ptr<const QueryResultStorage> storage, uint32 fieldCount) : 
+    m_uiFieldCount(fieldCount), 
+    m_uiRowCount(storage->vCells.size() / fieldCount),
+    m_pResult(nullptr), 
+    m_pFields(nullptr),
+    m_pMetrics(nullptr),
+    m_uiBytesRead(0),
+    m_pStorage(storage), 
+    m_uiStorageRow(0)
+{
+    m_pCurrentRow = new DbField[m_uiFieldCount];
+
+    ASSERT(m_pCurrentRow);
+    NextRow();
+}
+
+QueryResult::~QueryResult()
+{
+    EndQuery();
+}
+
+bool QueryResult::NextRow()
+{
+    MYSQL_ROW row;
+
+    if (m_pStorage)
+    {
+        if (m_uiStorageRow >= m_uiRowCount)
+        {
+            EndQuery();
+            return false;
+        }
+
+        const size_t uiFirstCell = size_t(m_uiStorageRow++) * m_uiFieldCount;
+
+        for (uint32 i = 0; i < m_uiFieldCount; i++)
+            m_pStorage->viewCell(uiFirstCell + i, m_pCurrentRow[i]);
+
+        return true;
+    }
+
+    if (!m_pResult)
+        return false;
+
+    row = mysql_fetch_row(m_pResult);
+
+    if (!row)
+    {
+        EndQuery();
+        return false;
+    }
+
+    // mysql_store_result keeps every row (null terminated) until mysql_free_result, no need to copy.
+    unsigned long* pLengths = mysql_fetch_lengths(m_pResult);
+
+    for (uint32 i = 0; i < m_uiFieldCount; i++)
+    {
+        m_pCurrentRow[i].SetView(row[i], pLengths[i]);
+        m_uiBytesRead += pLengths[i];
+    }
+
+    return true;
+}
+
+void QueryResult::EndQuery()
+{
+    if (m_pCurrentRow)
+    {
+        delete [] m_pCurrentRow;
+        m_pCurrentRow = 0;
+    }
+
+    if (m_pResult)
+    {
+        mysql_free_result(m_pResult);
+        m_pResult = 0;
+        m_pFields = 0;
+    }
+
+    if (m_pMetrics && m_uiBytesRead)
+    {
+        m_pMetrics->RecordBytes(m_uiBytesRead);
+        m_uiBytesRead = 0;
+    }
+
+    m_pStorage.reset();
+}
+
+int32 QueryResult::getColumnIndex(const char* name) const
+{
+    for (uint32 i = 0; i < m_uiFieldCount; ++i)
+    {
+        const char* column = getColumnName(i);
+
+        if (column && isColumnName(column, name))
+            return int32(i);
+    }
+
+    return -1;
+}
+
+const char* QueryResult::getColumnName(const uint32 index) const
+{
+    if (index >= m_uiFieldCount)
+        return nullptr;
+
+    if (m_pFields)
+        return m_pFields[index].name;
+
+    if (m_pStorage && index < m_pStorage->vColumns.size())
+        return m_pStorage->vColumns[index].c_str();
+
+    return nullptr;
+}
+
+bool QueryResult::isColumnName(const char* column, const char* name)
+{
+    for (; *column && *name; ++column, ++name)
+    {
+        if (tolower((unsigned char)*column) != tolower((unsigned char)*name))
+            return false;
+    }
+
+    return *column == *name;
+}
\ No newline at end of file
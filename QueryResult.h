@@ -1,35 +1,117 @@
-#ifndef _QUERYRESULT_H
-#define _QUERYRESULT_H
-
-#include "DbField.h"
-
-#include <mysql.h>
-
-class QueryResult
-{
-    public:
-        QueryResult(MYSQL_RES* result, MYSQL_FIELD* fields, uint64 rowCount, uint32 fieldCount);
-        ~QueryResult();
-
-        bool NextRow();
-
-        uint32 getFieldCount() const { return m_uiFieldCount; }
-        uint64 getRowCount() const { return m_uiRowCount; }
-
-        DbField* fetchCurrentRow() const { return m_pCurrentRow; }
-
-        const DbField & operator [] (int index) const { return m_pCurrentRow[index]; }
-        
-    private:
-        void EndQuery();
-        
-        uint32 m_uiFieldCount;
-        uint64 m_uiRowCount;
-
-        DbField* m_pCurrentRow;
-        MYSQL_RES* m_pResult;
-};
-
-#endif
-
-
+#ifndef _QUERYRESULT_H
+#define _QUERYRESULT_H
+
+#include "DbField.h"
+#include "DatabaseMetrics.h"
+
+#include <mysql.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Rows copied out of the connection up front, so the result doesn't keep the connection (or a statement) busy.
+struct QueryResultStorage
+{
+    static const size_t NULL_CELL = size_t(-1);
+
+    struct Cell
+    {
+        size_t uiOffset;
+        size_t uiLength;
+        DbFieldType eType;
+        DbBinaryValue binary;
+    };
+
+    void addCell(const char* value, const size_t length)
+    {
+        DbBinaryValue binary;
+        binary.uiValue = 0;
+        addBinaryCell(value, length, DB_FIELD_TEXT, binary);
+    }
+
+    // value is the text form of binary.
+    void addBinaryCell(const char* value, const size_t length, const DbFieldType type, const DbBinaryValue binary)
+    {
+        Cell cell = { vData.size(), length, type, binary };
+        vCells.push_back(cell);
+        vData.insert(vData.end(), value, value + length);
+        vData.push_back('\0');
+    }
+
+    void addNull()
+    {
+        Cell cell = { size_t(NULL_CELL), 0, DB_FIELD_TEXT, DbBinaryValue() };
+        vCells.push_back(cell);
+    }
+
+    void viewCell(const size_t index, DbField& field) const
+    {
+        const Cell& cell = vCells[index];
+
+        if (cell.uiOffset == NULL_CELL)
+            field.SetView(nullptr, 0);
+        else
+            field.SetBinaryView(&vData[cell.uiOffset], cell.uiLength, cell.eType, cell.binary);
+    }
+
+    // Every value, null terminated, back to back.
+    std::vector<char> vData;
+
+    // Where each cell is in vData, row after row.
+    std::vector<Cell> vCells;
+
+    // Names of the columns, empty if they weren't kept.
+    std::vector<std::string> vColumns;
+};
+
+class QueryResult
+{
+    public:
+        // The bytes read out of result are added to metrics (if given) once it's done.
+        QueryResult(MYSQL_RES* result, MYSQL_FIELD* fields, uint64 rowCount, uint32 fieldCount, DatabaseMetrics* metrics = nullptr);
+        QueryResult(std::shared_ptr<const QueryResultStorage> storage, uint32 fieldCount);
+        ~QueryResult();
+
+        bool NextRow();
+
+        uint32 getFieldCount() const { return m_uiFieldCount; }
+        uint64 getRowCount() const { return m_uiRowCount; }
+
+        // The fields point into the result's own row buffers, they stay valid until the result is done.
+        DbField* fetchCurrentRow() const { return m_pCurrentRow; }
+
+        const DbField & operator [] (int index) const { return m_pCurrentRow[index]; }
+
+        // Position of the column called name (not case sensitive), -1 if there's none. Look it up once, not per row.
+        //  Column names are gone once every row has been read, like the rows.
+        int32 getColumnIndex(const char* name) const;
+
+        // Null if index is out of range or the names weren't kept.
+        const char* getColumnName(const uint32 index) const;
+
+        // MySQL column names aren't case sensitive.
+        static bool isColumnName(const char* column, const char* name);
+
+        // The copied out rows when the result has them (prepared statements), null when it reads from m_pResult.
+        //  Null too once every row has been read.
+        std::shared_ptr<const QueryResultStorage> getStorage() const { return m_pStorage; }
+        
+    private:
+        void EndQuery();
+        
+        uint32 m_uiFieldCount;
+        uint64 m_uiRowCount;
+
+        DbField* m_pCurrentRow;
+        MYSQL_RES* m_pResult;
+        MYSQL_FIELD* m_pFields;
+
+        DatabaseMetrics* m_pMetrics;
+        uint64 m_uiBytesRead;
+
+        // Used instead of m_pResult when the rows were already copied out.
+        std::shared_ptr<const QueryResultStorage> m_pStorage;
+        uint64 m_uiStorageRow;
+};
+
+#endif
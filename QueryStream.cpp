@@ -0,0 +1,102 @@
+#include "Database.h"
+#include "QueryStream.h"
+
+QueryStream::QueryStream(std::unique_lock<std::mutex>&& lock, MYSQL* mysql, MYSQL_RES* result, uint32 fieldCount, DatabaseMetrics* metrics) : 
+    m_uiFieldCount(fieldCount), 
+    m_uiRowCount(0),
+    m_bError(false),
+    m_uiError(0),
+    m_pMYSQL(mysql),
+    m_pResult(result),
+    m_pMetrics(metrics),
+    m_uiBytesRead(0),
+    m_lock(std::move(lock))
+{
+    m_pCurrentRow = new DbField[m_uiFieldCount];
+
+    ASSERT(m_pCurrentRow);
+    NextRow();
+}
+
+QueryStream::~QueryStream()
+{
+    EndQuery();
+}
+
+bool QueryStream::NextRow()
+{
+    if (!m_pResult)
+        return false;
+
+    MYSQL_ROW row = mysql_fetch_row(m_pResult);
+
+    if (!row)
+    {
+        if ((m_uiError = mysql_errno(m_pMYSQL)))
+        {
+            printf("SQL Error: '%s'.", mysql_error(m_pMYSQL));
+            m_bError = true;
+        }
+
+        EndQuery();
+        return false;
+    }
+
+    unsigned long* pLengths = mysql_fetch_lengths(m_pResult);
+
+    for (uint32 i = 0; i < m_uiFieldCount; i++)
+    {
+        m_pCurrentRow[i].SetView(row[i], pLengths[i]);
+        m_uiBytesRead += pLengths[i];
+    }
+
+    ++m_uiRowCount;
+    return true;
+}
+
+void QueryStream::EndQuery()
+{
+    if (m_pCurrentRow)
+    {
+        delete [] m_pCurrentRow;
+        m_pCurrentRow = 0;
+    }
+
+    // Reads whatever the server still has for us, the connection can't be used before that.
+    if (m_pResult)
+    {
+        mysql_free_result(m_pResult);
+        m_pResult = 0;
+    }
+
+    if (m_pMetrics)
+    {
+        m_pMetrics->RecordRows(m_uiRowCount);
+        m_pMetrics->RecordBytes(m_uiBytesRead);
+        m_pMetrics = nullptr;
+    }
+
+    if (m_lock.owns_lock())
+        m_lock.unlock();
+}
+
+int32 QueryStream::getColumnIndex(const char* name) const
+{
+    for (uint32 i = 0; i < m_uiFieldCount; ++i)
+    {
+        const char* column = getColumnName(i);
+
+        if (column && QueryResult::isColumnName(column, name))
+            return int32(i);
+    }
+
+    return -1;
+}
+
+const char* QueryStream::getColumnName(const uint32 index) const
+{
+    if (!m_pResult || index >= m_uiFieldCount)
+        return nullptr;
+
+    return mysql_fetch_fields(m_pResult)[index].name;
+}
\ No newline at end of file
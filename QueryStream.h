@@ -0,0 +1,65 @@
+#ifndef _QUERYSTREAM_H
+#define _QUERYSTREAM_H
+
+#include "DbField.h"
+#include "DatabaseMetrics.h"
+
+#include <mysql.h>
+#include <mutex>
+
+// Unbuffered result from mysql_use_result, rows are read from the socket one at a time as NextRow is called.
+// Holds its connection locked until every row was read or the stream is destroyed, so finish with it quickly.
+// Abandoning a stream part way through still has to read (and discard) what's left of the result.
+// Belongs to the thread that called Database::StreamQuery: the connection stays locked by that thread, so reading, draining
+// and destroying the stream all have to happen there.
+class QueryStream
+{
+    public:
+        // The rows and bytes read are added to metrics (if given) once the stream ends.
+        QueryStream(std::unique_lock<std::mutex>&& lock, MYSQL* mysql, MYSQL_RES* result, uint32 fieldCount, DatabaseMetrics* metrics = nullptr);
+        ~QueryStream();
+
+        bool NextRow();
+
+        uint32 getFieldCount() const { return m_uiFieldCount; }
+
+        // How many rows were read so far.
+        uint64 getRowCount() const { return m_uiRowCount; }
+
+        // True if the server or the connection failed before the last row.
+        bool hadError() const { return m_bError; }
+
+        // The error number when hadError, 0 otherwise.
+        uint32 getError() const { return m_uiError; }
+
+        // Unlike QueryResult, the fields are only valid until the next call to NextRow.
+        DbField* fetchCurrentRow() const { return m_pCurrentRow; }
+
+        const DbField & operator [] (int index) const { return m_pCurrentRow[index]; }
+
+        // Same as QueryResult's, the names are gone once the stream ended.
+        int32 getColumnIndex(const char* name) const;
+        const char* getColumnName(const uint32 index) const;
+
+    private:
+        QueryStream(const QueryStream&);
+        void operator=(const QueryStream&);
+
+        void EndQuery();
+
+        uint32 m_uiFieldCount;
+        uint64 m_uiRowCount;
+        bool m_bError;
+        uint32 m_uiError;
+
+        DbField* m_pCurrentRow;
+        MYSQL* m_pMYSQL;
+        MYSQL_RES* m_pResult;
+
+        DatabaseMetrics* m_pMetrics;
+        uint64 m_uiBytesRead;
+
+        std::unique_lock<std::mutex> m_lock;
+};
+
+#endif
\ No newline at end of file
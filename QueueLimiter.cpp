@@ -0,0 +1,299 @@
+#include "Database.h"
+#include "QueueLimiter.h"
+
+#include <typeinfo>
+
+// Written before each spilled query's SQL.
+struct SpillRecord
+{
+    uint64 uiShardKey;
+    int64 iQueuedUs;
+    uint32 uiPriority;
+    uint32 uiLength;
+
+    // Its record in the write spool, 0 if it has none.
+    uint64 uiSpoolRecord;
+};
+
+QueueLimiter::QueueLimiter(Database& db) :
+    m_db(db),
+    m_uiMaxItems(0),
+    m_uiMaxBytes(0),
+    m_ePolicy(DB_QUEUE_BLOCK),
+    m_uiBlockTimeoutMs(0),
+    m_uiItems(0),
+    m_uiBytes(0),
+    m_uiItemsHighWater(0),
+    m_uiBytesHighWater(0),
+    m_uiWaiting(0),
+    m_uiRejected(0),
+    m_pSpill(nullptr),
+    m_iSpillRead(0),
+    m_iSpillWrite(0),
+    m_uiSpillRecords(0),
+    m_uiSpilled(0),
+    m_uiSpillFeeding(0),
+    m_bStop(false)
+{
+
+}
+
+QueueLimiter::~QueueLimiter()
+{
+    Stop();
+
+    if (!m_pSpill)
+        return;
+
+    // Everything in it was queued by Stop.
+    fclose(m_pSpill);
+
+    if (!m_strSpillPath.empty())
+        remove(m_strSpillPath.c_str());
+}
+
+bool QueueLimiter::SetLimits(const uint32 maxItems, const uint64 maxBytes, const DbQueuePolicy policy, const uint32 blockTimeoutMs, const char* spillPath)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (policy == DB_QUEUE_SPILL && !m_pSpill)
+        {
+            m_pSpill = spillPath ? fopen(spillPath, "w+b") : tmpfile();
+
+            if (!m_pSpill)
+            {
+                printf("QueueLimiter::SetLimits - Could not open the spill file '%s'.", spillPath ? spillPath : "(temporary)");
+                return false;
+            }
+
+            if (spillPath)
+                m_strSpillPath = spillPath;
+        }
+
+        m_uiMaxItems = maxItems;
+        m_uiMaxBytes = maxBytes;
+        m_ePolicy = policy;
+        m_uiBlockTimeoutMs = blockTimeoutMs;
+    }
+
+    // Looser limits may have made room.
+    m_condition.notify_all();
+    return true;
+}
+
+bool QueueLimiter::Admit(std::shared_ptr<QueryObj>& pObj)
+{
+    QueryObj& obj = *pObj;
+    const uint64 uiBytes = obj.getQueuedBytes();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Plain SQL goes behind anything already spilled, whatever the policy is now, so it keeps its order.
+    if (typeid(obj) == typeid(QueryObj) && (m_uiSpillRecords || m_uiSpillFeeding || (m_ePolicy == DB_QUEUE_SPILL && !hasRoom(uiBytes))))
+    {
+        if (Spill(obj))
+        {
+            ++m_uiSpillRecords;
+            ++m_uiSpilled;
+
+            if (!m_thread.joinable())
+            {
+                m_bStop = false;
+                m_thread = std::thread(&QueueLimiter::SpillThread, this);
+            }
+
+            m_condition.notify_all();
+
+            // The record stays undone until the copy read back from the file is.
+            obj.m_pSpool = nullptr;
+            pObj.reset();
+            return true;
+        }
+    }
+
+    // Anything that can't be spilled waits for the spill to be queued too, or it would get ahead of writes made before it.
+    auto canQueue = [this, uiBytes] { return !m_uiSpillRecords && !m_uiSpillFeeding && hasRoom(uiBytes); };
+
+    if (!canQueue())
+    {
+        if (m_ePolicy == DB_QUEUE_REJECT)
+        {
+            ++m_uiRejected;
+            return false;
+        }
+
+        // Workers go over the limit (and ahead of the spill) instead, only they make room.
+        if (!workerThread())
+        {
+            const int64 iStartUs = DatabaseMetrics::NowUs();
+
+            ++m_uiWaiting;
+            const bool bRoom = m_condition.wait_for(lock, std::chrono::milliseconds(m_uiBlockTimeoutMs), canQueue);
+            --m_uiWaiting;
+
+            m_blocked.Record(uint64(DatabaseMetrics::NowUs() - iStartUs));
+
+            if (!bRoom)
+            {
+                ++m_uiRejected;
+                return false;
+            }
+        }
+    }
+
+    Add(uiBytes);
+    obj.m_pLimiter = this;
+    obj.m_uiQueuedBytes = uiBytes;
+    return true;
+}
+
+void QueueLimiter::Release(const uint64 bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    ASSERT(m_uiItems && m_uiBytes >= bytes);
+    --m_uiItems;
+    m_uiBytes -= bytes;
+
+    if (m_uiWaiting || m_uiSpillRecords)
+        m_condition.notify_all();
+}
+
+void QueueLimiter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+
+    m_condition.notify_all();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void QueueLimiter::Snapshot(DatabaseMetricsSnapshot& result)
+{
+    m_blocked.Snapshot(result.queueBlocked);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    result.uiQueuedItems = m_uiItems;
+    result.uiQueuedBytes = m_uiBytes;
+    result.uiQueuedItemsHighWater = m_uiItemsHighWater;
+    result.uiQueuedBytesHighWater = m_uiBytesHighWater;
+    result.uiQueueRejected = m_uiRejected;
+    result.uiSpilled = m_uiSpilled;
+    result.uiSpillPending = m_uiSpillRecords;
+    result.uiSpillBytes = uint64(m_iSpillWrite - m_iSpillRead);
+}
+
+bool QueueLimiter::hasRoom(const uint64 bytes) const
+{
+    // Something bigger than maxBytes on its own still gets in once nothing else is queued.
+    return (!m_uiMaxItems || m_uiItems < m_uiMaxItems) && (!m_uiMaxBytes || !m_uiItems || m_uiBytes + bytes <= m_uiMaxBytes);
+}
+
+void QueueLimiter::Add(const uint64 bytes)
+{
+    ++m_uiItems;
+    m_uiBytes += bytes;
+
+    m_uiItemsHighWater = std::max(m_uiItemsHighWater, m_uiItems);
+    m_uiBytesHighWater = std::max(m_uiBytesHighWater, m_uiBytes);
+}
+
+bool QueueLimiter::Spill(const QueryObj& obj)
+{
+    ASSERT(m_pSpill);
+
+    SpillRecord record;
+    record.uiShardKey = obj.m_uiShardKey;
+    record.iQueuedUs = obj.m_iQueuedUs;
+    record.uiPriority = uint32(obj.m_ePriority);
+    record.uiLength = uint32(obj.m_strQuery.size());
+    record.uiSpoolRecord = obj.m_pSpool ? obj.m_uiSpoolRecord : 0;
+
+    if (fseek(m_pSpill, long(m_iSpillWrite), SEEK_SET) || fwrite(&record, sizeof(record), 1, m_pSpill) != 1 ||
+        fwrite(obj.m_strQuery.data(), 1, record.uiLength, m_pSpill) != record.uiLength)
+    {
+        printf("QueueLimiter::Spill - Could not write to the spill file, the query stays in memory.");
+        return false;
+    }
+
+    m_iSpillWrite += int64(sizeof(record) + record.uiLength);
+    return true;
+}
+
+void QueueLimiter::SpillThread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::string strQuery;
+
+    while (true)
+    {
+        if (!m_uiSpillRecords)
+        {
+            // All of it is queued, the file starts over.
+            m_iSpillRead = 0;
+            m_iSpillWrite = 0;
+
+            // Whoever waited behind the spill can go now.
+            if (m_uiWaiting)
+                m_condition.notify_all();
+
+            if (m_bStop)
+                break;
+
+            m_condition.wait(lock, [this] { return m_uiSpillRecords || m_bStop; });
+            continue;
+        }
+
+        SpillRecord record;
+
+        if (fseek(m_pSpill, long(m_iSpillRead), SEEK_SET) || fread(&record, sizeof(record), 1, m_pSpill) != 1)
+        {
+            printf("QueueLimiter::SpillThread - Could not read the spill file, %llu queries are lost.", (unsigned long long)m_uiSpillRecords);
+            m_uiSpillRecords = 0;
+            continue;
+        }
+
+        // Waits its turn like any caller would, even when stopping: the workers are still running.
+        m_condition.wait(lock, [this, &record] { return hasRoom(record.uiLength); });
+
+        // Others may have written meanwhile, the file position is theirs.
+        strQuery.resize(record.uiLength);
+
+        if (fseek(m_pSpill, long(m_iSpillRead + int64(sizeof(record))), SEEK_SET) || fread(&strQuery[0], 1, record.uiLength, m_pSpill) != record.uiLength)
+        {
+            printf("QueueLimiter::SpillThread - Could not read the spill file, %llu queries are lost.", (unsigned long long)m_uiSpillRecords);
+            m_uiSpillRecords = 0;
+            continue;
+        }
+
+        m_iSpillRead += int64(sizeof(record) + record.uiLength);
+        --m_uiSpillRecords;
+        ++m_uiSpillFeeding;
+        Add(record.uiLength);
+
+        lock.unlock();
+
+        std::shared_ptr<QueryObj> pObj = std::make_shared<QueryObj>(strQuery, record.uiShardKey);
+        pObj->m_ePriority = DbPriority(record.uiPriority);
+        pObj->m_iQueuedUs = record.iQueuedUs;
+        pObj->m_pLimiter = this;
+        pObj->m_uiQueuedBytes = record.uiLength;
+
+        if (record.uiSpoolRecord)
+        {
+            pObj->m_pSpool = m_db.m_pSpool.get();
+            pObj->m_uiSpoolRecord = record.uiSpoolRecord;
+        }
+
+        m_db.EnqueueQuery(std::move(pObj));
+
+        lock.lock();
+        --m_uiSpillFeeding;
+    }
+}
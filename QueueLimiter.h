@@ -0,0 +1,110 @@
+#ifndef QUEUELIMITER_H
+#define QUEUELIMITER_H
+
+#include "DatabaseMetrics.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class Database;
+class QueryObj;
+
+// What a queue call does while the queue is over the limits given to Database::SetQueueLimits.
+enum DbQueuePolicy
+{
+    // Waits for room, up to the timeout, then it's turned away.
+    DB_QUEUE_BLOCK,
+
+    // Turned away right away.
+    DB_QUEUE_REJECT,
+
+    // Plain SQL (QueueExecuteQuery, queueExecuteArgs and the like) is written to a file instead, and queued from there in order
+    //  once there's room. Anything else waits like DB_QUEUE_BLOCK, and while anything is spilled, until all of it was queued.
+    DB_QUEUE_SPILL
+};
+
+// Counts every queued object, from being queued until it's done and freed, against a cap on objects and bytes of SQL (or data).
+// Off (counting only) until limits are set.
+class QueueLimiter
+{
+    public:
+        QueueLimiter(Database& db);
+        ~QueueLimiter();
+
+        // 0 for no limit. spillPath is used by DB_QUEUE_SPILL the first time it needs a file, a temporary file if null.
+        //  Returns false if the file can't be opened.
+        bool SetLimits(const uint32 maxItems, const uint64 maxBytes, const DbQueuePolicy policy, const uint32 blockTimeoutMs, const char* spillPath);
+
+        // Counts pObj, or writes it to the spill file and resets pObj. Returns false if it was turned away.
+        bool Admit(std::shared_ptr<QueryObj>& pObj);
+
+        // Called as an admitted object is destroyed.
+        void Release(const uint64 bytes);
+
+        // Queues everything spilled, waiting for room as usual, then stops the spill thread until something is spilled again.
+        void Stop();
+
+        // Fills the queue limit part of result.
+        void Snapshot(DatabaseMetricsSnapshot& result);
+
+        // Called by the threads that run queued objects. What they queue is never waited on, they would be waiting on themselves.
+        static void MarkWorkerThread() { workerThread() = true; }
+
+    private:
+        static bool& workerThread()
+        {
+            static thread_local bool s_bWorker = false;
+            return s_bWorker;
+        }
+
+        // m_mutex expected to be locked for all of these.
+        bool hasRoom(const uint64 bytes) const;
+        void Add(const uint64 bytes);
+
+        // Appends a record for the plain SQL obj, returns false if it couldn't be written.
+        bool Spill(const QueryObj& obj);
+
+        void SpillThread();
+
+        Database& m_db;
+
+        std::mutex m_mutex;
+
+        // Signalled when room is made, or something is spilled.
+        std::condition_variable m_condition;
+
+        uint32 m_uiMaxItems;
+        uint64 m_uiMaxBytes;
+        DbQueuePolicy m_ePolicy;
+        uint32 m_uiBlockTimeoutMs;
+
+        uint64 m_uiItems;
+        uint64 m_uiBytes;
+        uint64 m_uiItemsHighWater;
+        uint64 m_uiBytesHighWater;
+
+        // Callers waiting for room, how long they waited, and the ones turned away.
+        uint32 m_uiWaiting;
+        DbHistogram m_blocked;
+        uint64 m_uiRejected;
+
+        // Records between m_iSpillRead and m_iSpillWrite are waiting to be queued, in order.
+        FILE* m_pSpill;
+        std::string m_strSpillPath;
+        int64 m_iSpillRead;
+        int64 m_iSpillWrite;
+        uint64 m_uiSpillRecords;
+        uint64 m_uiSpilled;
+
+        // Read back by the spill thread but not queued yet, newer SQL stays behind it too.
+        uint32 m_uiSpillFeeding;
+
+        std::thread m_thread;
+        bool m_bStop;
+};
+
+#endif
@@ -0,0 +1,461 @@
+#include "Database.h"
+#include "ReplayBackend.h"
+#include "QueryFormatter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+namespace
+{
+    // "DBREPLAY" followed by the format version.
+    const char s_szMagic[8] = { 'D', 'B', 'R', 'E', 'P', 'L', 'A', 'Y' };
+    const uint32 s_uiVersion = 2;
+
+    template <class T>
+    void WriteValue(std::ofstream& file, const T& value)
+    {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <class T>
+    bool ReadValue(std::ifstream& file, T& value)
+    {
+        return bool(file.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    void WriteString(std::ofstream& file, const char* str, const uint64 length)
+    {
+        WriteValue(file, length);
+        file.write(str, std::streamsize(length));
+    }
+
+    bool ReadString(std::ifstream& file, std::string& str)
+    {
+        uint64 length;
+
+        if (!ReadValue(file, length))
+            return false;
+
+        str.resize(size_t(length));
+        return length == 0 || bool(file.read(&str[0], std::streamsize(length)));
+    }
+}
+
+ReplayData::ReplayData() :
+    m_uiBaseUs(0),
+    m_uiPerRowUs(0),
+    m_uiAnswered(0),
+    m_uiUnmatched(0)
+{
+
+}
+
+void ReplayData::SetLatency(const uint32 baseUs, const uint32 perRowUs)
+{
+    m_uiBaseUs = baseUs;
+    m_uiPerRowUs = perRowUs;
+}
+
+void ReplayData::AddResult(const std::string& strQuery, std::shared_ptr<const QueryResultStorage> storage, const uint32 fieldCount)
+{
+    Entry entry;
+    entry.pStorage = fieldCount ? storage : nullptr;
+    entry.uiFieldCount = fieldCount;
+    entry.uiErrno = 0;
+    AddEntry(strQuery, entry);
+}
+
+void ReplayData::AddError(const std::string& strQuery, const uint32 errorNumber, const std::string& strError)
+{
+    Entry entry;
+    entry.uiFieldCount = 0;
+    entry.uiErrno = errorNumber;
+    entry.strError = strError;
+    AddEntry(strQuery, entry);
+}
+
+void ReplayData::AddEntry(const std::string& strQuery, const Entry& entry)
+{
+    auto itr = m_uoExact.find(strQuery);
+
+    if (itr == m_uoExact.end())
+    {
+        itr = m_uoExact.emplace(strQuery, entry).first;
+        m_vQueries.push_back(strQuery);
+    }
+    else
+    {
+        itr->second = entry;
+    }
+
+    m_uoFingerprints[DatabaseMetrics::Fingerprint(strQuery.data(), strQuery.size())] = &itr->second;
+}
+
+bool ReplayData::Capture(Database& db, const std::string& strQuery)
+{
+    std::shared_ptr<QueryResult> result = db.Query("%s", strQuery.c_str());
+
+    // No way to tell a failed query from one without rows here, both are recorded as no rows.
+    if (!result)
+    {
+        AddResult(strQuery, nullptr, 0);
+        return true;
+    }
+
+    const uint32 uiFieldCount = result->getFieldCount();
+    std::shared_ptr<QueryResultStorage> pStorage = std::make_shared<QueryResultStorage>();
+    pStorage->vCells.reserve(size_t(result->getRowCount()) * uiFieldCount);
+
+    for (uint32 i = 0; i < uiFieldCount; ++i)
+        pStorage->vColumns.push_back(result->getColumnName(i) ? result->getColumnName(i) : "");
+
+    do
+    {
+        DbField* pFields = result->fetchCurrentRow();
+
+        for (uint32 i = 0; i < uiFieldCount; ++i)
+        {
+            if (pFields[i].isNull())
+                pStorage->addNull();
+            else
+                pStorage->addCell(pFields[i].getString(), pFields[i].getLength());
+        }
+    }
+    while (result->NextRow());
+
+    AddResult(strQuery, pStorage, uiFieldCount);
+    return true;
+}
+
+bool ReplayData::Save(const char* path) const
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+    if (!file)
+    {
+        printf("ReplayData::Save - Could not open %s.", path);
+        return false;
+    }
+
+    file.write(s_szMagic, sizeof(s_szMagic));
+    WriteValue(file, s_uiVersion);
+    WriteValue(file, m_uiBaseUs);
+    WriteValue(file, m_uiPerRowUs);
+    WriteValue(file, uint64(m_vQueries.size()));
+
+    for (const std::string& strQuery : m_vQueries)
+    {
+        const Entry& entry = m_uoExact.find(strQuery)->second;
+
+        WriteString(file, strQuery.data(), strQuery.size());
+        WriteValue(file, entry.uiErrno);
+        WriteString(file, entry.strError.data(), entry.strError.size());
+        WriteValue(file, entry.uiFieldCount);
+        WriteValue(file, uint64(entry.pStorage ? entry.pStorage->vCells.size() : 0));
+
+        if (!entry.pStorage)
+            continue;
+
+        WriteValue(file, uint64(entry.pStorage->vColumns.size()));
+
+        for (const std::string& strColumn : entry.pStorage->vColumns)
+            WriteString(file, strColumn.data(), strColumn.size());
+
+        for (const QueryResultStorage::Cell& cell : entry.pStorage->vCells)
+        {
+            const uint8 uiNull = cell.uiOffset == QueryResultStorage::NULL_CELL;
+            WriteValue(file, uiNull);
+
+            if (uiNull)
+                continue;
+
+            WriteValue(file, uint8(cell.eType));
+            WriteValue(file, cell.binary);
+            WriteString(file, &entry.pStorage->vData[cell.uiOffset], cell.uiLength);
+        }
+    }
+
+    return bool(file);
+}
+
+bool ReplayData::Load(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file)
+    {
+        printf("ReplayData::Load - Could not open %s.", path);
+        return false;
+    }
+
+    char szMagic[sizeof(s_szMagic)];
+    uint32 uiVersion = 0;
+    uint64 uiEntries = 0;
+
+    if (!file.read(szMagic, sizeof(szMagic)) || memcmp(szMagic, s_szMagic, sizeof(szMagic)) || !ReadValue(file, uiVersion) || uiVersion != s_uiVersion)
+    {
+        printf("ReplayData::Load - %s isn't a replay file.", path);
+        return false;
+    }
+
+    if (!ReadValue(file, m_uiBaseUs) || !ReadValue(file, m_uiPerRowUs) || !ReadValue(file, uiEntries))
+    {
+        printf("ReplayData::Load - %s is truncated.", path);
+        return false;
+    }
+
+    std::string strQuery;
+    std::string strValue;
+
+    for (uint64 i = 0; i < uiEntries; ++i)
+    {
+        Entry entry;
+        uint64 uiCells = 0;
+
+        if (!ReadString(file, strQuery) || !ReadValue(file, entry.uiErrno) || !ReadString(file, entry.strError) || !ReadValue(file, entry.uiFieldCount) || !ReadValue(file, uiCells))
+        {
+            printf("ReplayData::Load - %s is truncated.", path);
+            return false;
+        }
+
+        if (uiCells)
+        {
+            std::shared_ptr<QueryResultStorage> pStorage = std::make_shared<QueryResultStorage>();
+            uint64 uiColumns = 0;
+
+            if (!ReadValue(file, uiColumns))
+            {
+                printf("ReplayData::Load - %s is truncated.", path);
+                return false;
+            }
+
+            pStorage->vColumns.resize(size_t(uiColumns));
+
+            for (std::string& strColumn : pStorage->vColumns)
+            {
+                if (!ReadString(file, strColumn))
+                {
+                    printf("ReplayData::Load - %s is truncated.", path);
+                    return false;
+                }
+            }
+
+            for (uint64 j = 0; j < uiCells; ++j)
+            {
+                uint8 uiNull = 0;
+                uint8 uiType = 0;
+                DbBinaryValue binary;
+
+                if (!ReadValue(file, uiNull))
+                {
+                    printf("ReplayData::Load - %s is truncated.", path);
+                    return false;
+                }
+
+                if (uiNull)
+                {
+                    pStorage->addNull();
+                    continue;
+                }
+
+                if (!ReadValue(file, uiType) || !ReadValue(file, binary) || !ReadString(file, strValue))
+                {
+                    printf("ReplayData::Load - %s is truncated.", path);
+                    return false;
+                }
+
+                pStorage->addBinaryCell(strValue.data(), strValue.size(), DbFieldType(uiType), binary);
+            }
+
+            entry.pStorage = pStorage;
+        }
+
+        AddEntry(strQuery, entry);
+    }
+
+    return true;
+}
+
+const ReplayData::Entry* ReplayData::Find(const std::string& strQuery) const
+{
+    auto itr = m_uoExact.find(strQuery);
+
+    if (itr != m_uoExact.end())
+    {
+        ++m_uiAnswered;
+        return &itr->second;
+    }
+
+    auto itrFingerprint = m_uoFingerprints.find(DatabaseMetrics::Fingerprint(strQuery.data(), strQuery.size()));
+
+    if (itrFingerprint != m_uoFingerprints.end())
+    {
+        ++m_uiAnswered;
+        return itrFingerprint->second;
+    }
+
+    ++m_uiUnmatched;
+    return nullptr;
+}
+
+uint64 ReplayData::getDelayUs(const Entry* entry) const
+{
+    uint64 uiRows = 0;
+
+    if (entry && entry->pStorage && entry->uiFieldCount)
+        uiRows = entry->pStorage->vCells.size() / entry->uiFieldCount;
+
+    return m_uiBaseUs + uiRows * m_uiPerRowUs;
+}
+
+ReplayBackend::ReplayBackend(std::shared_ptr<const ReplayData> pData) :
+    m_pData(pData),
+    m_pPending(nullptr),
+    m_bMultiStatements(false),
+    m_uiErrno(0)
+{
+    ASSERT(m_pData);
+}
+
+DatabaseBackendFactory ReplayBackend::Factory(std::shared_ptr<const ReplayData> pData)
+{
+    return [pData]() { return std::unique_ptr<DatabaseBackend>(new ReplayBackend(pData)); };
+}
+
+bool ReplayBackend::Open(const std::string& /*strHost*/, const std::string& /*strPortOrSocket*/, const std::string& /*strUser*/, const std::string& /*strPassword*/, const std::string& /*strDbName*/, const bool bNonBlocking)
+{
+    // There's no socket to wait on.
+    if (bNonBlocking)
+    {
+        printf("ReplayBackend::Open - Replay can't be non-blocking.");
+        return false;
+    }
+
+    return true;
+}
+
+bool ReplayBackend::Query(const std::string& strQuery)
+{
+    m_pPending = m_pData->Find(strQuery);
+
+    if (const uint64 uiDelayUs = m_pData->getDelayUs(m_pPending))
+        std::this_thread::sleep_for(std::chrono::microseconds(uiDelayUs));
+
+    if (m_pPending && m_pPending->uiErrno)
+    {
+        m_uiErrno = m_pPending->uiErrno;
+        m_strError = m_pPending->strError;
+        m_pPending = nullptr;
+        return false;
+    }
+
+    m_uiErrno = 0;
+    m_strError.clear();
+    return true;
+}
+
+std::shared_ptr<QueryResult> ReplayBackend::StoreResult(DatabaseMetrics* pMetrics)
+{
+    const ReplayData::Entry* pEntry = m_pPending;
+    m_pPending = nullptr;
+
+    if (!pEntry || !pEntry->pStorage)
+        return nullptr;
+
+    std::shared_ptr<QueryResult> result = std::make_shared<QueryResult>(pEntry->pStorage, pEntry->uiFieldCount);
+
+    if (pMetrics)
+    {
+        pMetrics->RecordRows(result->getRowCount());
+        pMetrics->RecordBytes(pEntry->pStorage->vData.size());
+    }
+
+    return result;
+}
+
+bool ReplayBackend::StoreResultCopy(std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount)
+{
+    if (m_pPending)
+    {
+        storage = m_pPending->pStorage;
+        fieldCount = m_pPending->uiFieldCount;
+    }
+
+    m_pPending = nullptr;
+    return true;
+}
+
+bool ReplayBackend::LoadData(const std::string& strStatement, const char* data, const size_t length, uint64& rows)
+{
+    if (!Query(strStatement))
+        return false;
+
+    m_pPending = nullptr;
+    rows = uint64(std::count(data, data + length, '\n'));
+    return true;
+}
+
+bool ReplayBackend::MultiQuery(const std::string& strStatements, uint32& failedStatement, std::vector<std::shared_ptr<QueryResult>>* pResults, DatabaseMetrics* pMetrics)
+{
+    failedStatement = 1;
+
+    if (!m_bMultiStatements)
+    {
+        m_uiErrno = 1064;
+        m_strError = "Multi statements are off";
+        return false;
+    }
+
+    size_t uiStart = 0;
+    char quote = 0;
+
+    for (size_t i = 0; i <= strStatements.size(); ++i)
+    {
+        const char c = i < strStatements.size() ? strStatements[i] : ';';
+
+        if (quote)
+        {
+            if (c == '\\')
+                ++i;
+            else if (c == quote)
+                quote = 0;
+
+            continue;
+        }
+
+        if (c == '\'' || c == '"' || c == '`')
+        {
+            quote = c;
+            continue;
+        }
+
+        if (c != ';')
+            continue;
+
+        const size_t uiFirst = strStatements.find_first_not_of(" \t\r\n", uiStart);
+
+        if (uiFirst != std::string::npos && uiFirst < i)
+        {
+            if (!Query(strStatements.substr(uiFirst, strStatements.find_last_not_of(" \t\r\n", i - 1) + 1 - uiFirst)))
+                return false;
+
+            if (pResults)
+                pResults->push_back(StoreResult(pMetrics));
+            else
+                DiscardResult();
+
+            ++failedStatement;
+        }
+
+        uiStart = i + 1;
+    }
+
+    return true;
+}
+
+size_t ReplayBackend::EscapeString(char* to, const char* from, const size_t length)
+{
+    return QueryFormatter::EscapeString(to, from, length);
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+#ifndef REPLAYBACKEND_H
+#define REPLAYBACKEND_H
+
+#include "DatabaseBackend.h"
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Database;
+
+// Recorded answers for ReplayBackend, filled in once then shared (const) by every connection.
+// A query is answered by the entry recorded for the same text, or failing that for the same
+// fingerprint (see DatabaseMetrics::Fingerprint), so it matches whatever literals it's run with.
+class ReplayData
+{
+    public:
+        ReplayData();
+
+        // Every answer takes baseUs plus perRowUs for each row, like a server at a fixed distance would.
+        void SetLatency(const uint32 baseUs, const uint32 perRowUs);
+
+        // storage may be null, the query returns no rows.
+        void AddResult(const std::string& strQuery, std::shared_ptr<const QueryResultStorage> storage, const uint32 fieldCount);
+        void AddError(const std::string& strQuery, const uint32 errorNumber, const std::string& strError);
+
+        // Runs strQuery (blocking) on db and records its rows. Returns false if the query failed.
+        bool Capture(Database& db, const std::string& strQuery);
+
+        // Raw native endian binary, for reading back on the same kind of machine. Returns false on I/O errors.
+        bool Save(const char* path) const;
+        bool Load(const char* path);
+
+        // Queries answered from an entry, and queries nothing matched (those succeed with no rows).
+        uint64 getAnswered() const { return m_uiAnswered; }
+        uint64 getUnmatched() const { return m_uiUnmatched; }
+
+    private:
+        friend class ReplayBackend;
+
+        struct Entry
+        {
+            std::shared_ptr<const QueryResultStorage> pStorage;
+            uint32 uiFieldCount;
+
+            // 0 when the query succeeds.
+            uint32 uiErrno;
+            std::string strError;
+        };
+
+        void AddEntry(const std::string& strQuery, const Entry& entry);
+
+        // Null when nothing matches, counted either way.
+        const Entry* Find(const std::string& strQuery) const;
+
+        // How long answering entry takes.
+        uint64 getDelayUs(const Entry* entry) const;
+
+        uint32 m_uiBaseUs;
+        uint32 m_uiPerRowUs;
+
+        // By exact text, in the order they were added (for Save).
+        std::vector<std::string> m_vQueries;
+        std::unordered_map<std::string, Entry> m_uoExact;
+
+        // The last entry added for each fingerprint.
+        std::unordered_map<uint64, const Entry*> m_uoFingerprints;
+
+        mutable std::atomic<uint64> m_uiAnswered;
+        mutable std::atomic<uint64> m_uiUnmatched;
+};
+
+// Answers from a ReplayData without a server, for benchmarks and tests that must not depend on one.
+// Open always succeeds and ignores where it's told to connect.
+class ReplayBackend : public DatabaseBackend
+{
+    public:
+        ReplayBackend(std::shared_ptr<const ReplayData> pData);
+
+        // For Database::SetBackend, every connection replays from pData.
+        static DatabaseBackendFactory Factory(std::shared_ptr<const ReplayData> pData);
+
+        virtual bool Open(const std::string& strHost, const std::string& strPortOrSocket, const std::string& strUser, const std::string& strPassword, const std::string& strDbName, const bool bNonBlocking) final;
+        virtual void Close() final {}
+
+        virtual bool Query(const std::string& strQuery) final;
+
+        // The recorded rows are shared, not copied.
+        virtual std::shared_ptr<QueryResult> StoreResult(DatabaseMetrics* pMetrics) final;
+        virtual bool StoreResultCopy(std::shared_ptr<const QueryResultStorage>& storage, uint32& fieldCount) final;
+        virtual void DiscardResult() final { m_pPending = nullptr; }
+
+        // Splits on ';' outside quotes and answers each statement in turn.
+        virtual bool MultiQuery(const std::string& strStatements, uint32& failedStatement, std::vector<std::shared_ptr<QueryResult>>* pResults, DatabaseMetrics* pMetrics) final;
+        virtual void SetMultiStatements(const bool bEnable) final { m_bMultiStatements = bEnable; }
+
+        // Answered like Query, every line of data counts as a loaded row.
+        virtual bool LoadData(const std::string& strStatement, const char* data, const size_t length, uint64& rows) final;
+
+        virtual bool Ping() final { return true; }
+
+        virtual uint32 getErrno() const final { return m_uiErrno; }
+        virtual const char* getError() const final { return m_strError.c_str(); }
+
+        // There's never a reconnect.
+        virtual unsigned long getThreadId() const final { return 1; }
+
+        // The same escaping as mysql_real_escape_string with a utf8 connection.
+        virtual size_t EscapeString(char* to, const char* from, const size_t length) final;
+
+    private:
+        std::shared_ptr<const ReplayData> m_pData;
+
+        // The answer to the last Query, until its result is taken.
+        const ReplayData::Entry* m_pPending;
+
+        bool m_bMultiStatements;
+
+        uint32 m_uiErrno;
+        std::string m_strError;
+};
+
+#endif
\ No newline at end of file
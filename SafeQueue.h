@@ -1,59 +1,143 @@
-#ifndef SAFE_QUEUE
-#define SAFE_QUEUE
-
-#include <queue>
-#include <mutex>
-#include <condition_variable>
-#include <chrono>
-#include <future>
-
-template <class T>
-class SafeQueue
-{
-    public:
-        SafeQueue(void) : 
-            m_vQueue(), 
-            m_mutex()
-        {}
-
-        ~SafeQueue(void)
-        {}
-
-        void clear()
-        {
-            m_vQueue.clear();
-        }
-
-        void push(T t)
-        {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            m_vQueue.push_back(t);
-        }
-
-        void pushMany(std::vector<T> vT)
-        {
-            std::lock_guard<std::mutex> lock(m_mutex);
-
-            for (size_t i = 0; i < vT.size(); ++i)
-                m_vQueue.push_back(vT[i]);
-        }
-        
-        // Parameter expected to be empty.
-        bool popAll(std::vector<T>& result)
-        {
-            std::lock_guard<std::mutex> lock(m_mutex);
-
-            if (m_vQueue.empty())
-                return false;
-
-            result = m_vQueue;
-            m_vQueue.clear();
-            return true;
-        }
-
-    private:
-        std::mutex m_mutex;
-        std::vector<T> m_vQueue;
-};
-
+#ifndef SAFE_QUEUE
+#define SAFE_QUEUE
+
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <future>
+
+// Many producers, one (or a few) consumers. Items are moved in and the whole queue is swapped out,
+// so T may be move-only and draining never copies. Keep passing the same (cleared) vector to the pop
+// functions and the two buffers trade places forever without allocating.
+template <class T>
+class SafeQueue
+{
+    public:
+        SafeQueue(void) : 
+            m_mutex(),
+            m_condition(),
+            m_vQueue(), 
+            m_bShutdown(false)
+        {}
+
+        ~SafeQueue(void)
+        {}
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_vQueue.clear();
+        }
+
+        // Returns true if the queue was empty, for consumers that also want a signal of their own.
+        bool push(T&& t)
+        {
+            bool bWasEmpty;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                bWasEmpty = m_vQueue.empty();
+                m_vQueue.push_back(std::move(t));
+            }
+
+            m_condition.notify_one();
+            return bWasEmpty;
+        }
+
+        bool push(const T& t)
+        {
+            return push(T(t));
+        }
+
+        // vT is left empty.
+        void pushMany(std::vector<T>&& vT)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                if (m_vQueue.empty())
+                {
+                    m_vQueue.swap(vT);
+                }
+                else
+                {
+                    for (size_t i = 0; i < vT.size(); ++i)
+                        m_vQueue.push_back(std::move(vT[i]));
+                }
+            }
+
+            vT.clear();
+            m_condition.notify_one();
+        }
+
+        // Wakes every waiter, from now on the wait functions return false once the queue is empty.
+        void shutdown()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_bShutdown = true;
+            }
+
+            m_condition.notify_all();
+        }
+        
+        // Parameter expected to be empty.
+        bool popAll(std::vector<T>& result)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return takeAll(result);
+        }
+
+        // Parameter expected to be empty.
+        // Blocks until there is something to pop, returns false only after shutdown() with nothing left.
+        bool waitPopAll(std::vector<T>& result)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return !m_vQueue.empty() || m_bShutdown; });
+            return takeAll(result);
+        }
+
+        // Parameter expected to be empty.
+        // Same as waitPopAll but also gives up, returning false, after timeout.
+        template <class Rep, class Period>
+        bool waitPopAllFor(std::vector<T>& result, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait_for(lock, timeout, [this] { return !m_vQueue.empty() || m_bShutdown; });
+            return takeAll(result);
+        }
+
+        // Runs f(const std::vector<T>&) on what's queued, under the lock, so keep it short.
+        template <class F>
+        void inspect(F f)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            f(static_cast<const std::vector<T>&>(m_vQueue));
+        }
+
+        bool isShutdown()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_bShutdown;
+        }
+
+    private:
+        // m_mutex expected to be locked, result expected to be empty.
+        bool takeAll(std::vector<T>& result)
+        {
+            if (m_vQueue.empty())
+                return false;
+
+            // Our buffer goes out, the caller's (empty, but with its capacity) comes in.
+            result.swap(m_vQueue);
+            return true;
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::vector<T> m_vQueue;
+        bool m_bShutdown;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,381 @@
+#include "Database.h"
+#include "WriteBehind.h"
+
+#include <algorithm>
+
+// Rows per batched statement, the server parses a huge CASE slowly and max_allowed_packet may be small.
+#define WRITE_BEHIND_BATCH_ROWS 500
+#define WRITE_BEHIND_BATCH_BYTES (256 * 1024)
+
+WriteBehind::WriteBehind(Database& db) :
+    m_db(db),
+    m_bStop(false),
+    m_uiIntervalMs(100),
+    m_uiMaxRows(10000),
+    m_uiWrites(0),
+    m_uiMerged(0),
+    m_uiRowsFlushed(0),
+    m_uiStatements(0)
+{
+
+}
+
+WriteBehind::~WriteBehind()
+{
+    Stop();
+}
+
+void WriteBehind::Write(const std::string& strTable, const std::string& strKeyColumn, const std::string& strKey, const bool bUpsert, std::vector<std::pair<std::string, std::string>>& vColumns)
+{
+    ASSERT(!vColumns.empty());
+
+    // The last value given for a column wins, stable_sort keeps them in the order given.
+    std::stable_sort(vColumns.begin(), vColumns.end(), [](const std::pair<std::string, std::string>& a, const std::pair<std::string, std::string>& b) { return a.first < b.first; });
+
+    for (size_t i = vColumns.size() - 1; i > 0; --i)
+    {
+        if (vColumns[i - 1].first == vColumns[i].first)
+            vColumns.erase(vColumns.begin() + (i - 1));
+    }
+
+    std::string strRowKey = RowKey(strTable, strKeyColumn, strKey);
+    bool bFull;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_thread.joinable())
+        {
+            m_bStop = false;
+            m_thread = std::thread(&WriteBehind::FlushThread, this);
+        }
+
+        ++m_uiWrites;
+
+        auto itr = m_uoRows.find(strRowKey);
+
+        if (itr == m_uoRows.end())
+        {
+            m_uoRows.insert(std::make_pair(std::move(strRowKey), m_vRows.size()));
+
+            Row row;
+            row.strTable = strTable;
+            row.strKeyColumn = strKeyColumn;
+            row.strKey = strKey;
+            row.bUpsert = bUpsert;
+            row.vColumns.swap(vColumns);
+            m_vRows.push_back(std::move(row));
+        }
+        else
+        {
+            ++m_uiMerged;
+
+            Row& row = m_vRows[itr->second];
+            row.bUpsert |= bUpsert;
+            MergeColumns(row.vColumns, vColumns);
+        }
+
+        bFull = m_vRows.size() >= m_uiMaxRows;
+    }
+
+    if (bFull)
+        Flush();
+}
+
+bool WriteBehind::Flush(std::function<void()> onFlushed)
+{
+    // One flush at a time, so an older value of a row is never queued after a newer one.
+    std::lock_guard<std::mutex> flushLock(m_mutexFlush);
+
+    std::vector<Row> vRows;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        vRows.swap(m_vRows);
+        m_uoRows.clear();
+    }
+
+    if (vRows.empty() && !onFlushed)
+        return true;
+
+    std::vector<std::string> vStatements;
+    BuildStatements(vRows, vStatements);
+
+    {
+        // Everything goes to the same worker and lane, whatever scope the caller is in, so flushes (and the barriers after them) keep their order.
+        DbPriorityScope priority(DB_PRIORITY_NORMAL);
+
+        if (m_db.PushQuery(std::make_shared<WriteBehindObj>(vStatements, onFlushed)))
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_uiRowsFlushed += vRows.size();
+            m_uiStatements += vStatements.size();
+            return true;
+        }
+    }
+
+    printf("WriteBehind::Flush - The queue turned the flush away, %u rows wait for the next one.", uint32(vRows.size()));
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // They were written first, so they go back in front, with whatever was written to the same rows meanwhile merged over them.
+    std::vector<Row> vNewer;
+    vNewer.swap(m_vRows);
+    m_vRows.swap(vRows);
+    m_uoRows.clear();
+
+    for (size_t i = 0; i < m_vRows.size(); ++i)
+        m_uoRows.insert(std::make_pair(RowKey(m_vRows[i].strTable, m_vRows[i].strKeyColumn, m_vRows[i].strKey), i));
+
+    for (size_t i = 0; i < vNewer.size(); ++i)
+    {
+        Row& row = vNewer[i];
+        std::string strRowKey = RowKey(row.strTable, row.strKeyColumn, row.strKey);
+        auto itr = m_uoRows.find(strRowKey);
+
+        if (itr == m_uoRows.end())
+        {
+            m_uoRows.insert(std::make_pair(std::move(strRowKey), m_vRows.size()));
+            m_vRows.push_back(std::move(row));
+            continue;
+        }
+
+        Row& older = m_vRows[itr->second];
+        older.bUpsert |= row.bUpsert;
+        MergeColumns(older.vColumns, row.vColumns);
+    }
+
+    return false;
+}
+
+void WriteBehind::SetLimits(const uint32 intervalMs, const uint32 maxRows)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_uiIntervalMs = intervalMs;
+        m_uiMaxRows = maxRows;
+    }
+
+    // The flush thread starts waiting again with the new interval.
+    m_condition.notify_all();
+}
+
+void WriteBehind::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+
+    m_condition.notify_all();
+
+    if (m_thread.joinable())
+        m_thread.join();
+
+    // There's no next flush to wait for.
+    if (!Flush())
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        printf("WriteBehind::Stop - %u rows are lost.", uint32(m_vRows.size()));
+    }
+}
+
+WriteBehindStats WriteBehind::getStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    WriteBehindStats stats;
+    stats.uiWrites = m_uiWrites;
+    stats.uiMerged = m_uiMerged;
+    stats.uiRowsFlushed = m_uiRowsFlushed;
+    stats.uiStatements = m_uiStatements;
+    stats.uiPending = m_vRows.size();
+    return stats;
+}
+
+void WriteBehind::FlushThread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (!m_bStop)
+    {
+        const uint32 uiIntervalMs = m_uiIntervalMs;
+
+        if (m_condition.wait_for(lock, std::chrono::milliseconds(uiIntervalMs), [this, uiIntervalMs] { return m_bStop || m_uiIntervalMs != uiIntervalMs; }))
+            continue;
+
+        if (m_vRows.empty())
+            continue;
+
+        lock.unlock();
+        Flush();
+        lock.lock();
+    }
+}
+
+std::string WriteBehind::RowKey(const std::string& strTable, const std::string& strKeyColumn, const std::string& strKey)
+{
+    std::string strRowKey = strTable;
+    strRowKey += '\0';
+    strRowKey += strKeyColumn;
+    strRowKey += '\0';
+    strRowKey += strKey;
+    return strRowKey;
+}
+
+void WriteBehind::MergeColumns(std::vector<std::pair<std::string, std::string>>& vColumns, std::vector<std::pair<std::string, std::string>>& vNewer)
+{
+    // Both are sorted, merge the new values in.
+    std::vector<std::pair<std::string, std::string>> vMerged;
+    vMerged.reserve(vColumns.size() + vNewer.size());
+
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < vColumns.size() || j < vNewer.size())
+    {
+        if (j == vNewer.size() || (i < vColumns.size() && vColumns[i].first < vNewer[j].first))
+        {
+            vMerged.push_back(std::move(vColumns[i++]));
+        }
+        else
+        {
+            if (i < vColumns.size() && vColumns[i].first == vNewer[j].first)
+                ++i;
+
+            vMerged.push_back(std::move(vNewer[j++]));
+        }
+    }
+
+    vColumns.swap(vMerged);
+}
+
+void WriteBehind::BuildStatements(std::vector<Row>& vRows, std::vector<std::string>& vStatements)
+{
+    // Rows that can share a statement: same table, key column, kind and columns.
+    //  Groups go out in the order their first row was written, so a parent table written first is sent first.
+    std::unordered_map<std::string, size_t> uoGroups;
+    std::vector<std::vector<const Row*>> vGroups;
+    std::string strGroup;
+
+    for (size_t i = 0; i < vRows.size(); ++i)
+    {
+        const Row& row = vRows[i];
+
+        strGroup = row.strTable;
+        strGroup += '\0';
+        strGroup += row.strKeyColumn;
+        strGroup += '\0';
+        strGroup += row.bUpsert ? 'u' : 'n';
+
+        for (size_t j = 0; j < row.vColumns.size(); ++j)
+        {
+            strGroup += '\0';
+            strGroup += row.vColumns[j].first;
+        }
+
+        auto itr = uoGroups.find(strGroup);
+
+        if (itr == uoGroups.end())
+        {
+            itr = uoGroups.emplace(strGroup, vGroups.size()).first;
+            vGroups.push_back(std::vector<const Row*>());
+        }
+
+        vGroups[itr->second].push_back(&row);
+    }
+
+    std::vector<const Row*> vBatch;
+
+    for (size_t g = 0; g < vGroups.size(); ++g)
+    {
+        const std::vector<const Row*>& vGroup = vGroups[g];
+        size_t uiBytes = 0;
+
+        for (size_t i = 0; i < vGroup.size(); ++i)
+        {
+            vBatch.push_back(vGroup[i]);
+
+            for (size_t j = 0; j < vGroup[i]->vColumns.size(); ++j)
+                uiBytes += vGroup[i]->vColumns[j].second.size() + vGroup[i]->strKey.size() + 16;
+
+            if (vBatch.size() == WRITE_BEHIND_BATCH_ROWS || uiBytes >= WRITE_BEHIND_BATCH_BYTES || i + 1 == vGroup.size())
+            {
+                vStatements.push_back(std::string());
+                AppendStatement(vBatch, vStatements.back());
+
+                vBatch.clear();
+                uiBytes = 0;
+            }
+        }
+    }
+}
+
+void WriteBehind::AppendStatement(const std::vector<const Row*>& vBatch, std::string& strStatement)
+{
+    ASSERT(!vBatch.empty());
+
+    const Row& first = *vBatch[0];
+
+    if (first.bUpsert)
+    {
+        // INSERT INTO t (k, a, b) VALUES (1, x, y), (2, z, w) ON DUPLICATE KEY UPDATE a = VALUES(a), b = VALUES(b)
+        strStatement = "INSERT INTO " + first.strTable + " (" + first.strKeyColumn;
+
+        for (size_t i = 0; i < first.vColumns.size(); ++i)
+            strStatement += ", " + first.vColumns[i].first;
+
+        strStatement += ") VALUES ";
+
+        for (size_t i = 0; i < vBatch.size(); ++i)
+        {
+            strStatement += i ? ", (" : "(";
+            strStatement += vBatch[i]->strKey;
+
+            for (size_t j = 0; j < vBatch[i]->vColumns.size(); ++j)
+                strStatement += ", " + vBatch[i]->vColumns[j].second;
+
+            strStatement += ')';
+        }
+
+        strStatement += " ON DUPLICATE KEY UPDATE ";
+
+        for (size_t i = 0; i < first.vColumns.size(); ++i)
+        {
+            const std::string& strColumn = first.vColumns[i].first;
+            strStatement += (i ? ", " : "") + strColumn + " = VALUES(" + strColumn + ")";
+        }
+
+        return;
+    }
+
+    strStatement = "UPDATE " + first.strTable + " SET ";
+
+    if (vBatch.size() == 1)
+    {
+        // UPDATE t SET a = x, b = y WHERE k = 1
+        for (size_t i = 0; i < first.vColumns.size(); ++i)
+            strStatement += (i ? ", " : "") + first.vColumns[i].first + " = " + first.vColumns[i].second;
+
+        strStatement += " WHERE " + first.strKeyColumn + " = " + first.strKey;
+        return;
+    }
+
+    // UPDATE t SET a = CASE k WHEN 1 THEN x WHEN 2 THEN z END, b = CASE k ... END WHERE k IN (1, 2)
+    for (size_t i = 0; i < first.vColumns.size(); ++i)
+    {
+        strStatement += (i ? ", " : "") + first.vColumns[i].first + " = CASE " + first.strKeyColumn;
+
+        for (size_t j = 0; j < vBatch.size(); ++j)
+            strStatement += " WHEN " + vBatch[j]->strKey + " THEN " + vBatch[j]->vColumns[i].second;
+
+        strStatement += " END";
+    }
+
+    strStatement += " WHERE " + first.strKeyColumn + " IN (";
+
+    for (size_t i = 0; i < vBatch.size(); ++i)
+        strStatement += (i ? ", " : "") + vBatch[i]->strKey;
+
+    strStatement += ')';
+}
@@ -0,0 +1,105 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include "DbField.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Database;
+
+struct WriteBehindStats
+{
+    // Row writes handed in, and how many of them were merged into one still waiting, so never sent on their own.
+    uint64 uiWrites;
+    uint64 uiMerged;
+
+    // Rows and statements queued by flushes so far.
+    uint64 uiRowsFlushed;
+    uint64 uiStatements;
+
+    // Rows waiting for the next flush.
+    uint64 uiPending;
+};
+
+// Holds row writes keyed by (table, key column, key) for a while, so only the latest value of each column is sent.
+// Rows are flushed every interval, or as soon as maxRows are waiting, as a few batched statements queued like QueueExecuteQuery:
+// rows of a table with the same columns become one UPDATE ... CASE (or one INSERT ... ON DUPLICATE KEY UPDATE for upserts).
+// Until its flush a write isn't in the database, nothing else queued or run meanwhile sees it. Use Database::FlushWriteBehind before
+// anything that must. Columns written through here shouldn't also be written directly, the later direct write could be overwritten.
+class WriteBehind
+{
+    public:
+        WriteBehind(Database& db);
+        ~WriteBehind();
+
+        // Sets the columns of the row where keyColumn = key, values are SQL literals (formatted and escaped already).
+        //  bUpsert inserts the row if it isn't there, a row that was upserted before the flush stays an upsert.
+        void Write(const std::string& strTable, const std::string& strKeyColumn, const std::string& strKey, const bool bUpsert, std::vector<std::pair<std::string, std::string>>& vColumns);
+
+        // Queues everything waiting now. onFlushed (optional) is called on the worker thread once it ran.
+        //  Returns false if the queue turned it away, the rows wait for the next flush and onFlushed is never called.
+        bool Flush(std::function<void()> onFlushed = nullptr);
+
+        // Flushes every intervalMs (100 by default), or when maxRows (10000 by default) are waiting.
+        void SetLimits(const uint32 intervalMs, const uint32 maxRows);
+
+        // Flushes and stops the flush thread, until the next Write.
+        void Stop();
+
+        WriteBehindStats getStats();
+
+    private:
+        struct Row
+        {
+            std::string strTable;
+            std::string strKeyColumn;
+            std::string strKey;
+            bool bUpsert;
+
+            // Sorted by name, so rows with the same columns batch together whichever order they were set in.
+            std::vector<std::pair<std::string, std::string>> vColumns;
+        };
+
+        void FlushThread();
+
+        // Tells rows apart in m_uoRows.
+        static std::string RowKey(const std::string& strTable, const std::string& strKeyColumn, const std::string& strKey);
+
+        // Both sorted by name, vColumns gets the columns of both with the values of vNewer where they share one.
+        static void MergeColumns(std::vector<std::pair<std::string, std::string>>& vColumns, std::vector<std::pair<std::string, std::string>>& vNewer);
+
+        // Adds the statements for rows, grouped by table, key column, kind and columns, in the order each group was first written.
+        static void BuildStatements(std::vector<Row>& vRows, std::vector<std::string>& vStatements);
+        static void AppendStatement(const std::vector<const Row*>& vBatch, std::string& strStatement);
+
+        Database& m_db;
+
+        // Held for a whole flush, taken before m_mutex.
+        std::mutex m_mutexFlush;
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::thread m_thread;
+        bool m_bStop;
+
+        // Waiting rows in the order they were first written, and where each key is in it.
+        std::vector<Row> m_vRows;
+        std::unordered_map<std::string, size_t> m_uoRows;
+
+        uint32 m_uiIntervalMs;
+        uint32 m_uiMaxRows;
+
+        uint64 m_uiWrites;
+        uint64 m_uiMerged;
+        uint64 m_uiRowsFlushed;
+        uint64 m_uiStatements;
+};
+
+#endif
@@ -0,0 +1,584 @@
+#include "Database.h"
+#include "WriteSpool.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <typeinfo>
+
+// "DBSPOOL1", at the start of every segment.
+#define WRITE_SPOOL_MAGIC 0x314C4F4F50534244ULL
+
+enum WriteSpoolKind
+{
+    WRITE_SPOOL_QUERY,
+    WRITE_SPOOL_TRANSACTION
+};
+
+enum WriteSpoolState
+{
+    WRITE_SPOOL_PENDING,
+    WRITE_SPOOL_DONE
+};
+
+struct WriteSpoolHeader
+{
+    uint64 uiMagic;
+    uint64 uiId;
+};
+
+// Followed by its statements, each a uint32 length and the SQL. Records start 8 byte aligned.
+struct WriteSpoolRecord
+{
+    // Bytes of statements after this. Written last, 0 where nothing was (completely) written.
+    uint32 uiLength;
+    uint32 uiChecksum;
+    uint64 uiShardKey;
+    uint8 uiKind;
+    uint8 uiPriority;
+    uint8 uiState;
+    uint8 uiPad[5];
+};
+
+// FNV-1a, to tell a record cut short by a power loss from a whole one.
+static uint32 SpoolChecksum(const char* data, const size_t length)
+{
+    uint32 uiHash = 2166136261u;
+
+    for (size_t i = 0; i < length; ++i)
+        uiHash = (uiHash ^ uint8(data[i])) * 16777619u;
+
+    return uiHash;
+}
+
+// msync wants a page aligned start.
+static bool SyncRange(char* pData, const size_t from, const size_t to)
+{
+    const size_t uiPage = size_t(sysconf(_SC_PAGESIZE));
+    const size_t uiStart = from / uiPage * uiPage;
+
+    return msync(pData + uiStart, to - uiStart, MS_SYNC) == 0;
+}
+
+static void AppendStatement(char*& pWrite, const std::string& strQuery)
+{
+    const uint32 uiLength = uint32(strQuery.size());
+    memcpy(pWrite, &uiLength, sizeof(uiLength));
+    memcpy(pWrite + sizeof(uiLength), strQuery.data(), uiLength);
+    pWrite += sizeof(uiLength) + uiLength;
+}
+
+WriteSpool::Segment::~Segment()
+{
+    if (pData)
+        munmap(pData, uiSize);
+
+    if (iFd >= 0)
+        close(iFd);
+
+    if (bDelete)
+        unlink(strPath.c_str());
+}
+
+WriteSpool::WriteSpool(Database& db, const std::string& strDirectory, const uint32 segmentBytes, const uint32 syncIntervalMs) :
+    m_db(db),
+    m_strDirectory(strDirectory),
+    m_uiSegmentBytes(segmentBytes),
+    m_uiSyncIntervalMs(syncIntervalMs),
+    m_uiWriteOffset(0),
+    m_uiNextSegment(1),
+    m_uiAppended(0),
+    m_uiSynced(0),
+    m_uiSyncedOffset(0),
+    m_uiSyncWaiters(0),
+    m_bStop(false),
+    m_uiBytes(0),
+    m_uiSyncs(0),
+    m_uiReplayed(0)
+{
+
+}
+
+WriteSpool::~WriteSpool()
+{
+    Close();
+}
+
+bool WriteSpool::Open()
+{
+    DIR* pDir = opendir(m_strDirectory.c_str());
+
+    if (!pDir)
+    {
+        printf("WriteSpool::Open - Could not read the directory '%s'.", m_strDirectory.c_str());
+        return false;
+    }
+
+    // Segments are named after their id in 16 hex digits, so they sort in the order they were written.
+    std::vector<uint64> vIds;
+
+    while (dirent* pEntry = readdir(pDir))
+    {
+        unsigned long long uiId;
+
+        if (strlen(pEntry->d_name) == 22 && !strcmp(pEntry->d_name + 16, ".spool") && sscanf(pEntry->d_name, "%16llx", &uiId) == 1)
+            vIds.push_back(uiId);
+    }
+
+    closedir(pDir);
+    std::sort(vIds.begin(), vIds.end());
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_bStop = false;
+        m_uiNextSegment = vIds.empty() ? 1 : vIds.back() + 1;
+
+        if (!Rotate(0))
+            return false;
+    }
+
+    m_thread = std::thread(&WriteSpool::SyncThread, this);
+
+    for (size_t i = 0; i < vIds.size(); ++i)
+    {
+        std::shared_ptr<Segment> pSegment = MapSegment(getSegmentPath(vIds[i]), vIds[i], 0, false);
+
+        if (!pSegment)
+            continue;
+
+        // Counted first, workers may finish the first ones before the last are queued.
+        pSegment->uiPending = Replay(*pSegment, false);
+
+        if (!pSegment->uiPending)
+        {
+            pSegment->bDelete = true;
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_mSegments[pSegment->uiId] = pSegment;
+        }
+
+        printf("WriteSpool::Open - Queueing %u writes left undone in '%s'.", pSegment->uiPending, pSegment->strPath.c_str());
+        Replay(*pSegment, true);
+    }
+
+    return true;
+}
+
+void WriteSpool::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+
+    m_conditionSync.notify_all();
+    m_conditionSynced.notify_all();
+
+    // It syncs whatever is left before it stops.
+    if (m_thread.joinable())
+        m_thread.join();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_pActive)
+        m_pActive->bDelete = !m_pActive->uiPending;
+
+    m_pActive.reset();
+    m_mSegments.clear();
+}
+
+void WriteSpool::Record(QueryObj& obj)
+{
+    // Replayed, or spilled and queued again.
+    if (obj.m_pSpool)
+        return;
+
+    const std::vector<std::shared_ptr<QueryObj>>* pQueries = nullptr;
+    size_t uiLength = 0;
+
+    if (typeid(obj) == typeid(QueryObj))
+    {
+        uiLength = sizeof(uint32) + obj.m_strQuery.size();
+    }
+    else if (typeid(obj) == typeid(TransactionQueryObj))
+    {
+        pQueries = &static_cast<TransactionQueryObj&>(obj).m_vQueries;
+
+        // Prepared statements can't be replayed before they're registered again.
+        for (size_t i = 0; i < pQueries->size(); ++i)
+        {
+            if (typeid(*(*pQueries)[i]) != typeid(QueryObj))
+                return;
+
+            uiLength += sizeof(uint32) + (*pQueries)[i]->m_strQuery.size();
+        }
+
+        if (pQueries->empty())
+            return;
+    }
+    else
+    {
+        return;
+    }
+
+    const size_t uiRecordBytes = (sizeof(WriteSpoolRecord) + uiLength + 7) & ~size_t(7);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (!m_pActive || m_bStop)
+        return;
+
+    if (m_uiWriteOffset + uiRecordBytes > m_pActive->uiSize && !Rotate(uiRecordBytes))
+        return;
+
+    char* pRecord = m_pActive->pData + m_uiWriteOffset;
+    char* pWrite = pRecord + sizeof(WriteSpoolRecord);
+
+    if (pQueries)
+    {
+        for (size_t i = 0; i < pQueries->size(); ++i)
+            AppendStatement(pWrite, (*pQueries)[i]->m_strQuery);
+    }
+    else
+    {
+        AppendStatement(pWrite, obj.m_strQuery);
+    }
+
+    WriteSpoolRecord record;
+    memset(&record, 0, sizeof(record));
+    record.uiLength = uint32(uiLength);
+    record.uiChecksum = SpoolChecksum(pRecord + sizeof(WriteSpoolRecord), uiLength);
+    record.uiShardKey = obj.m_uiShardKey;
+    record.uiKind = uint8(pQueries ? WRITE_SPOOL_TRANSACTION : WRITE_SPOOL_QUERY);
+    record.uiPriority = uint8(obj.m_ePriority);
+    record.uiState = WRITE_SPOOL_PENDING;
+
+    // The length goes in last, so a record the process died writing reads as the end.
+    memcpy(pRecord + sizeof(uint32), reinterpret_cast<const char*>(&record) + sizeof(uint32), sizeof(record) - sizeof(uint32));
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(pRecord, &record.uiLength, sizeof(uint32));
+
+    obj.m_pSpool = this;
+    obj.m_uiSpoolRecord = (m_pActive->uiId << 32) | m_uiWriteOffset;
+
+    m_uiWriteOffset += uiRecordBytes;
+    ++m_pActive->uiPending;
+    ++m_uiAppended;
+    m_uiBytes += uiRecordBytes;
+
+    if (m_uiSyncIntervalMs)
+        return;
+
+    // One sync covers everyone who appended meanwhile.
+    const uint64 uiRecord = m_uiAppended;
+
+    ++m_uiSyncWaiters;
+    m_conditionSync.notify_one();
+    m_conditionSynced.wait(lock, [this, uiRecord] { return m_uiSynced >= uiRecord || m_bStop; });
+    --m_uiSyncWaiters;
+}
+
+void WriteSpool::MarkDone(const uint64 record)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Closed already, it stays undone.
+    auto itr = m_mSegments.find(record >> 32);
+
+    if (itr == m_mSegments.end())
+        return;
+
+    Segment& segment = *itr->second;
+    ASSERT(segment.uiPending);
+
+    segment.pData[(record & 0xFFFFFFFF) + offsetof(WriteSpoolRecord, uiState)] = WRITE_SPOOL_DONE;
+
+    if (--segment.uiPending || itr->second == m_pActive)
+        return;
+
+    segment.bDelete = true;
+    m_mSegments.erase(itr);
+}
+
+WriteSpoolStats WriteSpool::getStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    WriteSpoolStats stats;
+    stats.uiRecords = m_uiAppended;
+    stats.uiBytes = m_uiBytes;
+    stats.uiSyncs = m_uiSyncs;
+    stats.uiSyncedRecords = m_uiSynced;
+    stats.uiReplayed = m_uiReplayed;
+    stats.uiPending = 0;
+    stats.uiSegments = uint32(m_mSegments.size());
+
+    for (auto itr = m_mSegments.begin(); itr != m_mSegments.end(); ++itr)
+        stats.uiPending += itr->second->uiPending;
+
+    return stats;
+}
+
+std::shared_ptr<WriteSpool::Segment> WriteSpool::MapSegment(const std::string& strPath, const uint64 id, const size_t size, const bool bCreate)
+{
+    std::shared_ptr<Segment> pSegment = std::make_shared<Segment>();
+    pSegment->uiId = id;
+    pSegment->strPath = strPath;
+    pSegment->iFd = open(strPath.c_str(), bCreate ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+
+    if (pSegment->iFd < 0)
+    {
+        printf("WriteSpool::MapSegment - Could not open '%s'.", strPath.c_str());
+        return nullptr;
+    }
+
+    if (bCreate)
+    {
+        // Allocated up front, so a full disk fails here instead of as a SIGBUS writing to the map.
+        if (posix_fallocate(pSegment->iFd, 0, off_t(size)))
+        {
+            printf("WriteSpool::MapSegment - Could not allocate %llu bytes for '%s'.", (unsigned long long)size, strPath.c_str());
+            pSegment->bDelete = true;
+            return nullptr;
+        }
+
+        pSegment->uiSize = size;
+    }
+    else
+    {
+        struct stat st;
+
+        if (fstat(pSegment->iFd, &st) || size_t(st.st_size) < sizeof(WriteSpoolHeader))
+        {
+            printf("WriteSpool::MapSegment - '%s' isn't a spool segment.", strPath.c_str());
+            return nullptr;
+        }
+
+        pSegment->uiSize = size_t(st.st_size);
+    }
+
+    void* pData = mmap(nullptr, pSegment->uiSize, PROT_READ | PROT_WRITE, MAP_SHARED, pSegment->iFd, 0);
+
+    if (pData == MAP_FAILED)
+    {
+        printf("WriteSpool::MapSegment - Could not map '%s'.", strPath.c_str());
+        pSegment->bDelete = bCreate;
+        return nullptr;
+    }
+
+    pSegment->pData = static_cast<char*>(pData);
+    WriteSpoolHeader* pHeader = reinterpret_cast<WriteSpoolHeader*>(pSegment->pData);
+
+    if (bCreate)
+    {
+        pHeader->uiMagic = WRITE_SPOOL_MAGIC;
+        pHeader->uiId = id;
+    }
+    else if (pHeader->uiMagic != WRITE_SPOOL_MAGIC || pHeader->uiId != id)
+    {
+        printf("WriteSpool::MapSegment - '%s' isn't a spool segment.", strPath.c_str());
+        return nullptr;
+    }
+
+    return pSegment;
+}
+
+uint32 WriteSpool::Replay(Segment& segment, const bool bQueue)
+{
+    uint32 uiCount = 0;
+    size_t uiOffset = sizeof(WriteSpoolHeader);
+
+    while (uiOffset + sizeof(WriteSpoolRecord) <= segment.uiSize)
+    {
+        WriteSpoolRecord record;
+        memcpy(&record, segment.pData + uiOffset, sizeof(record));
+
+        if (!record.uiLength)
+            break;
+
+        const char* pStatements = segment.pData + uiOffset + sizeof(WriteSpoolRecord);
+
+        if (uiOffset + sizeof(WriteSpoolRecord) + record.uiLength > segment.uiSize || SpoolChecksum(pStatements, record.uiLength) != record.uiChecksum)
+        {
+            if (!bQueue)
+                printf("WriteSpool::Replay - '%s' ends in a record that was cut short, it's skipped.", segment.strPath.c_str());
+
+            break;
+        }
+
+        const size_t uiRecordOffset = uiOffset;
+        uiOffset += (sizeof(WriteSpoolRecord) + record.uiLength + 7) & ~size_t(7);
+
+        if (record.uiState != WRITE_SPOOL_PENDING)
+            continue;
+
+        ++uiCount;
+
+        if (!bQueue)
+            continue;
+
+        std::vector<std::shared_ptr<QueryObj>> vQueries;
+        const char* pEnd = pStatements + record.uiLength;
+
+        while (pStatements + sizeof(uint32) <= pEnd)
+        {
+            uint32 uiLength;
+            memcpy(&uiLength, pStatements, sizeof(uiLength));
+            pStatements += sizeof(uiLength);
+
+            vQueries.push_back(std::make_shared<QueryObj>(std::string(pStatements, uiLength), record.uiShardKey));
+            pStatements += uiLength;
+        }
+
+        std::shared_ptr<QueryObj> pObj;
+
+        if (record.uiKind == WRITE_SPOOL_TRANSACTION)
+            pObj = std::make_shared<TransactionQueryObj>(vQueries, nullptr, record.uiShardKey);
+        else
+            pObj = vQueries.front();
+
+        pObj->m_ePriority = DbPriority(record.uiPriority);
+        pObj->m_iQueuedUs = DatabaseMetrics::NowUs();
+        pObj->m_pSpool = this;
+        pObj->m_uiSpoolRecord = (segment.uiId << 32) | uiRecordOffset;
+
+        // Past the queue limits, nothing may be turned away: a record left for a later Open would run after newer writes.
+        m_db.EnqueueQuery(std::move(pObj));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_uiReplayed;
+    }
+
+    return uiCount;
+}
+
+bool WriteSpool::Rotate(const size_t bytes)
+{
+    // Whole pages, and always room for the record that didn't fit.
+    const size_t uiPage = size_t(sysconf(_SC_PAGESIZE));
+    size_t uiSize = std::max<size_t>(m_uiSegmentBytes, sizeof(WriteSpoolHeader) + bytes);
+    uiSize = (uiSize + uiPage - 1) / uiPage * uiPage;
+
+    if (uiSize > 0xFFFFFFFF)
+    {
+        printf("WriteSpool::Rotate - A record of %llu bytes doesn't fit in a segment, it isn't recorded.", (unsigned long long)bytes);
+        return false;
+    }
+
+    std::shared_ptr<Segment> pSegment = MapSegment(getSegmentPath(m_uiNextSegment), m_uiNextSegment, uiSize, true);
+
+    if (!pSegment)
+        return false;
+
+    ++m_uiNextSegment;
+
+    // The new name has to survive a power loss too.
+    const int iDirFd = open(m_strDirectory.c_str(), O_RDONLY);
+
+    if (iDirFd >= 0)
+    {
+        fsync(iDirFd);
+        close(iDirFd);
+    }
+
+    // The sync thread only follows the active segment, what's left of the old one is synced here.
+    if (m_pActive)
+    {
+        if (m_uiWriteOffset > m_uiSyncedOffset)
+        {
+            SyncRange(m_pActive->pData, m_uiSyncedOffset, m_uiWriteOffset);
+            ++m_uiSyncs;
+        }
+
+        if (!m_pActive->uiPending)
+        {
+            m_pActive->bDelete = true;
+            m_mSegments.erase(m_pActive->uiId);
+        }
+
+        m_uiSynced = m_uiAppended;
+        m_conditionSynced.notify_all();
+    }
+
+    m_mSegments[pSegment->uiId] = pSegment;
+    m_pActive = pSegment;
+
+    // The header is synced with the first records.
+    m_uiWriteOffset = sizeof(WriteSpoolHeader);
+    m_uiSyncedOffset = 0;
+    return true;
+}
+
+std::string WriteSpool::getSegmentPath(const uint64 id) const
+{
+    char szName[32];
+    snprintf(szName, sizeof(szName), "/%016llx.spool", (unsigned long long)id);
+    return m_strDirectory + szName;
+}
+
+void WriteSpool::SyncThread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        if (m_uiSyncIntervalMs)
+            m_conditionSync.wait_for(lock, std::chrono::milliseconds(m_uiSyncIntervalMs), [this] { return m_bStop; });
+        else
+            m_conditionSync.wait(lock, [this] { return m_bStop || (m_uiSyncWaiters && m_uiSynced < m_uiAppended); });
+
+        if (m_uiSynced < m_uiAppended && m_pActive)
+        {
+            // Held so it stays mapped, even if writing moves on meanwhile.
+            std::shared_ptr<Segment> pSegment = m_pActive;
+            const size_t uiFrom = m_uiSyncedOffset;
+            const size_t uiTo = m_uiWriteOffset;
+            const uint64 uiRecords = m_uiAppended;
+
+            // Appending goes on while it syncs, the next sync picks that up.
+            lock.unlock();
+
+            if (!SyncRange(pSegment->pData, uiFrom, uiTo))
+                printf("WriteSpool::SyncThread - Could not sync '%s'.", pSegment->strPath.c_str());
+
+            lock.lock();
+
+            if (pSegment == m_pActive)
+                m_uiSyncedOffset = std::max(m_uiSyncedOffset, uiTo);
+
+            m_uiSynced = std::max(m_uiSynced, uiRecords);
+            ++m_uiSyncs;
+            m_conditionSynced.notify_all();
+        }
+
+        if (m_bStop)
+            break;
+    }
+}
+
+#else
+
+// Needs mmap, see Database::SetWriteSpool.
+WriteSpool::WriteSpool(Database& db, const std::string& strDirectory, const uint32 segmentBytes, const uint32 syncIntervalMs) :
+    m_db(db), m_strDirectory(strDirectory), m_uiSegmentBytes(segmentBytes), m_uiSyncIntervalMs(syncIntervalMs) {}
+WriteSpool::~WriteSpool() {}
+WriteSpool::Segment::~Segment() {}
+bool WriteSpool::Open() { return false; }
+void WriteSpool::Close() {}
+void WriteSpool::Record(QueryObj& obj) {}
+void WriteSpool::MarkDone(const uint64 /*record*/) {}
+WriteSpoolStats WriteSpool::getStats() { return WriteSpoolStats(); }
+
+#endif
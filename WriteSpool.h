@@ -0,0 +1,126 @@
+#ifndef WRITESPOOL_H
+#define WRITESPOOL_H
+
+#include "DbField.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Database;
+class QueryObj;
+
+struct WriteSpoolStats
+{
+    // Queued writes recorded so far, and the bytes of their records.
+    uint64 uiRecords;
+    uint64 uiBytes;
+
+    // Syncs to disk, and the records they covered between them.
+    uint64 uiSyncs;
+    uint64 uiSyncedRecords;
+
+    // Records queued again by Initialize, and records not done yet (queued, running, or left for the next Initialize).
+    uint64 uiReplayed;
+    uint64 uiPending;
+
+    // Segment files on disk.
+    uint32 uiSegments;
+};
+
+// Append-only log of queued writes, in memory-mapped segment files of a directory. See Database::SetWriteSpool.
+// Plain SQL and transactions of plain SQL are recorded as they're queued, and marked done once they ran. A segment file is
+// deleted when every record in it is done and writing moved on to the next one. Records left undone by a crash are queued again
+// by the next Open in the order they were first queued. A write that failed is done too, run later it could undo newer writes.
+// The map is shared with the kernel, so a process crash loses nothing written to it. Syncs to disk, for power loss, are done by
+// one thread for everything appended since the last: on an interval, or as soon as someone waits for one.
+class WriteSpool
+{
+    public:
+        WriteSpool(Database& db, const std::string& strDirectory, const uint32 segmentBytes, const uint32 syncIntervalMs);
+        ~WriteSpool();
+
+        // Queues what the segments in the directory have undone, past the queue limits, then starts a new segment.
+        //  Returns false if the directory can't be read or the new segment can't be made.
+        bool Open();
+
+        // Syncs, then unmaps every segment. Done ones are deleted, the rest are kept for the next Open.
+        void Close();
+
+        // Records obj if it's plain SQL (or a transaction of only that) and waits for the sync when the interval is 0.
+        void Record(QueryObj& obj);
+
+        // Called as a recorded object is destroyed, whether it ran or failed.
+        void MarkDone(const uint64 record);
+
+        WriteSpoolStats getStats();
+
+    private:
+        struct Segment
+        {
+            Segment() : uiId(0), pData(nullptr), uiSize(0), iFd(-1), uiPending(0), bDelete(false) {}
+            ~Segment();
+
+            uint64 uiId;
+            std::string strPath;
+            char* pData;
+            size_t uiSize;
+            int iFd;
+
+            // Records not done yet.
+            uint32 uiPending;
+
+            // Set once nothing in it is needed, it's deleted when the last reference goes.
+            bool bDelete;
+        };
+
+        // Maps the segment file at strPath, creating it with size bytes if bCreate.
+        std::shared_ptr<Segment> MapSegment(const std::string& strPath, const uint64 id, const size_t size, const bool bCreate);
+
+        // Counts the undone records of segment, and queues them if bQueue. A record cut short ends the segment.
+        uint32 Replay(Segment& segment, const bool bQueue);
+
+        // m_mutex expected to be locked. Moves writing to a new segment with room for bytes.
+        bool Rotate(const size_t bytes);
+
+        std::string getSegmentPath(const uint64 id) const;
+
+        void SyncThread();
+
+        Database& m_db;
+
+        const std::string m_strDirectory;
+        const uint32 m_uiSegmentBytes;
+        const uint32 m_uiSyncIntervalMs;
+
+        std::mutex m_mutex;
+
+        // Every segment with something undone, and the one being written.
+        std::map<uint64, std::shared_ptr<Segment>> m_mSegments;
+        std::shared_ptr<Segment> m_pActive;
+        size_t m_uiWriteOffset;
+        uint64 m_uiNextSegment;
+
+        // Records appended and synced so far, and where the active segment is synced up to.
+        uint64 m_uiAppended;
+        uint64 m_uiSynced;
+        size_t m_uiSyncedOffset;
+
+        // Signals the sync thread, and the ones waiting on it.
+        std::condition_variable m_conditionSync;
+        std::condition_variable m_conditionSynced;
+        uint32 m_uiSyncWaiters;
+
+        std::thread m_thread;
+        bool m_bStop;
+
+        uint64 m_uiBytes;
+        uint64 m_uiSyncs;
+        uint64 m_uiReplayed;
+};
+
+#endif
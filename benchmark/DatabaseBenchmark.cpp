@@ -0,0 +1,526 @@
+// Benchmarks for the paths Database is built around. Everything but the DbField and SafeQueue cases
+// runs against a live server, use a local mysqld and a scratch database: it creates and drops
+// bench_wide and bench_tall in it.
+//
+// Build it together with the library sources, with the same ASSERT, __int64 and common includes the
+// host project supplies to them, for example:
+//   g++ -std=c++17 -O2 -pthread -I. $(mysql_config --cflags) -D'__int64=long long' -D'ASSERT(x)=assert(x)'
+//       -include cassert -include cstdio -include cstring -include cstdarg -include sstream
+//       benchmark/DatabaseBenchmark.cpp *.cpp $(mysql_config --libs) -o DatabaseBenchmark
+//
+// Usage: DatabaseBenchmark "host;port;user;pw;dbname" [name filter] [pool size]
+// Only the cases whose "bench" name contains the filter run.
+// Each result is one JSON object per line on stdout so runs can be diffed, progress goes to stderr.
+// Latencies are per operation unless the line says otherwise ("sample").
+
+#include "../Database.h"
+#include "../SafeQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STMT_BENCH_TALL 1
+#define STMT_BENCH_WIDE 2
+
+#define BENCH_WIDE_COLUMNS 64
+#define BENCH_WIDE_ROWS 2000
+#define BENCH_TALL_ROWS 200000
+
+static int64 NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double Percentile(const std::vector<int64>& vSorted, const double p)
+{
+    if (vSorted.empty())
+        return 0.0;
+
+    const size_t uiIndex = std::min(vSorted.size() - 1, size_t(p * double(vSorted.size())));
+    return double(vSorted[uiIndex]) / 1000.0;
+}
+
+// One JSON line. params is extra "key":value pairs (with a trailing comma), vNs the samples in nanoseconds.
+static void Report(const char* name, const std::string& params, const uint64 ops, const int64 elapsedNs, std::vector<int64>& vNs)
+{
+    std::sort(vNs.begin(), vNs.end());
+
+    const double dSeconds = double(elapsedNs) / 1e9;
+
+    printf("{\"bench\":\"%s\",%s\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f", name, params.c_str(), (unsigned long long)ops, dSeconds, dSeconds > 0.0 ? double(ops) / dSeconds : 0.0);
+
+    if (!vNs.empty())
+    {
+        printf(",\"samples\":%llu,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f",
+               (unsigned long long)vNs.size(), Percentile(vNs, 0.5), Percentile(vNs, 0.9), Percentile(vNs, 0.99), Percentile(vNs, 0.999), double(vNs.back()) / 1000.0);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+}
+
+// What a DbHistogram recorded between two snapshots. The max can't be taken apart, it's the overall one.
+static DbLatencySnapshot Delta(const DbLatencySnapshot& after, const DbLatencySnapshot& before)
+{
+    DbLatencySnapshot result = after;
+    result.uiCount -= before.uiCount;
+    result.uiTotalUs -= before.uiTotalUs;
+
+    for (uint32 i = 0; i < DB_HISTOGRAM_BUCKETS; ++i)
+        result.uiBuckets[i] -= before.uiBuckets[i];
+
+    return result;
+}
+
+static std::string HistogramParams(const char* prefix, const DbLatencySnapshot& latency)
+{
+    char szParams[256];
+    snprintf(szParams, sizeof(szParams), "\"%s_count\":%llu,\"%s_p50_us\":%llu,\"%s_p99_us\":%llu,", prefix, (unsigned long long)latency.uiCount,
+             prefix, (unsigned long long)latency.getPercentileUs(0.5), prefix, (unsigned long long)latency.getPercentileUs(0.99));
+    return szParams;
+}
+
+static bool Wanted(const char* filter, const char* name)
+{
+    return !filter || strstr(name, filter);
+}
+
+// DbField getters on text and on already decoded values, no server needed.
+static void BenchDbFieldDecode()
+{
+    const uint32 uiBatches = 100;
+    const uint32 uiPerBatch = 100000;
+
+    const char* szInt = "1234567";
+    const char* szDouble = "12345.678";
+
+    DbBinaryValue binary;
+    binary.iValue = 1234567;
+
+    const char* szCases[] = { "text_int32", "text_uint64", "text_double", "binary_int32", "binary_uint64" };
+
+    for (uint32 uiCase = 0; uiCase < 5; ++uiCase)
+    {
+        DbField field;
+
+        if (uiCase == 2)
+            field.SetView(szDouble, strlen(szDouble));
+        else if (uiCase < 2)
+            field.SetView(szInt, strlen(szInt));
+        else
+            field.SetBinaryView(szInt, strlen(szInt), DB_FIELD_INT64, binary);
+
+        std::vector<int64> vNs;
+        volatile uint64 uiSink = 0;
+        const int64 iStart = NowNs();
+
+        for (uint32 b = 0; b < uiBatches; ++b)
+        {
+            const int64 iBatchStart = NowNs();
+            uint64 uiSum = 0;
+
+            for (uint32 i = 0; i < uiPerBatch; ++i)
+            {
+                switch (uiCase)
+                {
+                    case 0: case 3: uiSum += uint64(field.getInt32()); break;
+                    case 1: case 4: uiSum += field.getUInt64(); break;
+                    default: uiSum += uint64(field.getDouble()); break;
+                }
+            }
+
+            uiSink = uiSink + uiSum;
+            vNs.push_back(NowNs() - iBatchStart);
+        }
+
+        Report("dbfield_decode", std::string("\"case\":\"") + szCases[uiCase] + "\",\"sample\":\"batch of 100000\",", uint64(uiBatches) * uiPerBatch, NowNs() - iStart, vNs);
+    }
+}
+
+// Producers pushing into one SafeQueue drained by one consumer, no server needed.
+static void BenchSafeQueue()
+{
+    const uint32 uiPerProducer = 200000;
+    const uint32 uiProducerCounts[] = { 1, 2, 4, 8 };
+
+    for (uint32 uiProducers : uiProducerCounts)
+    {
+        SafeQueue<uint64> queue;
+        std::atomic<bool> bGo(false);
+        std::vector<std::vector<int64>> vProducerNs(uiProducers);
+        std::vector<std::thread> vThreads;
+
+        for (uint32 p = 0; p < uiProducers; ++p)
+        {
+            vThreads.push_back(std::thread([&, p]
+            {
+                while (!bGo)
+                    std::this_thread::yield();
+
+                for (uint32 i = 0; i < uiPerProducer; ++i)
+                {
+                    // Timing every push would swamp what's measured.
+                    if (i % 16 == 0)
+                    {
+                        const int64 iStart = NowNs();
+                        queue.push(uint64(i));
+                        vProducerNs[p].push_back(NowNs() - iStart);
+                    }
+                    else
+                    {
+                        queue.push(uint64(i));
+                    }
+                }
+            }));
+        }
+
+        const uint64 uiTotal = uint64(uiProducers) * uiPerProducer;
+        uint64 uiReceived = 0;
+        std::vector<uint64> vBatch;
+
+        const int64 iStart = NowNs();
+        bGo = true;
+
+        while (uiReceived < uiTotal && queue.waitPopAll(vBatch))
+        {
+            uiReceived += vBatch.size();
+            vBatch.clear();
+        }
+
+        const int64 iElapsed = NowNs() - iStart;
+
+        for (size_t i = 0; i < vThreads.size(); ++i)
+            vThreads[i].join();
+
+        std::vector<int64> vNs;
+
+        for (size_t p = 0; p < vProducerNs.size(); ++p)
+            vNs.insert(vNs.end(), vProducerNs[p].begin(), vProducerNs[p].end());
+
+        Report("safequeue_contention", "\"producers\":" + std::to_string(uiProducers) + ",\"sample\":\"push, every 16th\",", uiTotal, iElapsed, vNs);
+    }
+}
+
+// Cost of QueueExecuteQuery to the caller, then until the last one ran, and how long each sat in the queue.
+static void BenchQueueExecute(Database& db)
+{
+    const uint32 uiCount = 100000;
+
+    DatabaseMetricsSnapshot before;
+    db.getMetrics(before);
+
+    std::vector<int64> vNs;
+    vNs.reserve(uiCount);
+
+    const int64 iStart = NowNs();
+
+    for (uint32 i = 0; i < uiCount; ++i)
+    {
+        const int64 iCallStart = NowNs();
+        db.QueueExecuteQuery("DO %u", i);
+        vNs.push_back(NowNs() - iCallStart);
+    }
+
+    const int64 iEnqueued = NowNs() - iStart;
+
+    // Same shard key and lane as the writes, so this only runs once everything before it has.
+    {
+        DbPriorityScope normal(DB_PRIORITY_NORMAL);
+        db.QueryAsync("SELECT 1").get();
+    }
+
+    const int64 iElapsed = NowNs() - iStart;
+
+    DatabaseMetricsSnapshot after;
+    db.getMetrics(after);
+
+    std::vector<int64> vNone;
+    Report("queue_enqueue", "", uiCount, iEnqueued, vNs);
+    Report("queue_throughput", HistogramParams("queue_wait", Delta(after.queueWait, before.queueWait)), uiCount, iElapsed, vNone);
+}
+
+// Blocking Query from several threads at once, over a pool of getPoolSize connections.
+static void BenchQueryContention(Database& db)
+{
+    const uint32 uiPerThread = 2000;
+    const uint32 uiThreadCounts[] = { 1, 2, 4, 8, 16 };
+
+    for (uint32 uiThreads : uiThreadCounts)
+    {
+        DatabaseMetricsSnapshot before;
+        db.getMetrics(before);
+
+        std::vector<std::vector<int64>> vThreadNs(uiThreads);
+        std::vector<std::thread> vThreads;
+        std::atomic<bool> bGo(false);
+
+        for (uint32 t = 0; t < uiThreads; ++t)
+        {
+            vThreads.push_back(std::thread([&, t]
+            {
+                vThreadNs[t].reserve(uiPerThread);
+
+                while (!bGo)
+                    std::this_thread::yield();
+
+                for (uint32 i = 0; i < uiPerThread; ++i)
+                {
+                    const int64 iStart = NowNs();
+                    std::shared_ptr<QueryResult> result = db.Query("SELECT %u", i);
+                    vThreadNs[t].push_back(NowNs() - iStart);
+                }
+            }));
+        }
+
+        const int64 iStart = NowNs();
+        bGo = true;
+
+        for (size_t i = 0; i < vThreads.size(); ++i)
+            vThreads[i].join();
+
+        const int64 iElapsed = NowNs() - iStart;
+
+        DatabaseMetricsSnapshot after;
+        db.getMetrics(after);
+
+        std::vector<int64> vNs;
+
+        for (size_t t = 0; t < vThreadNs.size(); ++t)
+            vNs.insert(vNs.end(), vThreadNs[t].begin(), vThreadNs[t].end());
+
+        std::string strParams = "\"threads\":" + std::to_string(uiThreads) + ",\"pool\":" + std::to_string(db.getPoolSize()) + ",";
+        strParams += HistogramParams("lock_wait", Delta(after.callerLockWait, before.callerLockWait));
+
+        Report("query_contention", strParams, uint64(uiThreads) * uiPerThread, iElapsed, vNs);
+    }
+}
+
+// From queueCallbackQuery until WaitCallbackResults hands the result over.
+static void BenchCallbackTurnaround(Database& db)
+{
+    const uint32 uiCount = 5000;
+
+    std::vector<int64> vNs;
+    vNs.reserve(uiCount);
+
+    std::vector<DbCallbackResult> vResults;
+
+    const int64 iStart = NowNs();
+
+    for (uint32 i = 0; i < uiCount; ++i)
+    {
+        const int64 iQueued = NowNs();
+        db.queueCallbackQuery(i, "SELECT 1");
+
+        while (!db.WaitCallbackResults(vResults, 1000))
+            ;
+
+        vNs.push_back(NowNs() - iQueued);
+        vResults.clear();
+    }
+
+    Report("callback_turnaround", "", uiCount, NowNs() - iStart, vNs);
+}
+
+static bool CreateTables(Database& db)
+{
+    db.ExecuteQueryInstant("DROP TABLE IF EXISTS bench_wide");
+    db.ExecuteQueryInstant("DROP TABLE IF EXISTS bench_tall");
+
+    std::string strWide = "CREATE TABLE bench_wide (id INT UNSIGNED NOT NULL PRIMARY KEY";
+
+    for (uint32 i = 1; i < BENCH_WIDE_COLUMNS; ++i)
+        strWide += ", c" + std::to_string(i) + (i % 4 == 0 ? " VARCHAR(32) NOT NULL" : " INT NOT NULL");
+
+    strWide += ")";
+
+    if (!db.ExecuteQueryInstant("%s", strWide.c_str()) ||
+        !db.ExecuteQueryInstant("CREATE TABLE bench_tall (id INT UNSIGNED NOT NULL PRIMARY KEY, a INT NOT NULL, b DOUBLE NOT NULL, c VARCHAR(32) NOT NULL)"))
+        return false;
+
+    // Batches stay well under MAX_QUERY_LEN.
+    std::string strBatch;
+
+    for (uint32 uiRow = 0; uiRow < BENCH_WIDE_ROWS; ++uiRow)
+    {
+        std::string strRow = "(" + std::to_string(uiRow);
+
+        for (uint32 i = 1; i < BENCH_WIDE_COLUMNS; ++i)
+            strRow += i % 4 == 0 ? ",'value " + std::to_string(uiRow * i) + "'" : "," + std::to_string(int32(uiRow * i));
+
+        strRow += ")";
+
+        if (!strBatch.empty() && strBatch.size() + strRow.size() > MAX_QUERY_LEN - 512)
+        {
+            db.ExecuteQueryInstant("INSERT INTO bench_wide VALUES %s", strBatch.c_str());
+            strBatch.clear();
+        }
+
+        strBatch += (strBatch.empty() ? "" : ",") + strRow;
+    }
+
+    db.ExecuteQueryInstant("INSERT INTO bench_wide VALUES %s", strBatch.c_str());
+    strBatch.clear();
+
+    for (uint32 uiRow = 0; uiRow < BENCH_TALL_ROWS; ++uiRow)
+    {
+        const std::string strRow = "(" + std::to_string(uiRow) + "," + std::to_string(int32(uiRow * 7)) + "," + std::to_string(uiRow) + ".25,'row " + std::to_string(uiRow) + "')";
+
+        if (!strBatch.empty() && strBatch.size() + strRow.size() > MAX_QUERY_LEN - 512)
+        {
+            db.ExecuteQueryInstant("INSERT INTO bench_tall VALUES %s", strBatch.c_str());
+            strBatch.clear();
+        }
+
+        strBatch += (strBatch.empty() ? "" : ",") + strRow;
+    }
+
+    db.ExecuteQueryInstant("INSERT INTO bench_tall VALUES %s", strBatch.c_str());
+
+    db.RegisterStatement(STMT_BENCH_TALL, "SELECT * FROM bench_tall");
+    db.RegisterStatement(STMT_BENCH_WIDE, "SELECT * FROM bench_wide");
+    return true;
+}
+
+// Touches every cell through the getters, the string columns just give 0.
+static uint64 DecodeAll(QueryResult& result)
+{
+    uint64 uiSum = 0;
+    const uint32 uiFields = result.getFieldCount();
+
+    do
+    {
+        const DbField* pFields = result.fetchCurrentRow();
+
+        for (uint32 i = 0; i < uiFields; ++i)
+            uiSum += pFields[i].getLength() + uint64(pFields[i].getInt64());
+    }
+    while (result.NextRow());
+
+    return uiSum;
+}
+
+// Fetch and NextRow/DbField decode of a wide and a tall result, from text queries and prepared statements.
+static void BenchResultDecode(Database& db)
+{
+    const uint32 uiRuns = 5;
+
+    struct Shape { const char* name; const char* table; uint32 statement; uint64 rows; uint32 columns; };
+    const Shape shapes[] = { { "wide", "bench_wide", STMT_BENCH_WIDE, BENCH_WIDE_ROWS, BENCH_WIDE_COLUMNS }, { "tall", "bench_tall", STMT_BENCH_TALL, BENCH_TALL_ROWS, 4 } };
+
+    for (const Shape& shape : shapes)
+    {
+        for (uint32 uiPrepared = 0; uiPrepared < 2; ++uiPrepared)
+        {
+            std::vector<int64> vFetchNs;
+            std::vector<int64> vDecodeNs;
+            int64 iDecodeTotal = 0;
+            volatile uint64 uiSink = 0;
+
+            for (uint32 uiRun = 0; uiRun < uiRuns; ++uiRun)
+            {
+                const int64 iStart = NowNs();
+                std::shared_ptr<QueryResult> result = uiPrepared ? db.QueryStatement(PreparedStatement(shape.statement)) : db.Query("SELECT * FROM %s", shape.table);
+                const int64 iFetched = NowNs();
+
+                if (!result)
+                {
+                    fprintf(stderr, "result_decode: no rows from %s\n", shape.table);
+                    return;
+                }
+
+                uiSink = uiSink + DecodeAll(*result);
+
+                vFetchNs.push_back(iFetched - iStart);
+                vDecodeNs.push_back(NowNs() - iFetched);
+                iDecodeTotal += vDecodeNs.back();
+            }
+
+            const std::string strParams = std::string("\"shape\":\"") + shape.name + "\",\"protocol\":\"" + (uiPrepared ? "binary" : "text") +
+                                          "\",\"columns\":" + std::to_string(shape.columns) + ",\"rows_per_result\":" + std::to_string(shape.rows) + ",\"sample\":\"whole result\",";
+
+            // ops are cells, so ops_per_sec is the decode rate.
+            Report("result_fetch", strParams, uiRuns, 0, vFetchNs);
+            Report("result_decode", strParams, uint64(uiRuns) * shape.rows * shape.columns, iDecodeTotal, vDecodeNs);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s \"host;port;user;pw;dbname\" [name filter] [pool size]\n", argv[0]);
+        return 1;
+    }
+
+    const char* filter = argc > 2 && *argv[2] ? argv[2] : nullptr;
+    const uint32 uiPoolSize = argc > 3 ? uint32(atoi(argv[3])) : 4;
+
+    if (Wanted(filter, "dbfield_decode"))
+    {
+        fprintf(stderr, "dbfield_decode...\n");
+        BenchDbFieldDecode();
+    }
+
+    if (Wanted(filter, "safequeue_contention"))
+    {
+        fprintf(stderr, "safequeue_contention...\n");
+        BenchSafeQueue();
+    }
+
+    const bool bQueue = Wanted(filter, "queue_enqueue") || Wanted(filter, "queue_throughput");
+    const bool bContention = Wanted(filter, "query_contention");
+    const bool bCallback = Wanted(filter, "callback_turnaround");
+    const bool bResult = Wanted(filter, "result_fetch") || Wanted(filter, "result_decode");
+
+    if (!bQueue && !bContention && !bCallback && !bResult)
+        return 0;
+
+    Database db;
+
+    if (!db.Initialize(argv[1], uiPoolSize ? uiPoolSize : 1))
+    {
+        fprintf(stderr, "Could not connect.\n");
+        return 1;
+    }
+
+    if (bQueue)
+    {
+        fprintf(stderr, "queue_enqueue, queue_throughput...\n");
+        BenchQueueExecute(db);
+    }
+
+    if (bContention)
+    {
+        fprintf(stderr, "query_contention...\n");
+        BenchQueryContention(db);
+    }
+
+    if (bCallback)
+    {
+        fprintf(stderr, "callback_turnaround...\n");
+        BenchCallbackTurnaround(db);
+    }
+
+    if (bResult)
+    {
+        fprintf(stderr, "Filling bench_wide and bench_tall...\n");
+
+        if (CreateTables(db))
+            BenchResultDecode(db);
+        else
+            fprintf(stderr, "Could not create the tables.\n");
+
+        db.ExecuteQueryInstant("DROP TABLE IF EXISTS bench_wide");
+        db.ExecuteQueryInstant("DROP TABLE IF EXISTS bench_tall");
+    }
+
+    db.Uninitialise();
+    return 0;
+}